@@ -30,6 +30,9 @@ BEGIN_DECLS
  *
  * If dbuf_put() reaches the end of its buffer, it will refuse further
  * writes until dbuf_get() swaps buffers.
+ *
+ * A dbuf is not safe for a producer and consumer running concurrently
+ * on different cores; use a spsc_ring instead.
  */
 struct dbuf;
 
@@ -40,6 +43,22 @@ struct dbuf;
  */
 struct dbuf *dbuf_init(size_t size) __attribute__((warn_unused_result));
 
+/**
+ * Allocates a mirrored dbuf with capacity in bytes given by size,
+ * rounded up to a multiple of the page size.
+ *
+ * Rather than a pair of swapped buffers, a mirrored dbuf is a ring
+ * whose storage is mapped twice, back to back, so that every readable
+ * (or writable) region is contiguous regardless of where it wraps. Up
+ * to the full capacity may be passed to dbuf_reserve(), dbuf_peek(),
+ * dbuf_put_n() or dbuf_get_n() in a single span.
+ *
+ * NOTE: maps 2 * size bytes of address space backed by size bytes of
+ * memory. Returns NULL if the platform does not support memfd_create.
+ */
+struct dbuf *dbuf_init_mirrored(size_t size)
+    __attribute__((warn_unused_result));
+
 /**
  * Copies the first readable byte of dbuf into byte.
  *
@@ -56,8 +75,125 @@ bool dbuf_get(struct dbuf *dbuf, uint8_t *byte) __attribute__((nonnull));
 bool dbuf_put(struct dbuf *dbuf, uint8_t byte) __attribute__((nonnull));
 
 /**
- * Frees memory allocated for dbuf during dbuf_init().
+ * Copies up to n bytes from src into dbuf.
+ *
+ * Returns the number of bytes written, which is less than n if dbuf
+ * does not have enough writable capacity.
+ */
+size_t dbuf_put_n(struct dbuf *dbuf, const uint8_t *src, size_t n)
+    __attribute__((nonnull));
+
+/**
+ * Copies up to n readable bytes of dbuf into dst, swapping buffers as
+ * needed.
+ *
+ * Returns the number of bytes read, which is less than n if fewer
+ * than n bytes were readable.
+ */
+size_t dbuf_get_n(struct dbuf *dbuf, uint8_t *dst, size_t n)
+    __attribute__((nonnull));
+
+/**
+ * Returns a pointer to the contiguous writable region of dbuf, and
+ * stores its length in len, without copying.
+ *
+ * Returns NULL (and stores 0 in len) if dbuf has no writable
+ * capacity. Bytes written to the region are not readable until they
+ * are published with dbuf_commit().
+ */
+uint8_t *dbuf_reserve(struct dbuf *dbuf, size_t *len)
+    __attribute__((nonnull, warn_unused_result));
+
+/**
+ * Publishes the first n bytes of the region returned by the last call
+ * to dbuf_reserve(). n must not exceed the reserved length.
+ */
+void dbuf_commit(struct dbuf *dbuf, size_t n) __attribute__((nonnull));
+
+/**
+ * Returns a pointer to the contiguous readable region of dbuf, and
+ * stores its length in len, without copying. Swaps buffers if the
+ * read buffer is exhausted.
+ *
+ * Returns NULL (and stores 0 in len) if no bytes are readable. The
+ * region remains valid until it is released with dbuf_consume().
+ */
+const uint8_t *dbuf_peek(struct dbuf *dbuf, size_t *len)
+    __attribute__((nonnull, warn_unused_result));
+
+/**
+ * Releases the first n bytes of the region returned by the last call
+ * to dbuf_peek(). n must not exceed the peeked length.
+ */
+void dbuf_consume(struct dbuf *dbuf, size_t n) __attribute__((nonnull));
+
+/**
+ * Frees memory allocated for dbuf during dbuf_init() or
+ * dbuf_init_mirrored().
  */
 void dbuf_deinit(struct dbuf *dbuf) __attribute__((nonnull));
 
+/**
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * Unlike dbuf, a spsc_ring may be shared between a producer and a
+ * consumer running concurrently on different cores. Exactly one
+ * thread may call spsc_ring_put()/spsc_ring_put_n(), and exactly one
+ * (other) thread may call spsc_ring_get()/spsc_ring_get_n().
+ */
+struct spsc_ring;
+
+/**
+ * Allocates a spsc_ring with capacity in bytes of at least size,
+ * rounded up to the next power of two.
+ */
+struct spsc_ring *spsc_ring_init(size_t size)
+    __attribute__((warn_unused_result));
+
+/**
+ * Puts a byte in ring. Returns true if the byte was written, false if
+ * ring has no writable capacity.
+ *
+ * Must only be called by the producer.
+ */
+bool spsc_ring_put(struct spsc_ring *ring, uint8_t byte)
+    __attribute__((nonnull));
+
+/**
+ * Copies up to n bytes from src into ring.
+ *
+ * Returns the number of bytes written, which is less than n if ring
+ * does not have enough writable capacity.
+ *
+ * Must only be called by the producer.
+ */
+size_t spsc_ring_put_n(struct spsc_ring *ring, const uint8_t *src, size_t n)
+    __attribute__((nonnull));
+
+/**
+ * Copies the first readable byte of ring into byte.
+ *
+ * Returns true if there was a readable byte, false otherwise.
+ *
+ * Must only be called by the consumer.
+ */
+bool spsc_ring_get(struct spsc_ring *ring, uint8_t *byte)
+    __attribute__((nonnull));
+
+/**
+ * Copies up to n readable bytes of ring into dst.
+ *
+ * Returns the number of bytes read, which is less than n if fewer
+ * than n bytes were readable.
+ *
+ * Must only be called by the consumer.
+ */
+size_t spsc_ring_get_n(struct spsc_ring *ring, uint8_t *dst, size_t n)
+    __attribute__((nonnull));
+
+/**
+ * Frees memory allocated for ring during spsc_ring_init().
+ */
+void spsc_ring_deinit(struct spsc_ring *ring) __attribute__((nonnull));
+
 END_DECLS
@@ -19,7 +19,7 @@
 #pragma once
 
 #include <portable/macros.h>
-#include <portable/stdbool.h>
+#include <portable/system.h>
 
 BEGIN_DECLS
 
@@ -34,12 +34,359 @@ typedef enum {
     LOG_DEBUG   /* Debug-level messages */
 } log_level_t;
 
-/* max length of log messages */
+/*
+ * Calls of the logging macros less severe than LOG_COMPILE_LEVEL are
+ * removed by the preprocessor, and cost nothing at runtime. Since #if
+ * cannot see enumerators, it must be defined as the integer value of
+ * a log_level_t (e.g. -DLOG_COMPILE_LEVEL=4 to keep LOG_WARN and more
+ * severe) before this header is included. By default, none are.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#    define LOG_COMPILE_LEVEL 7 /* LOG_DEBUG */
+#endif
+
+/* max length of log messages formatted on the stack */
 #define LOG_MAX_LEN 256
 
+/*
+ * Max length of text messages, which are formatted again in a
+ * per-thread buffer if they do not fit in LOG_MAX_LEN. Binary and
+ * structured messages are truncated to LOG_MAX_LEN.
+ */
+#define LOG_MAX_LONG_LEN (64 * 1024)
+
 /* maximum acceptable length of a log filename */
 #define LOG_MAX_FILENAME 255
 
+/* default period of buffered output flushes, in milliseconds */
+#define LOG_FLUSH_MS 1000
+
+/*
+ * Minimum period of "suppressed N messages" reports, in milliseconds.
+ * Counts still pending are reported by log_flush() and log_deinit().
+ */
+#define LOG_SUPPRESSED_MS 1000
+
+/* number of buckets of the latency histogram of log_stats() */
+#define LOG_LATENCY_BUCKETS 32
+
+/* maximum number of stack frames output by log_backtrace() */
+#define LOG_BACKTRACE_SIZE 64
+
+/* maximum number of sinks added by log_add_sink() */
+#define LOG_MAX_SINKS 8
+
+/* default path of the local syslog socket */
+#define LOG_SYSLOG_PATH "/dev/log"
+
+/* default path of the systemd-journald native protocol socket */
+#define LOG_JOURNAL_PATH "/run/systemd/journal/socket"
+
+/* resolution of the fractional seconds in message timestamps */
+typedef enum {
+    LOG_PRECISION_MSEC, /* milliseconds */
+    LOG_PRECISION_USEC, /* microseconds */
+    LOG_PRECISION_NSEC  /* nanoseconds */
+} log_precision_t;
+
+/* source of message timestamps */
+typedef enum {
+    LOG_CLOCK_DEFAULT,         /* the cheapest adequate realtime clock */
+    LOG_CLOCK_REALTIME,        /* CLOCK_REALTIME */
+    LOG_CLOCK_REALTIME_COARSE, /* CLOCK_REALTIME_COARSE, where available */
+    LOG_CLOCK_MONOTONIC,       /* CLOCK_MONOTONIC, offset to wall time */
+    LOG_CLOCK_TSC              /* the CPU cycle counter, see below */
+} log_clock_t;
+
+/* encoding of log output */
+typedef enum {
+    LOG_FORMAT_TEXT,   /* formatted text lines */
+    LOG_FORMAT_BINARY, /* deferred-format binary records, see log-decode */
+    LOG_FORMAT_LOGFMT, /* logfmt lines of ts, level, file, line and msg */
+    LOG_FORMAT_JSON    /* JSON objects of the same fields, one per line */
+} log_format_t;
+
+/* behavior of asynchronous logging when the queue is full */
+typedef enum {
+    LOG_OVERFLOW_BLOCK, /* wait for the writer thread to make room */
+    LOG_OVERFLOW_DROP   /* discard the message and count it as dropped */
+} log_overflow_t;
+
+/**
+ * Logging module configuration. Zero-initialized fields select the
+ * default behavior.
+ */
+struct log_options {
+    log_level_t     level;     /* see log_init() */
+    char *          filename;  /* see log_init() */
+    log_precision_t precision; /* timestamp resolution */
+
+    /*
+     * Source of timestamps. LOG_CLOCK_MONOTONIC and LOG_CLOCK_TSC are
+     * offset to the wall time at log_init_opts(), and so never step
+     * backwards, but do not follow later changes of the system time.
+     * LOG_CLOCK_TSC reads the invariant cycle counter of x86-64 or
+     * AArch64 without a system call or vDSO; it is calibrated for
+     * 10ms by log_init_opts() and then continually against
+     * CLOCK_MONOTONIC. Elsewhere, it is LOG_CLOCK_MONOTONIC.
+     */
+    log_clock_t clock;
+
+    /*
+     * In LOG_FORMAT_BINARY, each call site of the logging macros
+     * outputs its file, line and format once; each message then
+     * outputs only the site, a raw timestamp and the raw arguments.
+     * log-decode formats a binary log as text.
+     *
+     * In LOG_FORMAT_LOGFMT and LOG_FORMAT_JSON, the timestamp, level,
+     * file, line and message of each message are output as fields,
+     * followed by any fields of log_kv().
+     */
+    log_format_t format;
+
+    /*
+     * If non-zero, messages are formatted by the caller and queued
+     * for a dedicated writer thread, which writes them in batches.
+     * The queue holds at least this many messages.
+     */
+    size_t         async;
+    log_overflow_t overflow; /* behavior when the queue is full */
+
+    /*
+     * If non-zero (and async is zero), messages are appended to an
+     * in-memory buffer of this many bytes, which is written when it
+     * fills, when a message at LOG_CRIT or more severe is logged, on
+     * log_flush(), and at least every flush_ms milliseconds
+     * (LOG_FLUSH_MS if zero).
+     */
+    size_t   buffer;
+    unsigned flush_ms;
+
+    /*
+     * If non-zero, the log file is preallocated and memory-mapped in
+     * extents of this many bytes (rounded up to the page size), and
+     * messages are copied into the map without system calls; async,
+     * buffer and rotation do not apply. Until log_deinit() truncates
+     * it, the file is followed by up to an extent of zeros.
+     */
+    size_t mmap;
+
+    /*
+     * If either is non-zero, the log file is rotated by a dedicated
+     * thread once rotate_size bytes are written to it, or every
+     * rotate_secs seconds: it is renamed to filename.1 (shifting
+     * older files up to filename.<rotate_keep>, 1 if zero), and
+     * logging continues to a new file without blocking writers.
+     */
+    size_t   rotate_size;
+    unsigned rotate_secs;
+    unsigned rotate_keep;
+
+    /*
+     * If non-zero, each thread records its recent messages at every
+     * level, including those below the log level, in a ring of this
+     * many bytes. The rings are dumped to the log by
+     * log_recorder_dump(), on a failed assertion (with --enable-panic)
+     * and on fatal signals (SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT).
+     */
+    size_t recorder;
+
+    /*
+     * If true, the latency of each message is added to the histogram
+     * of log_stats(), at the cost of reading the clock once more.
+     */
+    bool latency;
+
+    /*
+     * If non-zero (and the format is not LOG_FORMAT_BINARY), a message
+     * identical to the one before it, but for its timestamp, is not
+     * output but counted, and the count is output as "last message
+     * repeated N times" before the next different message, on
+     * log_flush(), and on the first repeat once the first unreported
+     * repeat is dedup_ms milliseconds old. Messages are then output
+     * under a lock. Nothing reports repeats on a timer: repeats
+     * followed by silence are reported only by log_flush() or
+     * log_deinit(), so call log_flush() periodically if they must
+     * appear within dedup_ms.
+     */
+    unsigned dedup_ms;
+
+    /*
+     * If true (and the format is not LOG_FORMAT_BINARY), each message
+     * is tagged with the id of the calling thread, its name if it has
+     * one (see log_set_thread_name()), and the CPU it runs on: as
+     * "[tid name cpu]" after the timestamp in LOG_FORMAT_TEXT, or as
+     * tid, thread and cpu fields. Ids and names are cached per thread,
+     * and the CPU is read without a system call where the C library
+     * supports it.
+     */
+    bool thread;
+};
+
+/**
+ * Logging statistics, since the process started.
+ */
+struct log_stats {
+    /* messages logged, indexed by level */
+    uint64_t messages[LOG_DEBUG + 1];
+
+    uint64_t bytes;      /* bytes output to the log and to sinks */
+    uint64_t errors;     /* failed writes, and other errors */
+    uint64_t truncated;  /* messages truncated, see LOG_MAX_LONG_LEN */
+    uint64_t dropped;    /* messages dropped, as by log_dropped() */
+    uint64_t suppressed; /* messages suppressed by rate limiting */
+
+    /*
+     * Messages by the time taken to format and output them, if
+     * log_options.latency: bucket i counts those that took from 2^i
+     * to 2^(i+1) nanoseconds (the first also counts faster ones, and
+     * the last slower ones).
+     */
+    uint64_t latency[LOG_LATENCY_BUCKETS];
+};
+
+/*
+ * Module of the call sites compiled after it is defined, for
+ * log_set_module_level(). If NULL, the module of a site is the
+ * basename of its source file without extensions (e.g. "buffer" for
+ * src/buffer.c).
+ */
+#ifndef LOG_MODULE
+#    define LOG_MODULE NULL
+#endif
+
+/**
+ * Per-call-site state, defined statically by the logging macros.
+ *
+ * All fields other than file, line and module are private to the
+ * logging module.
+ */
+struct log_site {
+    const char *     file;       /* source file (const) */
+    int              line;       /* source line (const) */
+    const char *     module;     /* LOG_MODULE (const) */
+    int              level;      /* level admitted by the macros */
+    int              output;     /* level of the site's module */
+    bool             registered; /* level is resolved */
+    struct log_site *next;       /* next registered site */
+    uint32_t         id;         /* binary log site id, 0 until registered */
+    uint32_t         session;    /* binary log session of the site record */
+    const char *     fmt;        /* registered format */
+    const void *     spec;       /* parsed format */
+};
+
+/* until its first message registers it, a site admits every level */
+#define LOG_SITE_INIT                                                 \
+    {                                                                 \
+        __FILE__, __LINE__, LOG_MODULE, LOG_DEBUG, LOG_DEBUG, false,  \
+            NULL, 0, 0, NULL, NULL                                    \
+    }
+
+/**
+ * Per-call-site state of the rate-limited logging macros. Private to
+ * the logging module.
+ */
+struct log_limit {
+    uint64_t          count;      /* calls, for log_every_n() etc. */
+    uint64_t          tat;        /* token bucket, for log_ratelimited() */
+    uint64_t          suppressed; /* calls suppressed since the last report */
+    uint64_t          reported;   /* time of the last report, in ns */
+    struct log_limit *next;       /* next limit with suppressed calls */
+    struct log_site * site;       /* site of the limit, once listed */
+    int               level;      /* level of the last suppressed call */
+    bool              listed;     /* the limit is in the list */
+};
+
+#define LOG_LIMIT_INIT                   \
+    {                                    \
+        0, 0, 0, 0, NULL, NULL, 0, false \
+    }
+
+/* outputs added by log_add_sink() */
+typedef enum {
+    LOG_SINK_FD,     /* an open file descriptor, e.g. STDERR_FILENO */
+    LOG_SINK_FILE,   /* a file opened for appending, optionally buffered */
+    LOG_SINK_MMAP,   /* a preallocated, memory-mapped file */
+    LOG_SINK_SYSLOG, /* the local syslog socket, in RFC 5424 */
+    LOG_SINK_JOURNAL /* the journald socket, in its native protocol */
+} log_sink_type_t;
+
+/**
+ * Options of log_add_sink().
+ */
+struct log_sink_options {
+    log_sink_type_t type;
+    log_level_t     level; /* least severe level output by the sink */
+
+    int fd; /* LOG_SINK_FD, which is not closed by log_deinit() */
+
+    /*
+     * The file of LOG_SINK_FILE and LOG_SINK_MMAP, or the socket of
+     * LOG_SINK_SYSLOG (LOG_SYSLOG_PATH if NULL) and LOG_SINK_JOURNAL
+     * (LOG_JOURNAL_PATH if NULL).
+     */
+    const char *filename;
+
+    /*
+     * For LOG_SINK_FILE, the size of its buffer, as for the buffer
+     * option of log_init_opts(); unbuffered if zero. For
+     * LOG_SINK_MMAP, its extent size, as for the mmap option.
+     *
+     * For LOG_SINK_SYSLOG and LOG_SINK_JOURNAL, the number of
+     * datagrams (at most 1024) batched and sent by one sendmmsg(2)
+     * when the batch fills, when a message at LOG_CRIT or more severe
+     * is logged, on log_flush(), and at least every LOG_FLUSH_MS;
+     * each message is sent as it is logged if zero.
+     */
+    size_t buffer;
+    size_t mmap;
+
+    /*
+     * The APP-NAME of LOG_SINK_SYSLOG, and SYSLOG_IDENTIFIER of
+     * LOG_SINK_JOURNAL; the program name if NULL.
+     */
+    const char *ident;
+
+    unsigned dedup_ms; /* as the dedup_ms option of log_init_opts() */
+};
+
+/* types of struct log_kv fields */
+typedef enum {
+    LOG_KV_STR,   /* string, quoted and escaped as needed */
+    LOG_KV_INT,   /* signed integer */
+    LOG_KV_UINT,  /* unsigned integer */
+    LOG_KV_BOOL,  /* true or false */
+    LOG_KV_DUR_US /* duration in microseconds, with a "us" suffix in text */
+} log_kv_type_t;
+
+/**
+ * A field of a structured message, see log_kv(). Use the LOG_STR(),
+ * LOG_INT(), LOG_UINT(), LOG_BOOL() and LOG_DUR_US() initializers,
+ * whose keys must be string literals: they are output verbatim, and
+ * must not need quoting or escaping.
+ */
+struct log_kv {
+    const char *  key;    /* field name */
+    size_t        keylen; /* length of key */
+    log_kv_type_t type;
+    union {
+        const char *       s;
+        long long          i;
+        unsigned long long u;
+    } value;
+};
+
+#define _LOG_KV(_key, _type, _member, _value)                          \
+    {                                                                  \
+        "" _key, sizeof("" _key) - 1, (_type), { ._member = (_value) } \
+    }
+
+#define LOG_STR(_key, _s) _LOG_KV(_key, LOG_KV_STR, s, (_s))
+#define LOG_INT(_key, _i) _LOG_KV(_key, LOG_KV_INT, i, (_i))
+#define LOG_UINT(_key, _u) _LOG_KV(_key, LOG_KV_UINT, u, (_u))
+#define LOG_BOOL(_key, _b) _LOG_KV(_key, LOG_KV_BOOL, i, (_b) ? 1 : 0)
+#define LOG_DUR_US(_key, _us) _LOG_KV(_key, LOG_KV_DUR_US, i, (_us))
+
 /**
  * Initializes the logging module.
  *
@@ -58,21 +405,156 @@ typedef enum {
  */
 bool log_init(log_level_t level, char *filename);
 
+/**
+ * Initializes the logging module with the provided options, as
+ * log_init() does with default options.
+ *
+ * In asynchronous or buffered mode, log_deinit() writes any pending
+ * messages before returning, as does process exit.
+ */
+bool log_init_opts(const struct log_options *opts) __attribute__((nonnull));
+
 /**
  * Returns true of the logging module is currently configured to emit
- * messages at the provided level, false otherwise.
+ * messages at the provided level, to the log or to any sink, false
+ * otherwise.
  */
 bool log_loggable(log_level_t level);
 
+/*
+ * The level set by log_init() or log_set_level(), for modules without
+ * an override. Read-only, and changed atomically.
+ */
+extern log_level_t log_threshold;
+
+/**
+ * Sets the level of modules without an override, as log_init() does,
+ * at any time. Calls already past their level check complete at the
+ * old level; later calls see the new one.
+ */
+void log_set_level(log_level_t level);
+
+/**
+ * Opt-in signal hooks to change the level at run time: signal up
+ * raises the level one step towards LOG_DEBUG (more verbose), and
+ * signal down lowers it one step towards LOG_EMERG, as by
+ * log_set_level(). For example, log_level_signals(SIGUSR1, SIGUSR2).
+ *
+ * The handlers only write to a pipe; the change is made by a helper
+ * thread, started by the first call. Returns false if the handlers
+ * cannot be installed or the thread started.
+ */
+bool log_level_signals(int up, int down);
+
+/**
+ * Sets the level of the call sites in module, overriding the level
+ * set by log_init() until log_clear_module_level(). The module of a
+ * site is described by LOG_MODULE. Note log_debug() messages are
+ * only compiled with ENABLE_DEBUG.
+ *
+ * Returns false if the override could not be allocated.
+ */
+bool log_set_module_level(const char *module, log_level_t level)
+    __attribute__((nonnull));
+
+/**
+ * Removes the level override of module, if any.
+ */
+void log_clear_module_level(const char *module) __attribute__((nonnull));
+
 /**
  * Output a message via the logging module with a newline appended.
  *
  * Module users should typically use one of the helper macros, rather
  * than calling this function directly.
  */
+void log_write_level(log_level_t level, const char *file, int line,
+                     const char *msg, ...)
+    __attribute__((nonnull, format(printf, 4, 5)));
+
+/**
+ * Output a message like log_write_level(), at the level of the log
+ * (log_threshold). Kept for callers built before log_write_level(),
+ * which check log_loggable() themselves.
+ */
 void log_write(const char *file, int line, const char *msg, ...)
     __attribute__((nonnull, format(printf, 3, 4)));
 
+/**
+ * Output a message logged at site via the logging module, with a
+ * newline appended.
+ *
+ * This is called by the helper macros; module users should not call
+ * it directly.
+ */
+void log_write_site(struct log_site *site, log_level_t level,
+                    const char *msg, ...)
+    __attribute__((nonnull, format(printf, 3, 4)));
+
+/**
+ * Output the message msg, which is not a format, logged at site via
+ * the logging module, followed by the n fields of kv. In
+ * LOG_FORMAT_TEXT and LOG_FORMAT_BINARY, the fields follow the
+ * message in logfmt.
+ *
+ * This is called by log_kv(); module users should not call it
+ * directly.
+ */
+void log_write_kv(struct log_site *site, log_level_t level, const char *msg,
+                  const struct log_kv *kv, size_t n) __attribute__((nonnull));
+
+/**
+ * Output a message like log_write_level(), but async-signal-safely, so it
+ * may be called from a signal handler: the message is formatted on the
+ * stack without libc formatting, locks or allocation, and written
+ * directly to the log file (or stderr), bypassing asynchronous and
+ * buffered output and sinks; the timestamp reads CLOCK_REALTIME.
+ *
+ * Only %s, %c, %d, %i, %u, %x, %X, %p and %% are formatted, with the
+ * l, ll and z length modifiers and a precision for %s; flags and widths
+ * are ignored. The rest of the format, from any other conversion, is
+ * output as is.
+ *
+ * This is called by log_signal_safe(), which module users should call
+ * instead.
+ */
+void log_write_signal_safe(log_level_t level, const char *file, int line,
+                           const char *msg, ...)
+    __attribute__((nonnull(2, 4), format(printf, 4, 5)));
+
+/**
+ * Output the stack of the calling thread at level, as
+ * log_write_signal_safe() does. In LOG_FORMAT_TEXT, frames are
+ * symbolized by backtrace_symbols_fd(); otherwise, each frame is a
+ * message of its address.
+ *
+ * This is called by log_backtrace(), which module users should call
+ * instead.
+ */
+void log_backtrace_signal_safe(log_level_t level, const char *file,
+                               int line) __attribute__((nonnull));
+
+/**
+ * Return true if a message at level from site passes its limit, and
+ * report calls suppressed by it. These are called by the rate-limited
+ * helper macros; module users should not call them directly.
+ */
+bool log_limit_every_n(struct log_site *site, struct log_limit *limit,
+                       log_level_t level, uint64_t n)
+    __attribute__((nonnull));
+bool log_limit_first_n(struct log_site *site, struct log_limit *limit,
+                       log_level_t level, uint64_t n)
+    __attribute__((nonnull));
+bool log_limit_rate(struct log_site *site, struct log_limit *limit,
+                    log_level_t level, uint64_t per_sec)
+    __attribute__((nonnull));
+
+/**
+ * Writes any messages pending in asynchronous or buffered mode.
+ * Returns once messages logged before the call have been written.
+ */
+void log_flush(void);
+
 /**
  * Output a message to stderr with a newline appended.
  */
@@ -85,69 +567,207 @@ void log_stderr(const char *msg, ...)
 void log_stdout(const char *msg, ...)
     __attribute__((nonnull, format(printf, 1, 2)));
 
+/**
+ * Returns the number of messages dropped because the asynchronous
+ * queue was full.
+ */
+uint64_t log_dropped(void);
+
+/**
+ * Fills stats with the logging statistics. Counters are kept per
+ * thread, so counting adds no contention; this sums them.
+ */
+void log_stats(struct log_stats *stats) __attribute__((nonnull));
+
+/**
+ * Reopens the log file by name, e.g. after it is renamed by an
+ * external log rotation tool. Writers are never blocked: with
+ * rotation configured, the file is opened by the rotator thread;
+ * otherwise, only async-signal-safe calls are made. Either way, it
+ * is safe to call from a signal handler, such as for SIGHUP.
+ */
+void log_reopen(void);
+
+/**
+ * Sets the name of the calling thread in messages tagged by the thread
+ * option of log_init_opts(), or if NULL, reverts to the name set by
+ * pthread_setname_np(), if any. Characters that would need quoting
+ * are replaced by '_', and names are truncated to 15 characters.
+ */
+void log_set_thread_name(const char *name);
+
+/**
+ * Adds an output of messages at opts->level or more severe, alongside
+ * the log set up by log_init_opts(), until log_deinit(). Each message
+ * is formatted once, and then written to the log and to each sink
+ * whose level it passes; sinks are written by the calling thread.
+ * Module levels (see log_set_module_level()) apply to the log only.
+ * LOG_SINK_SYSLOG and LOG_SINK_JOURNAL send LOG_FORMAT_TEXT messages
+ * without their timestamp, which is in the header of the datagram.
+ * Returns false if the sink cannot be opened, if LOG_MAX_SINKS are
+ * already added, or in LOG_FORMAT_BINARY.
+ */
+bool log_add_sink(const struct log_sink_options *opts)
+    __attribute__((nonnull));
+
+/**
+ * Outputs the messages recorded by the flight recorder, oldest first
+ * for each thread, after any pending messages. Does nothing unless
+ * the recorder option is set.
+ */
+void log_recorder_dump(void);
+
 /**
  * Deinitializes the logging module, releasing any resources allocated
  * during log_init().
  */
 void log_deinit(void);
 
-#define log_emerg(...)                                  \
-    do {                                                \
-        if (log_loggable(LOG_EMERG)) {                  \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
-    } while (0)
+/*
+ * True if the static struct log_site _site admits _level, hinted as
+ * unlikely. The level is loaded relaxed, as a single plain load, since
+ * log_set_level() and the like store it concurrently.
+ */
+#define _log_admits(_site, _level)                                          \
+    __builtin_expect(                                                       \
+        (int)(_level) <= __atomic_load_n(&(_site).level, __ATOMIC_RELAXED), \
+        0)
 
-#define log_alert(...)                                  \
-    do {                                                \
-        if (log_loggable(LOG_ALERT)) {                  \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
+/*
+ * Logs a message at _level from a call site with its own static
+ * struct log_site. The level check is inline, against the level of
+ * the site's module, and hinted as unlikely so that the call is laid
+ * out off the fast path.
+ */
+#define _log_at(_level, ...)                                   \
+    do {                                                       \
+        static struct log_site _log_site = LOG_SITE_INIT;      \
+        if (_log_admits(_log_site, _level)) {                  \
+            log_write_site(&_log_site, (_level), __VA_ARGS__); \
+        }                                                      \
     } while (0)
 
-#define log_crit(...)                                   \
-    do {                                                \
-        if (log_loggable(LOG_CRIT)) {                   \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
-    } while (0)
+#if LOG_COMPILE_LEVEL >= 0
+#    define log_emerg(...) _log_at(LOG_EMERG, __VA_ARGS__)
+#else
+#    define log_emerg(...)
+#endif
+
+#if LOG_COMPILE_LEVEL >= 1
+#    define log_alert(...) _log_at(LOG_ALERT, __VA_ARGS__)
+#else
+#    define log_alert(...)
+#endif
+
+#if LOG_COMPILE_LEVEL >= 2
+#    define log_crit(...) _log_at(LOG_CRIT, __VA_ARGS__)
+#else
+#    define log_crit(...)
+#endif
+
+#if LOG_COMPILE_LEVEL >= 3
+#    define log_error(...) _log_at(LOG_ERR, __VA_ARGS__)
+#else
+#    define log_error(...)
+#endif
+
+#if LOG_COMPILE_LEVEL >= 4
+#    define log_warn(...) _log_at(LOG_WARN, __VA_ARGS__)
+#else
+#    define log_warn(...)
+#endif
+
+#if LOG_COMPILE_LEVEL >= 5
+#    define log_notice(...) _log_at(LOG_NOTICE, __VA_ARGS__)
+#else
+#    define log_notice(...)
+#endif
 
-#define log_error(...)                                  \
-    do {                                                \
-        if (log_loggable(LOG_ERR)) {                    \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
+#if LOG_COMPILE_LEVEL >= 6
+#    define log_info(...) _log_at(LOG_INFO, __VA_ARGS__)
+#else
+#    define log_info(...)
+#endif
+
+/*
+ * Logs a message at _level from a call site with its own static
+ * struct log_site and struct log_limit, if _limit(site, limit, level,
+ * _arg) passes it. Messages suppressed by the limit are not formatted.
+ */
+#define _log_limited(_level, _limit, _arg, ...)                     \
+    do {                                                            \
+        static struct log_site  _log_site = LOG_SITE_INIT;          \
+        static struct log_limit _log_limit = LOG_LIMIT_INIT;        \
+        if ((int)(_level) <= LOG_COMPILE_LEVEL                      \
+            && _log_admits(_log_site, _level)                       \
+            && _limit(&_log_site, &_log_limit, (_level), (_arg))) { \
+            log_write_site(&_log_site, (_level), __VA_ARGS__);      \
+        }                                                           \
     } while (0)
 
-#define log_warn(...)                                   \
-    do {                                                \
-        if (log_loggable(LOG_WARN)) {                   \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
+/*
+ * Log the 1st, (_n + 1)th, (2 * _n + 1)th ... call at _level.
+ */
+#define log_every_n(_level, _n, ...) \
+    _log_limited(_level, log_limit_every_n, _n, __VA_ARGS__)
+
+/*
+ * Log the first _n calls at _level.
+ */
+#define log_first_n(_level, _n, ...) \
+    _log_limited(_level, log_limit_first_n, _n, __VA_ARGS__)
+
+/*
+ * Log calls at _level at an average of at most _per_sec per second,
+ * in bursts of at most _per_sec.
+ */
+#define log_ratelimited(_level, _per_sec, ...) \
+    _log_limited(_level, log_limit_rate, _per_sec, __VA_ARGS__)
+
+/*
+ * Log the message _msg at _level, followed by structured fields, e.g.
+ *
+ *     log_kv(LOG_INFO, "request", LOG_STR("path", path),
+ *            LOG_INT("status", status), LOG_DUR_US("lat", us));
+ *
+ * Nothing is formatted with printf. At least one field is required.
+ */
+#define log_kv(_level, _msg, ...)                                       \
+    do {                                                                \
+        static struct log_site _log_site = LOG_SITE_INIT;               \
+        if ((int)(_level) <= LOG_COMPILE_LEVEL                          \
+            && _log_admits(_log_site, _level)) {                        \
+            const struct log_kv _log_fields[] = {__VA_ARGS__};          \
+            log_write_kv(&_log_site, (_level), (_msg), _log_fields,     \
+                         sizeof(_log_fields) / sizeof(_log_fields[0])); \
+        }                                                               \
     } while (0)
 
-#define log_notice(...)                                 \
-    do {                                                \
-        if (log_loggable(LOG_NOTICE)) {                 \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
+/*
+ * Log a message at _level from a signal handler; see
+ * log_write_signal_safe().
+ */
+#define log_signal_safe(_level, ...)                            \
+    do {                                                        \
+        if ((int)(_level) <= LOG_COMPILE_LEVEL) {               \
+            log_write_signal_safe((_level), __FILE__, __LINE__, \
+                                  __VA_ARGS__);                 \
+        }                                                       \
     } while (0)
 
-#define log_info(...)                                   \
-    do {                                                \
-        if (log_loggable(LOG_INFO)) {                   \
-            log_write(__FILE__, __LINE__, __VA_ARGS__); \
-        }                                               \
+/*
+ * Log the stack of the calling thread at _level, async-signal-safely.
+ */
+#define log_backtrace(_level)                                        \
+    do {                                                             \
+        if ((int)(_level) <= LOG_COMPILE_LEVEL) {                    \
+            log_backtrace_signal_safe((_level), __FILE__, __LINE__); \
+        }                                                            \
     } while (0)
 
-#ifdef ENABLE_DEBUG
+#if defined(ENABLE_DEBUG) && LOG_COMPILE_LEVEL >= 7
 
-#    define log_debug(_level, ...)                          \
-        do {                                                \
-            if (log_loggable(_level)) {                     \
-                log_write(__FILE__, __LINE__, __VA_ARGS__); \
-            }                                               \
-        } while (0)
+#    define log_debug(_level, ...) _log_at(_level, __VA_ARGS__)
 
 #else /* !ENABLE_DEBUG */
 
@@ -29,6 +29,23 @@
 #    endif
 #endif
 
+/*
+ * __builtin_expect is a branch prediction hint; other compilers simply
+ * evaluate the expression.
+ */
+#if !defined(__GNUC__) && !defined(__builtin_expect)
+#    define __builtin_expect(exp, c) (exp)
+#endif
+
+/*
+ * __atomic_load_n with __ATOMIC_RELAXED is a plain load on the targets
+ * of other compilers.
+ */
+#if !defined(__GNUC__) && !defined(__atomic_load_n)
+#    define __ATOMIC_RELAXED      0
+#    define __atomic_load_n(p, m) (*(p))
+#endif
+
 /*
  * BEGIN_DECLS is used at the beginning of declarations so that C++
  * compilers don't mangle their names.  END_DECLS is used at the end.
@@ -21,8 +21,8 @@
 
 #include "assert.h"
 
+#include "log-private.h"
 #include "util-private.h"
-#include "xmalloc.h"
 
 /* number of stack frames to capture */
 #define BACKTRACE_SIZE 64
@@ -32,6 +32,7 @@ _assert(const char *cond, const char *file, int line, bool panic)
 {
     log_error("assert '%s' failed @ (%s, %d)", cond, file, line);
     if (panic) {
+        log_recorder_crash();
         stacktrace(1);
         abort();
     }
@@ -41,25 +42,17 @@ void
 stacktrace(int skip)
 {
 #ifdef HAVE_BACKTRACE
-    void * stack[BACKTRACE_SIZE];
-    char **symbols;
-    int    size;
-    int    i;
-    int    j;
+    void *stack[BACKTRACE_SIZE];
+    int   size;
 
     size = backtrace(stack, BACKTRACE_SIZE);
-    symbols = backtrace_symbols(stack, size);
-    if (symbols == NULL) {
-        return;
-    }
 
     skip++; /* skip this frame */
 
-    for (i = skip, j = 0; i < size; i++, j++) {
-        log_stderr("[%d] %s", j, symbols[i]);
+    /* unlike backtrace_symbols(), does not allocate */
+    if (skip < size) {
+        backtrace_symbols_fd(stack + skip, size - skip, STDERR_FILENO);
     }
-
-    xfree(symbols);
 #else
     UNUSED(skip);
 #endif /* !HAVE_BACKTRACE */
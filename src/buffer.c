@@ -16,7 +16,13 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <util/buffer.h>
+#include <util/log.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#    include <sys/mman.h>
+#endif
 
 #include "assert.h"
 #include "util-private.h"
@@ -24,6 +30,7 @@
 
 #if !defined NDEBUG
 #    define DBUF_MAGIC 0xdeadbeef
+#    define RING_MAGIC 0xfeedface
 #endif
 
 /**
@@ -47,6 +54,11 @@
  * buffer. If any unread bytes exists in the write buffer, the two
  * buffers are swapped.
  *
+ * dbuf_reserve()/dbuf_commit() expose the region from dbuf->last to
+ * the end of the write buffer directly, and dbuf_peek()/dbuf_consume()
+ * expose the region from dbuf->pos to dbuf->limit, so that callers
+ * may fill or drain either buffer without an intermediate copy.
+ *
  * +-------------------------------------------+
  * |        dbuf data        |   dbuf header   |
  * +-------------------------|  (struct dbuf)  |
@@ -69,13 +81,39 @@ struct dbuf {
 #if !defined NDEBUG
     uint32_t magic; /* dbuf magic (const) */
 #endif
-    uint8_t *pos;   /* read marker */
-    uint8_t *limit; /* read limit */
-    uint8_t *last;  /* write marker */
-    uint8_t *read;  /* start of read buffer */
-    uint8_t *write; /* start of write buffer */
+    uint8_t *pos;    /* read marker */
+    uint8_t *limit;  /* read limit */
+    uint8_t *last;   /* write marker */
+    uint8_t *read;   /* start of read buffer */
+    uint8_t *write;  /* start of write buffer */
+    size_t   mirror; /* capacity if mirrored, 0 otherwise (const) */
 };
 
+/**
+ * Mirrored dbuf mechanics:
+ *
+ * A mirrored dbuf maps the same capacity bytes of a memfd twice, back
+ * to back, so that any span starting within the first mapping may
+ * extend up to capacity bytes into the second and remain contiguous.
+ *
+ * dbuf->read points to the first byte of the first mapping, and
+ * dbuf->write and dbuf->limit are unused. The header is allocated
+ * separately, since the mappings are page-granular.
+ *
+ * dbuf->pos always lies within the first mapping, and dbuf->last lies
+ * between dbuf->pos and dbuf->pos + capacity. When dbuf->pos advances
+ * into the second mapping, both markers are moved back by capacity
+ * bytes, which refer to the same memory.
+ *
+ * +-----------------------------------------------+
+ * |   first mapping       |   second mapping      |
+ * +-----------------------------------------------+
+ * ^          ^            ^         ^
+ * |          \            |         \
+ * \          dbuf->pos    \         dbuf->last
+ *  dbuf->read              dbuf->read + dbuf->mirror
+ */
+
 UTIL_EXPORT struct dbuf *
 dbuf_init(size_t size)
 {
@@ -103,13 +141,104 @@ dbuf_init(size_t size)
     return dbuf;
 }
 
+UTIL_EXPORT struct dbuf *
+dbuf_init_mirrored(size_t size)
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+    struct dbuf *dbuf;
+    uint8_t *    buf;
+    size_t       page;
+    int          fd;
+
+    page = (size_t)sysconf(_SC_PAGESIZE);
+
+    /* both mappings, rounded up, must fit in a size_t */
+    if (size > SIZE_MAX / 2 - page) {
+        log_error("mirrored dbuf of %zu bytes is too large", size);
+        return NULL;
+    }
+    size = size == 0 ? page : (size + page - 1) / page * page;
+
+    dbuf = xzalloc(sizeof(struct dbuf));
+    if (dbuf == NULL) {
+        return NULL;
+    }
+
+    fd = memfd_create("dbuf", MFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("memfd_create failed: %s", strerror(errno));
+        goto fail_fd;
+    }
+
+    if (ftruncate(fd, (off_t)size) < 0) {
+        log_error("ftruncate(%zu) failed: %s", size, strerror(errno));
+        goto fail_map;
+    }
+
+    /* reserve address space for both mappings */
+    buf = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        log_error("mmap(%zu) failed: %s", size * 2, strerror(errno));
+        goto fail_map;
+    }
+
+    if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+             0) == MAP_FAILED
+        || mmap(buf + size, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        log_error("mirroring mmap(%zu) failed: %s", size, strerror(errno));
+        munmap(buf, size * 2);
+        goto fail_map;
+    }
+
+    close(fd);
+
+#    if !defined NDEBUG
+    dbuf->magic = DBUF_MAGIC;
+#    endif
+
+    dbuf->read = buf;
+    dbuf->pos = buf;
+    dbuf->last = buf;
+    dbuf->mirror = size;
+
+    return dbuf;
+
+fail_map:
+    close(fd);
+fail_fd:
+    xfree(dbuf);
+    return NULL;
+#else
+    UNUSED(size);
+
+    log_error("mirrored dbuf requires memfd_create");
+    return NULL;
+#endif /* !HAVE_MEMFD_CREATE || !HAVE_SYS_MMAN_H */
+}
+
+/*
+ * Returns the end of the writable region, which is either buffer b
+ * (if dbuf->write == buffer a) or the dbuf header (if dbuf->write ==
+ * buffer b), or one capacity past the read marker if mirrored.
+ */
+static inline uint8_t *
+_dbuf_write_end(struct dbuf *dbuf)
+{
+    if (dbuf->mirror) {
+        return dbuf->pos + dbuf->mirror;
+    }
+
+    return dbuf->write < dbuf->read ? dbuf->read : (uint8_t *)dbuf;
+}
+
 UTIL_EXPORT bool
 dbuf_put(struct dbuf *dbuf, uint8_t byte)
 {
     ASSERT(dbuf->magic == DBUF_MAGIC);
 
     /* out of writable capacity, wait for reader */
-    if (dbuf->last == dbuf->read || dbuf->last == (uint8_t *)dbuf) {
+    if (dbuf->last == _dbuf_write_end(dbuf)) {
         return false;
     }
 
@@ -119,6 +248,50 @@ dbuf_put(struct dbuf *dbuf, uint8_t byte)
     return true;
 }
 
+UTIL_EXPORT size_t
+dbuf_put_n(struct dbuf *dbuf, const uint8_t *src, size_t n)
+{
+    size_t avail;
+
+    ASSERT(dbuf->magic == DBUF_MAGIC);
+
+    avail = (size_t)(_dbuf_write_end(dbuf) - dbuf->last);
+    if (n > avail) {
+        n = avail;
+    }
+
+    /*
+     * Call to memcpy is insecure as it does not provide security
+     * checks introduced in the C11 standard
+     */
+    memcpy(dbuf->last, src, n); /* NOLINT */
+    dbuf->last += n;
+
+    return n;
+}
+
+UTIL_EXPORT uint8_t *
+dbuf_reserve(struct dbuf *dbuf, size_t *len)
+{
+    ASSERT(dbuf->magic == DBUF_MAGIC);
+
+    *len = (size_t)(_dbuf_write_end(dbuf) - dbuf->last);
+    if (*len == 0) {
+        return NULL; /* out of writable capacity, wait for reader */
+    }
+
+    return dbuf->last;
+}
+
+UTIL_EXPORT void
+dbuf_commit(struct dbuf *dbuf, size_t n)
+{
+    ASSERT(dbuf->magic == DBUF_MAGIC);
+    ASSERT(n <= (size_t)(_dbuf_write_end(dbuf) - dbuf->last));
+
+    dbuf->last += n;
+}
+
 static void
 _dbuf_swap(struct dbuf *dbuf)
 {
@@ -132,37 +305,286 @@ _dbuf_swap(struct dbuf *dbuf)
     dbuf->last = dbuf->write;
 }
 
+/*
+ * Returns the number of contiguous readable bytes at dbuf->pos,
+ * swapping buffers if the read buffer is exhausted.
+ */
+static inline size_t
+_dbuf_readable(struct dbuf *dbuf)
+{
+    if (dbuf->mirror) {
+        return (size_t)(dbuf->last - dbuf->pos);
+    }
+
+    /* empty/exhausted read buffer, unread bytes in the write buffer */
+    if (dbuf->limit == dbuf->pos && dbuf->last > dbuf->write) {
+        _dbuf_swap(dbuf);
+    }
+
+    return (size_t)(dbuf->limit - dbuf->pos);
+}
+
+/*
+ * Advances the read marker by n bytes, moving both markers back into
+ * the first mapping of a mirrored dbuf.
+ */
+static inline void
+_dbuf_advance(struct dbuf *dbuf, size_t n)
+{
+    dbuf->pos += n;
+
+    if (dbuf->mirror && dbuf->pos >= dbuf->read + dbuf->mirror) {
+        dbuf->pos -= dbuf->mirror;
+        dbuf->last -= dbuf->mirror;
+    }
+}
+
 UTIL_EXPORT bool
 dbuf_get(struct dbuf *dbuf, uint8_t *byte)
 {
     ASSERT(dbuf->magic == DBUF_MAGIC);
 
-    if (dbuf->limit > dbuf->pos ||  /* unread bytes in the read buffer */
-        dbuf->last > dbuf->write) { /* unread bytes in the write buffer */
+    if (_dbuf_readable(dbuf) == 0) {
+        /*
+         * nothing has been written to either buffer since the last
+         * read.
+         */
+        return false;
+    }
 
-        /* empty/exhausted read buffer */
-        if (dbuf->limit == dbuf->pos) {
-            _dbuf_swap(dbuf);
-        }
+    *byte = *dbuf->pos;
+    _dbuf_advance(dbuf, 1);
+
+    return true;
+}
 
-        *byte = *dbuf->pos;
-        ++dbuf->pos;
+UTIL_EXPORT size_t
+dbuf_get_n(struct dbuf *dbuf, uint8_t *dst, size_t n)
+{
+    size_t total = 0;
+    size_t avail;
 
-        return true;
-    }
+    ASSERT(dbuf->magic == DBUF_MAGIC);
 
     /*
-     * nothing has been written to either buffer since the last read.
+     * At most two copies are needed: the remainder of the read
+     * buffer, then the contents of the write buffer after a swap. A
+     * mirrored dbuf needs only one.
      */
-    return false;
+    while (total < n) {
+        avail = _dbuf_readable(dbuf);
+        if (avail == 0) {
+            break; /* nothing written since the last read */
+        }
+
+        if (avail > n - total) {
+            avail = n - total;
+        }
+
+        memcpy(dst + total, dbuf->pos, avail); /* NOLINT */
+        _dbuf_advance(dbuf, avail);
+        total += avail;
+    }
+
+    return total;
+}
+
+UTIL_EXPORT const uint8_t *
+dbuf_peek(struct dbuf *dbuf, size_t *len)
+{
+    ASSERT(dbuf->magic == DBUF_MAGIC);
+
+    *len = _dbuf_readable(dbuf);
+    if (*len == 0) {
+        return NULL; /* nothing written since the last read */
+    }
+
+    return dbuf->pos;
+}
+
+UTIL_EXPORT void
+dbuf_consume(struct dbuf *dbuf, size_t n)
+{
+    ASSERT(dbuf->magic == DBUF_MAGIC);
+    ASSERT(n <= (size_t)(dbuf->mirror ? dbuf->last - dbuf->pos
+                                      : dbuf->limit - dbuf->pos));
+
+    _dbuf_advance(dbuf, n);
 }
 
 UTIL_EXPORT void
 dbuf_deinit(struct dbuf *dbuf)
 {
+    if (dbuf->mirror) {
+        munmap(dbuf->read, dbuf->mirror * 2);
+        xfree(dbuf);
+        return;
+    }
+
     if (dbuf->read < dbuf->write) {
         xfree(dbuf->read);
     } else {
         xfree(dbuf->write);
     }
 }
+
+/**
+ * SPSC ring mechanics:
+ *
+ * ring->head and ring->tail are free-running byte counters; the
+ * number of readable bytes is always ring->tail - ring->head, and a
+ * counter maps to an offset in ring->data by masking with ring->mask.
+ *
+ * Only the consumer stores to ring->head, and only the producer
+ * stores to ring->tail. Each side publishes its counter with a
+ * release store after copying data, and loads the other side's
+ * counter with an acquire load, so bytes are never observed before
+ * they are written (or overwritten before they are read).
+ *
+ * Each side keeps a private cache of the other side's counter,
+ * refreshed only when the cached value indicates the ring is full
+ * (producer) or empty (consumer). The two halves live on separate
+ * cache lines, so neither core writes to a line the other reads on
+ * the fast path.
+ *
+ * +------------------------------------------------------+
+ * |  header   |  consumer line  |  producer line  | data |
+ * |  (const)  |  head           |  tail           |      |
+ * |           |  tail_cache     |  head_cache     |      |
+ * +------------------------------------------------------+
+ */
+struct spsc_ring {
+#if !defined NDEBUG
+    uint32_t magic; /* ring magic (const) */
+#endif
+    size_t   mask; /* capacity - 1 (const) */
+    uint8_t *data; /* start of ring data (const) */
+
+    /* consumer-owned */
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE))); /* read count */
+    size_t tail_cache; /* consumer's copy of tail */
+
+    /* producer-owned */
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE))); /* write count */
+    size_t head_cache; /* producer's copy of head */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+UTIL_EXPORT struct spsc_ring *
+spsc_ring_init(size_t size)
+{
+    struct spsc_ring *ring;
+    size_t            cap = 1;
+
+    while (cap < size) {
+        cap <<= 1;
+        if (cap == 0) {
+            return NULL; /* overflow */
+        }
+    }
+
+    ring = xmemalign(CACHE_LINE_SIZE, sizeof(struct spsc_ring) + cap);
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(struct spsc_ring)); /* NOLINT */
+
+#if !defined NDEBUG
+    ring->magic = RING_MAGIC;
+#endif
+
+    ring->mask = cap - 1;
+    ring->data = (uint8_t *)(ring + 1);
+
+    return ring;
+}
+
+UTIL_EXPORT bool
+spsc_ring_put(struct spsc_ring *ring, uint8_t byte)
+{
+    return spsc_ring_put_n(ring, &byte, 1) == 1;
+}
+
+UTIL_EXPORT size_t
+spsc_ring_put_n(struct spsc_ring *ring, const uint8_t *src, size_t n)
+{
+    size_t tail;
+    size_t avail;
+    size_t off;
+    size_t first;
+
+    ASSERT(ring->magic == RING_MAGIC);
+
+    tail = ring->tail; /* only the producer stores to tail */
+    avail = ring->mask + 1 - (tail - ring->head_cache);
+
+    if (avail < n) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        avail = ring->mask + 1 - (tail - ring->head_cache);
+    }
+
+    if (n > avail) {
+        n = avail;
+    }
+
+    off = tail & ring->mask;
+    first = ring->mask + 1 - off;
+    if (first > n) {
+        first = n;
+    }
+
+    memcpy(ring->data + off, src, first);       /* NOLINT */
+    memcpy(ring->data, src + first, n - first); /* NOLINT */
+
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+UTIL_EXPORT bool
+spsc_ring_get(struct spsc_ring *ring, uint8_t *byte)
+{
+    return spsc_ring_get_n(ring, byte, 1) == 1;
+}
+
+UTIL_EXPORT size_t
+spsc_ring_get_n(struct spsc_ring *ring, uint8_t *dst, size_t n)
+{
+    size_t head;
+    size_t avail;
+    size_t off;
+    size_t first;
+
+    ASSERT(ring->magic == RING_MAGIC);
+
+    head = ring->head; /* only the consumer stores to head */
+    avail = ring->tail_cache - head;
+
+    if (avail < n) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        avail = ring->tail_cache - head;
+    }
+
+    if (n > avail) {
+        n = avail;
+    }
+
+    off = head & ring->mask;
+    first = ring->mask + 1 - off;
+    if (first > n) {
+        first = n;
+    }
+
+    memcpy(dst, ring->data + off, first);       /* NOLINT */
+    memcpy(dst + first, ring->data, n - first); /* NOLINT */
+
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+UTIL_EXPORT void
+spsc_ring_deinit(struct spsc_ring *ring)
+{
+    xfree(ring);
+}
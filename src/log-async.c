@@ -0,0 +1,432 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "assert.h"
+#include "log-private.h"
+#include "util-private.h"
+#include "xmalloc.h"
+#include "xwrite.h"
+
+/* size of the writer thread's batch buffer */
+#define BATCH_SIZE (64 * 1024)
+
+#if LOG_MAX_LONG_LEN > BATCH_SIZE
+#    error "a batch must hold the longest message"
+#endif
+
+/* upper bound on how long the writer thread sleeps, in milliseconds */
+#define IDLE_MS 100
+
+/**
+ * Asynchronous queue mechanics:
+ *
+ * The queue is a bounded multi-producer/single-consumer ring of
+ * fixed-size slots, each able to hold one formatted message. Each
+ * slot carries a sequence number, which tells a producer whether the
+ * slot is free for the current lap of the ring and tells the consumer
+ * whether the slot has been filled.
+ *
+ * Producers claim a slot by advancing q->tail with a CAS, copy their
+ * message into it, and publish it with a release store of its
+ * sequence number. The writer thread consumes slots in order, copying
+ * them into a batch buffer that is written with a single write(2)
+ * once the queue is empty or the batch is full.
+ *
+ * An idle writer thread sleeps for at most IDLE_MS. Producers wake it
+ * early only if it is asleep and the queue is a quarter full, so the
+ * mutex and condition variables stay off the fast path and messages
+ * are written in large batches.
+ *
+ * A message longer than LOG_MAX_LEN is copied to the heap, and its
+ * slot holds a pointer to the copy, so it is written in order with
+ * the rest of the queue.
+ */
+struct slot {
+    size_t   seq;               /* sequence number */
+    uint32_t len;               /* message length */
+    char     buf[LOG_MAX_LEN];  /* formatted message, or pointer to it */
+};
+
+static struct queue {
+    struct slot *  slots;    /* slot storage (const) */
+    char *         batch;    /* writer thread's batch buffer (const) */
+    size_t         mask;     /* number of slots - 1 (const) */
+    log_overflow_t overflow; /* full queue behavior (const) */
+    int            fd;       /* output file descriptor (const) */
+
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE))); /* producers */
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE))); /* consumer */
+
+    size_t   written;  /* value of head after the last write */
+    uint64_t dropped;  /* messages dropped on a full queue */
+    int      sleeping; /* writer thread is (about to be) asleep */
+    int      waiting;  /* producers waiting for space */
+    int      stop;     /* writer thread should exit */
+
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;  /* signals the writer thread */
+    pthread_cond_t  space; /* signals blocked producers */
+    bool            running;
+} queue;
+
+/*
+ * Waits on cond for at most ms milliseconds. q->lock must be held.
+ */
+static void
+_log_async_wait(pthread_cond_t *cond, long ms)
+{
+    struct queue *  q = &queue;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(cond, &q->lock, &ts);
+}
+
+/*
+ * Returns the message in slot.
+ */
+static const char *
+_log_async_message(const struct slot *slot)
+{
+    char *msg;
+
+    if (slot->len <= LOG_MAX_LEN) {
+        return slot->buf;
+    }
+
+    memcpy(&msg, slot->buf, sizeof(msg)); /* NOLINT */
+    return msg;
+}
+
+/*
+ * Frees the slot at the head of the queue for the producer one lap
+ * ahead, and its message's heap copy, if any.
+ */
+static void
+_log_async_release(struct slot *slot)
+{
+    struct queue *q = &queue;
+
+    if (slot->len > LOG_MAX_LEN) {
+        free((char *)_log_async_message(slot));
+    }
+
+    __atomic_store_n(&slot->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copies as many queued messages as fit into batch, returning the
+ * number of bytes copied.
+ */
+static size_t
+_log_async_drain(char *batch, size_t size)
+{
+    struct queue *q = &queue;
+    struct slot * slot;
+    size_t        len = 0;
+
+    for (;;) {
+        slot = &q->slots[q->head & q->mask];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1) {
+            break; /* empty, or the next slot is still being filled */
+        }
+
+        if (len + slot->len > size) {
+            break; /* batch is full */
+        }
+
+        memcpy(batch + len, _log_async_message(slot), slot->len); /* NOLINT */
+        len += slot->len;
+
+        _log_async_release(slot);
+    }
+
+    return len;
+}
+
+static void *
+_log_async_run(void *arg)
+{
+    struct queue *q = &queue;
+    size_t        len;
+
+    UNUSED(arg);
+
+    for (;;) {
+        len = _log_async_drain(q->batch, BATCH_SIZE);
+
+        if (len > 0) {
+            if (xwrite(q->fd, q->batch, len) < 0) {
+                log_stats_error();
+            }
+
+            __atomic_store_n(&q->written, q->head, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&q->lock);
+                pthread_cond_broadcast(&q->space);
+                pthread_mutex_unlock(&q->lock);
+            }
+            continue;
+        }
+
+        if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+            break; /* stopped, and the queue is empty */
+        }
+
+        pthread_mutex_lock(&q->lock);
+        __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(&q->stop, __ATOMIC_SEQ_CST)) {
+            _log_async_wait(&q->wake, IDLE_MS);
+        }
+
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Wakes the writer thread if it is asleep.
+ */
+static void
+_log_async_wake(void)
+{
+    struct queue *q = &queue;
+
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->wake);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+bool
+log_async_start(int fd, size_t capacity, log_overflow_t overflow)
+{
+    struct queue *q = &queue;
+    size_t        n = 1;
+    size_t        i;
+    int           err;
+
+    ASSERT(!q->running);
+
+    /* rounding up at most doubles capacity, which must leave n slots */
+    if (capacity > SIZE_MAX / 2 / sizeof(struct slot)) {
+        log_stderr("starting log writer failed: queue of %zu is too large",
+                   capacity);
+        return false;
+    }
+
+    while (n < capacity) {
+        n <<= 1;
+    }
+
+    q->slots = xmemalign(CACHE_LINE_SIZE, n * sizeof(struct slot));
+    if (q->slots == NULL) {
+        return false;
+    }
+
+    q->batch = xmalloc(BATCH_SIZE);
+    if (q->batch == NULL) {
+        xfree(q->slots);
+        return false;
+    }
+
+    for (i = 0; i < n; i++) {
+        q->slots[i].seq = i;
+    }
+
+    q->mask = n - 1;
+    q->overflow = overflow;
+    q->fd = fd;
+    q->tail = 0;
+    q->head = 0;
+    q->written = 0;
+    q->dropped = 0;
+    q->sleeping = 0;
+    q->waiting = 0;
+    q->stop = 0;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    pthread_cond_init(&q->space, NULL);
+
+    err = pthread_create(&q->thread, NULL, _log_async_run, NULL);
+    if (err != 0) {
+        log_stderr("starting log writer thread failed: %s", strerror(err));
+        pthread_cond_destroy(&q->space);
+        pthread_cond_destroy(&q->wake);
+        pthread_mutex_destroy(&q->lock);
+        xfree(q->batch);
+        xfree(q->slots);
+        return false;
+    }
+
+    q->running = true;
+
+    return true;
+}
+
+bool
+log_async_push(const char *buf, size_t len)
+{
+    struct queue *q = &queue;
+    struct slot * slot;
+    char *        copy = NULL;
+    size_t        pos;
+    size_t        seq;
+
+    if (len > LOG_MAX_LEN) {
+        /* malloc() rather than xmalloc(), which may log */
+        copy = malloc(len);
+        if (copy == NULL) {
+            log_stats_error();
+            return false;
+        }
+        memcpy(copy, buf, len); /* NOLINT */
+    }
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            /* slot is free for this lap; try to claim it */
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            /* queue is full */
+            if (q->overflow == LOG_OVERFLOW_DROP) {
+                __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+                free(copy);
+                return false;
+            }
+
+            _log_async_wake();
+
+            pthread_mutex_lock(&q->lock);
+            __atomic_fetch_add(&q->waiting, 1, __ATOMIC_SEQ_CST);
+            _log_async_wait(&q->space, 10);
+            __atomic_fetch_sub(&q->waiting, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&q->lock);
+
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        } else {
+            /* another producer claimed the slot; retry */
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (copy != NULL) {
+        memcpy(slot->buf, &copy, sizeof(copy)); /* NOLINT */
+    } else {
+        memcpy(slot->buf, buf, len); /* NOLINT */
+    }
+    slot->len = (uint32_t)len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    /* wake the writer thread once the queue is a quarter full */
+    if (pos - __atomic_load_n(&q->head, __ATOMIC_RELAXED)
+        >= (q->mask + 1) / 4) {
+        _log_async_wake();
+    }
+
+    return true;
+}
+
+void
+log_async_flush(void)
+{
+    struct queue *q = &queue;
+    size_t        target;
+
+    if (!q->running) {
+        return;
+    }
+
+    target = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+
+    while ((ptrdiff_t)(__atomic_load_n(&q->written, __ATOMIC_SEQ_CST)
+                       - target)
+           < 0) {
+        pthread_mutex_lock(&q->lock);
+        __atomic_fetch_add(&q->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&q->wake);
+        _log_async_wait(&q->space, 10);
+        __atomic_fetch_sub(&q->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+void
+log_async_stop(void)
+{
+    struct queue *q = &queue;
+
+    if (!q->running) {
+        return;
+    }
+
+    __atomic_store_n(&q->stop, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->thread, NULL);
+
+    pthread_cond_destroy(&q->space);
+    pthread_cond_destroy(&q->wake);
+    pthread_mutex_destroy(&q->lock);
+
+    xfree(q->batch);
+    xfree(q->slots);
+    q->batch = NULL;
+    q->slots = NULL;
+    q->running = false;
+}
+
+uint64_t
+log_async_dropped(void)
+{
+    return __atomic_load_n(&queue.dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,259 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <pthread.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-fmt.h"
+#include "log-private.h"
+#include "util-private.h"
+
+/**
+ * Binary log mechanics:
+ *
+ * The first time a call site logs in a session, it is registered: its
+ * format is parsed into a struct log_spec, it is assigned an id, and
+ * a LOG_REC_SITE record carrying its file, line and format is output.
+ * Every message from the site is then output as a LOG_REC_EVENT
+ * record carrying only the site id, the raw timestamp and the raw
+ * argument bytes, and is formatted later by log-decode.
+ *
+ * A site whose format cannot be encoded (see log_fmt_parse()), or
+ * whose event does not fit in LOG_MAX_LEN bytes, falls back to a
+ * LOG_REC_TEXT record formatted by the caller.
+ *
+ * Registration is serialized by log_site_lock, and published with a
+ * release store of site->session, so the fast path is a single
+ * acquire load and compare.
+ */
+static pthread_mutex_t log_site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* next site id to assign */
+static uint32_t log_site_next = 1;
+
+/* current session, incremented by log_binary_start() */
+static uint32_t log_session = 0;
+
+/* size of a record header */
+#define REC_HDR sizeof(struct log_rec)
+
+static void
+_log_rec_hdr(char *buf, size_t len, enum log_rec_type type,
+             log_level_t level)
+{
+    struct log_rec rec;
+
+    rec.len = (uint16_t)len;
+    rec.type = (uint8_t)type;
+    rec.level = (uint8_t)level;
+
+    memcpy(buf, &rec, REC_HDR); /* NOLINT */
+}
+
+void
+log_binary_start(log_precision_t precision)
+{
+    char     buf[REC_HDR + 8];
+    uint32_t magic = LOG_BIN_MAGIC;
+
+    __atomic_add_fetch(&log_session, 1, __ATOMIC_RELEASE);
+
+    _log_rec_hdr(buf, sizeof(buf), LOG_REC_SESSION, LOG_EMERG);
+    memcpy(buf + REC_HDR, &magic, 4); /* NOLINT */
+    buf[REC_HDR + 4] = LOG_BIN_VERSION;
+    buf[REC_HDR + 5] = (char)precision;
+    buf[REC_HDR + 6] = (char)sizeof(long);
+    buf[REC_HDR + 7] = (char)sizeof(void *);
+
+    log_output(LOG_EMERG, buf, sizeof(buf));
+}
+
+/*
+ * Parses the format of site, with log_site_lock held, and assigns the
+ * site an id. Sites are parsed at most once per process; the spec is
+ * never freed.
+ */
+static void
+_log_binary_parse(struct log_site *site, const char *fmt)
+{
+    struct log_arg   args[LOG_FMT_MAX_ARGS];
+    struct log_spec *spec = NULL;
+    int              nargs;
+
+    nargs = log_fmt_parse(fmt, args, LOG_FMT_MAX_ARGS);
+    if (nargs >= 0) {
+        /* malloc() rather than xmalloc(), which may log */
+        spec = malloc(sizeof(struct log_spec)
+                      + sizeof(struct log_arg) * (size_t)nargs);
+    }
+    if (spec != NULL) {
+        spec->nargs = nargs;
+        memcpy(spec->args, args, sizeof(struct log_arg) * nargs); /* NOLINT */
+    }
+
+    site->spec = spec;
+    site->id = log_site_next++;
+    __atomic_store_n(&site->fmt, fmt, __ATOMIC_RELEASE);
+}
+
+const struct log_spec *
+log_binary_spec(struct log_site *site, const char *fmt)
+{
+    if (__atomic_load_n(&site->fmt, __ATOMIC_ACQUIRE) == NULL) {
+        pthread_mutex_lock(&log_site_lock);
+        if (site->fmt == NULL) {
+            _log_binary_parse(site, fmt);
+        }
+        pthread_mutex_unlock(&log_site_lock);
+    }
+
+    /* a different format at the same site is not encodable */
+    return site->fmt == fmt ? site->spec : NULL;
+}
+
+/*
+ * Registers site for the current session, parsing fmt the first time
+ * the site is seen, and outputs its LOG_REC_SITE record.
+ */
+static void
+_log_binary_register(struct log_site *site, log_level_t level,
+                     const char *fmt)
+{
+    uint32_t session;
+    size_t   flen;
+    size_t   mlen;
+    size_t   len;
+    char *   rec;
+
+    pthread_mutex_lock(&log_site_lock);
+
+    session = __atomic_load_n(&log_session, __ATOMIC_ACQUIRE);
+    if (site->session == session) {
+        pthread_mutex_unlock(&log_site_lock);
+        return; /* registered by another thread */
+    }
+
+    if (site->fmt == NULL) {
+        _log_binary_parse(site, fmt);
+    }
+
+    flen = strlen(site->file) + 1;
+    mlen = strlen(site->fmt) + 1;
+    len = REC_HDR + 8 + flen + mlen;
+
+    rec = len <= UINT16_MAX ? malloc(len) : NULL;
+    if (rec != NULL) {
+        _log_rec_hdr(rec, len, LOG_REC_SITE, level);
+        memcpy(rec + REC_HDR, &site->id, 4);               /* NOLINT */
+        memcpy(rec + REC_HDR + 4, &site->line, 4);         /* NOLINT */
+        memcpy(rec + REC_HDR + 8, site->file, flen);       /* NOLINT */
+        memcpy(rec + REC_HDR + 8 + flen, site->fmt, mlen); /* NOLINT */
+
+        log_output(level, rec, len);
+        free(rec);
+    } else {
+        site->spec = NULL; /* cannot be defined; always log text */
+    }
+
+    __atomic_store_n(&site->session, session, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&log_site_lock);
+}
+
+bool
+log_binary_event(struct log_site *site, log_level_t level,
+                 const struct timespec *ts, const char *fmt, va_list args)
+{
+    const struct log_spec *spec;
+    char                   buf[LOG_MAX_LEN];
+    size_t                 len;
+    int64_t                sec = ts->tv_sec;
+    uint32_t               nsec = (uint32_t)ts->tv_nsec;
+    int                    n;
+
+    if (__atomic_load_n(&site->session, __ATOMIC_ACQUIRE)
+        != __atomic_load_n(&log_session, __ATOMIC_RELAXED)) {
+        _log_binary_register(site, level, fmt);
+    }
+
+    spec = log_binary_spec(site, fmt);
+    if (spec == NULL) {
+        return false; /* not encodable */
+    }
+
+    len = REC_HDR;
+    memcpy(buf + len, &site->id, 4); /* NOLINT */
+    len += 4;
+    memcpy(buf + len, &sec, 8); /* NOLINT */
+    len += 8;
+    memcpy(buf + len, &nsec, 4); /* NOLINT */
+    len += 4;
+
+    n = log_fmt_encode(buf + len, sizeof(buf) - len, spec->args, spec->nargs,
+                       args);
+    if (n < 0) {
+        return false; /* does not fit; log as text */
+    }
+    len += (size_t)n;
+
+    _log_rec_hdr(buf, len, LOG_REC_EVENT, level);
+    log_output(level, buf, len);
+
+    return true;
+}
+
+void
+log_binary_text(log_level_t level, const char *file, int line,
+                const struct timespec *ts, const char *text, size_t tlen,
+                bool direct)
+{
+    char     buf[LOG_MAX_LEN];
+    size_t   len = REC_HDR;
+    size_t   flen;
+    int64_t  sec = ts->tv_sec;
+    uint32_t nsec = (uint32_t)ts->tv_nsec;
+    uint32_t uline = (uint32_t)line;
+
+    flen = strnlen(file, sizeof(buf) - REC_HDR - 17) + 1;
+
+    memcpy(buf + len, &sec, 8); /* NOLINT */
+    len += 8;
+    memcpy(buf + len, &nsec, 4); /* NOLINT */
+    len += 4;
+    memcpy(buf + len, &uline, 4); /* NOLINT */
+    len += 4;
+    memcpy(buf + len, file, flen - 1); /* NOLINT */
+    buf[len + flen - 1] = '\0';
+    len += flen;
+
+    if (tlen > sizeof(buf) - len) {
+        tlen = sizeof(buf) - len;
+    }
+    memcpy(buf + len, text, tlen); /* NOLINT */
+    len += tlen;
+
+    _log_rec_hdr(buf, len, LOG_REC_TEXT, level);
+
+    if (direct) {
+        log_output_direct(buf, len);
+    } else {
+        log_output(level, buf, len);
+    }
+}
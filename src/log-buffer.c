@@ -0,0 +1,364 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "util-private.h"
+#include "xmalloc.h"
+#include "xwrite.h"
+
+/**
+ * Buffered output mechanics:
+ *
+ * Formatted messages are appended to an in-memory buffer of b->size
+ * bytes, which is written with a single write(2) when the next
+ * message would not fit, when a message at LOG_CRIT or more severe
+ * is appended, on log_flush(), or by the flusher thread, which wakes
+ * every b->flush_ms milliseconds and writes whatever is buffered.
+ *
+ * A message larger than the whole buffer is written directly after
+ * flushing the buffer, so output order is preserved.
+ *
+ * A buffer started by log_buffer_start_batch() holds up to b->batch
+ * datagrams for a datagram socket, and also records where each ends;
+ * they are sent together by one sendmmsg(2), which also flushes the
+ * buffer once it holds b->batch datagrams.
+ */
+struct log_buffer {
+    char *   buf;      /* buffered messages */
+    size_t   size;     /* capacity of buf (const) */
+    size_t   len;      /* bytes buffered */
+    unsigned flush_ms; /* flusher thread period (const) */
+    int      fd;       /* output file descriptor (const) */
+    bool     stop;     /* flusher thread should exit */
+
+    /* batches of datagrams */
+    unsigned        batch; /* most datagrams buffered, 0 if a stream */
+    unsigned        count; /* datagrams buffered */
+    size_t *        ends;  /* offset of the end of each datagram */
+    struct iovec *  iov;   /* scratch for sending */
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr *msgs;  /* scratch for sending */
+#endif
+
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake; /* signals the flusher thread */
+};
+
+/*
+ * Sends a datagram of the n parts of iov.
+ */
+static void
+_log_buffer_sendv(int fd, const struct iovec *iov, int n)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg)); /* NOLINT */
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = (size_t)n;
+
+    while (sendmsg(fd, &msg, 0) < 0) {
+        if (errno != EINTR) {
+            log_stats_error();
+            return;
+        }
+    }
+}
+
+/*
+ * Sends the buffered datagrams, as few system calls as possible. A
+ * datagram that fails to send is dropped and counted as an error.
+ */
+static void
+_log_buffer_send(struct log_buffer *b)
+{
+    size_t   start = 0;
+    unsigned i;
+
+    for (i = 0; i < b->count; i++) {
+        b->iov[i].iov_base = b->buf + start;
+        b->iov[i].iov_len = b->ends[i] - start;
+        start = b->ends[i];
+    }
+
+#ifdef HAVE_SENDMMSG
+    for (i = 0; i < b->count; i++) {
+        memset(&b->msgs[i], 0, sizeof(b->msgs[i])); /* NOLINT */
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    i = 0;
+    while (i < b->count) {
+        int n = sendmmsg(b->fd, b->msgs + i, b->count - i, 0);
+
+        if (n > 0) {
+            i += (unsigned)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            /* skip the datagram that failed, and send the rest */
+            log_stats_error();
+            i++;
+        }
+    }
+#else
+    for (i = 0; i < b->count; i++) {
+        _log_buffer_sendv(b->fd, &b->iov[i], 1);
+    }
+#endif
+
+    b->count = 0;
+}
+
+/*
+ * Writes buffered messages to the output. b->lock must be held.
+ */
+static void
+_log_buffer_flush(struct log_buffer *b)
+{
+    if (b->len == 0) {
+        return;
+    }
+
+    if (b->batch > 0) {
+        _log_buffer_send(b);
+    } else if (xwrite(b->fd, b->buf, b->len) < 0) {
+        log_stats_error();
+    }
+
+    b->len = 0;
+}
+
+static void *
+_log_buffer_run(void *arg)
+{
+    struct log_buffer *b = arg;
+    struct timespec    ts;
+
+    pthread_mutex_lock(&b->lock);
+
+    while (!b->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += b->flush_ms / 1000;
+        ts.tv_nsec += (long)(b->flush_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&b->wake, &b->lock, &ts);
+
+        _log_buffer_flush(b);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+
+    return NULL;
+}
+
+/*
+ * Frees b and its buffers.
+ */
+static void
+_log_buffer_free(struct log_buffer *b)
+{
+#ifdef HAVE_SENDMMSG
+    if (b->msgs != NULL) {
+        xfree(b->msgs);
+    }
+#endif
+    if (b->iov != NULL) {
+        xfree(b->iov);
+    }
+    if (b->ends != NULL) {
+        xfree(b->ends);
+    }
+    if (b->buf != NULL) {
+        xfree(b->buf);
+    }
+    xfree(b);
+}
+
+/*
+ * Starts a buffer of size bytes, holding up to batch datagrams or, if
+ * batch is 0, a stream.
+ */
+static struct log_buffer *
+_log_buffer_start(int fd, size_t size, unsigned batch, unsigned flush_ms)
+{
+    struct log_buffer *b;
+    int                err;
+
+    b = xzalloc(sizeof(*b));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->buf = xmalloc(size);
+    if (b->buf == NULL) {
+        _log_buffer_free(b);
+        return NULL;
+    }
+
+    if (batch > 0) {
+        b->ends = xzalloc(batch * sizeof(*b->ends));
+        b->iov = xzalloc(batch * sizeof(*b->iov));
+#ifdef HAVE_SENDMMSG
+        b->msgs = xzalloc(batch * sizeof(*b->msgs));
+        if (b->msgs == NULL) {
+            _log_buffer_free(b);
+            return NULL;
+        }
+#endif
+        if (b->ends == NULL || b->iov == NULL) {
+            _log_buffer_free(b);
+            return NULL;
+        }
+    }
+
+    b->size = size;
+    b->len = 0;
+    b->flush_ms = flush_ms;
+    b->fd = fd;
+    b->stop = false;
+    b->batch = batch;
+    b->count = 0;
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->wake, NULL);
+
+    err = pthread_create(&b->thread, NULL, _log_buffer_run, b);
+    if (err != 0) {
+        log_stderr("starting log flusher thread failed: %s", strerror(err));
+        pthread_cond_destroy(&b->wake);
+        pthread_mutex_destroy(&b->lock);
+        _log_buffer_free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+struct log_buffer *
+log_buffer_start(int fd, size_t size, unsigned flush_ms)
+{
+    return _log_buffer_start(fd, size, 0, flush_ms);
+}
+
+struct log_buffer *
+log_buffer_start_batch(int fd, unsigned batch, size_t size,
+                       unsigned flush_ms)
+{
+    return _log_buffer_start(fd, size, batch, flush_ms);
+}
+
+void
+log_buffer_write(struct log_buffer *b, const char *buf, size_t len,
+                 bool flush)
+{
+    pthread_mutex_lock(&b->lock);
+
+    if (b->len + len > b->size) {
+        _log_buffer_flush(b);
+    }
+
+    if (len > b->size) {
+        if (xwrite(b->fd, buf, len) < 0) {
+            log_stats_error();
+        }
+    } else {
+        memcpy(b->buf + b->len, buf, len); /* NOLINT */
+        b->len += len;
+    }
+
+    if (flush || b->len == b->size) {
+        _log_buffer_flush(b);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+}
+
+void
+log_buffer_send(struct log_buffer *b, const struct iovec *iov, int n,
+                bool flush)
+{
+    size_t len = 0;
+    int    i;
+
+    for (i = 0; i < n; i++) {
+        len += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&b->lock);
+
+    if (b->len + len > b->size || b->count == b->batch) {
+        _log_buffer_flush(b);
+    }
+
+    if (len > b->size) {
+        _log_buffer_sendv(b->fd, iov, n);
+    } else {
+        for (i = 0; i < n; i++) {
+            memcpy(b->buf + b->len, iov[i].iov_base, /* NOLINT */
+                   iov[i].iov_len);
+            b->len += iov[i].iov_len;
+        }
+        b->ends[b->count++] = b->len;
+    }
+
+    if (flush || b->count == b->batch) {
+        _log_buffer_flush(b);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+}
+
+void
+log_buffer_flush(struct log_buffer *b)
+{
+    pthread_mutex_lock(&b->lock);
+    _log_buffer_flush(b);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void
+log_buffer_stop(struct log_buffer *b)
+{
+    pthread_mutex_lock(&b->lock);
+    b->stop = true;
+    pthread_cond_signal(&b->wake);
+    pthread_mutex_unlock(&b->lock);
+
+    pthread_join(b->thread, NULL);
+
+    _log_buffer_flush(b);
+
+    pthread_cond_destroy(&b->wake);
+    pthread_mutex_destroy(&b->lock);
+
+    _log_buffer_free(b);
+}
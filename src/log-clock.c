@@ -0,0 +1,324 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <portable/system.h>
+#include <time.h>
+#include <util/log.h>
+
+#if defined(__x86_64__)
+#    include <cpuid.h>
+#endif
+
+#include "log-private.h"
+#include "util-private.h"
+
+/**
+ * Timestamp clock mechanics:
+ *
+ * LOG_CLOCK_MONOTONIC reads CLOCK_MONOTONIC and adds the offset of
+ * CLOCK_REALTIME from it at log_clock_start(), so timestamps are wall
+ * times that never step backwards.
+ *
+ * LOG_CLOCK_TSC reads the CPU cycle counter (rdtsc on x86-64, cntvct_el0
+ * on AArch64) and converts the ticks since an anchor to nanoseconds as
+ * (ticks * mult) >> 32, added to the wall time of the anchor. The first
+ * mult is calibrated against CLOCK_MONOTONIC over CALIBRATE_MS. Once a
+ * reading is ANCHOR_SECS past the anchor, the reading thread (if no
+ * other is already) reanchors at the current CLOCK_MONOTONIC, and
+ * recalibrates mult over the whole interval since log_clock_start(),
+ * so its error shrinks as the process runs. The anchor is published
+ * under a sequence lock, so readers take no lock.
+ *
+ * Without an invariant counter, LOG_CLOCK_TSC falls back to
+ * LOG_CLOCK_MONOTONIC.
+ */
+
+#define NSEC_PER_SEC 1000000000LL
+
+/* period of the first calibration of LOG_CLOCK_TSC */
+#define CALIBRATE_MS 10
+
+/* period of reanchoring LOG_CLOCK_TSC, in seconds */
+#define ANCHOR_SECS 1
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#    define HAVE_TSC 1
+
+/* products of ticks and mult */
+__extension__ typedef unsigned __int128 uint128_t;
+#endif
+
+static struct {
+    log_clock_t type;   /* LOG_CLOCK_TSC, or the type of id */
+    clockid_t   id;     /* clock read, unless LOG_CLOCK_TSC */
+    int64_t     offset; /* nanoseconds from readings of id to wall time */
+
+    /* LOG_CLOCK_TSC */
+    uint64_t tsc0;   /* ticks at log_clock_start() */
+    int64_t  mono0;  /* CLOCK_MONOTONIC at log_clock_start() */
+    uint64_t period; /* ticks between anchors */
+    bool     busy;   /* a thread is reanchoring */
+    unsigned seq;    /* odd while the anchor is written */
+    uint64_t tsc;    /* ticks at the anchor */
+    int64_t  ns;     /* wall time at the anchor */
+    uint64_t mult;   /* nanoseconds per tick, times 2^32 */
+} log_clock = {.type = LOG_CLOCK_DEFAULT, .id = CLOCK_REALTIME};
+
+static int64_t
+_log_clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Returns the cheapest realtime clock whose resolution is at least
+ * as fine as precision.
+ */
+static clockid_t
+_log_clock_default(log_precision_t precision)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec res;
+    long            ns;
+
+    switch (precision) {
+    case LOG_PRECISION_MSEC:
+        ns = 1000000;
+        break;
+    case LOG_PRECISION_USEC:
+        ns = 1000;
+        break;
+    default:
+        ns = 1;
+        break;
+    }
+
+    if (clock_getres(CLOCK_REALTIME_COARSE, &res) == 0 && res.tv_sec == 0
+        && res.tv_nsec <= ns) {
+        return CLOCK_REALTIME_COARSE;
+    }
+#else
+    UNUSED(precision);
+#endif
+
+    return CLOCK_REALTIME;
+}
+
+#ifdef HAVE_TSC
+
+static inline uint64_t
+_log_tsc(void)
+{
+#    if defined(__x86_64__)
+    uint32_t lo;
+    uint32_t hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return (uint64_t)hi << 32 | lo;
+#    else
+    uint64_t v;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+
+    return v;
+#    endif
+}
+
+/*
+ * Returns true if the counter ticks at a constant rate, in every power
+ * state, and is synchronized across CPUs.
+ */
+static bool
+_log_tsc_invariant(void)
+{
+#    if defined(__x86_64__)
+    unsigned a;
+    unsigned b;
+    unsigned c;
+    unsigned d;
+
+    return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1U << 8));
+#    else
+    return true; /* the generic timer */
+#    endif
+}
+
+/*
+ * Sets the anchor of LOG_CLOCK_TSC at tsc ticks and mono nanoseconds of
+ * CLOCK_MONOTONIC, calibrating mult since the start.
+ */
+static void
+_log_tsc_anchor(uint64_t tsc, int64_t mono)
+{
+    unsigned seq = log_clock.seq;
+    uint64_t mult;
+
+    mult = (uint64_t)(((uint128_t)(mono - log_clock.mono0) << 32)
+                      / (tsc - log_clock.tsc0));
+
+    __atomic_store_n(&log_clock.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&log_clock.tsc, tsc, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_clock.ns, mono + log_clock.offset,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&log_clock.mult, mult, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&log_clock.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts LOG_CLOCK_TSC. Returns false if there is no invariant counter.
+ */
+static bool
+_log_tsc_start(void)
+{
+    struct timespec pause = {0, CALIBRATE_MS * 1000000L};
+    uint64_t        tsc;
+    int64_t         mono;
+
+    if (!_log_tsc_invariant()) {
+        return false;
+    }
+
+    log_clock.tsc0 = _log_tsc();
+    log_clock.mono0 = _log_clock_ns(CLOCK_MONOTONIC);
+
+    while (nanosleep(&pause, &pause) < 0 && errno == EINTR) {
+        /* sleep out the calibration period */
+    }
+
+    tsc = _log_tsc();
+    mono = _log_clock_ns(CLOCK_MONOTONIC);
+    if (tsc <= log_clock.tsc0) {
+        return false;
+    }
+
+    log_clock.period = (tsc - log_clock.tsc0) * (1000 / CALIBRATE_MS)
+                       * ANCHOR_SECS;
+    _log_tsc_anchor(tsc, mono);
+
+    return true;
+}
+
+/*
+ * Reads LOG_CLOCK_TSC, in nanoseconds of wall time.
+ */
+static int64_t
+_log_tsc_now(void)
+{
+    unsigned seq;
+    uint64_t tsc;
+    uint64_t anchor;
+    uint64_t mult;
+    int64_t  ns;
+
+    do {
+        seq = __atomic_load_n(&log_clock.seq, __ATOMIC_ACQUIRE);
+        anchor = __atomic_load_n(&log_clock.tsc, __ATOMIC_RELAXED);
+        ns = __atomic_load_n(&log_clock.ns, __ATOMIC_RELAXED);
+        mult = __atomic_load_n(&log_clock.mult, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) != 0
+             || seq != __atomic_load_n(&log_clock.seq, __ATOMIC_RELAXED));
+
+    tsc = _log_tsc();
+    if (tsc <= anchor) {
+        return ns; /* read on a CPU slightly behind the anchor's */
+    }
+
+    if (tsc - anchor > log_clock.period
+        && !__atomic_exchange_n(&log_clock.busy, true, __ATOMIC_ACQUIRE)) {
+        _log_tsc_anchor(tsc, _log_clock_ns(CLOCK_MONOTONIC));
+        __atomic_store_n(&log_clock.busy, false, __ATOMIC_RELEASE);
+    }
+
+    return ns + (int64_t)(((uint128_t)(tsc - anchor) * mult) >> 32);
+}
+
+#endif /* HAVE_TSC */
+
+void
+log_clock_start(log_clock_t type, log_precision_t precision)
+{
+    log_clock.offset = 0;
+
+    switch (type) {
+    case LOG_CLOCK_REALTIME:
+        log_clock.id = CLOCK_REALTIME;
+        break;
+    case LOG_CLOCK_REALTIME_COARSE:
+#ifdef CLOCK_REALTIME_COARSE
+        log_clock.id = CLOCK_REALTIME_COARSE;
+#else
+        log_clock.id = CLOCK_REALTIME;
+#endif
+        break;
+    case LOG_CLOCK_TSC:
+#ifdef HAVE_TSC
+        log_clock.offset = _log_clock_ns(CLOCK_REALTIME)
+                           - _log_clock_ns(CLOCK_MONOTONIC);
+        if (_log_tsc_start()) {
+            break;
+        }
+#endif
+        type = LOG_CLOCK_MONOTONIC;
+        /* FALLTHROUGH */
+    case LOG_CLOCK_MONOTONIC:
+        log_clock.id = CLOCK_MONOTONIC;
+        log_clock.offset = _log_clock_ns(CLOCK_REALTIME)
+                           - _log_clock_ns(CLOCK_MONOTONIC);
+        break;
+    default:
+        type = LOG_CLOCK_DEFAULT;
+        log_clock.id = _log_clock_default(precision);
+        break;
+    }
+
+    log_clock.type = type;
+}
+
+void
+log_clock_now(struct timespec *ts)
+{
+    int64_t ns;
+
+#ifdef HAVE_TSC
+    if (log_clock.type == LOG_CLOCK_TSC) {
+        ns = _log_tsc_now();
+        ts->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+        ts->tv_nsec = (long)(ns % NSEC_PER_SEC);
+        return;
+    }
+#endif
+
+    clock_gettime(log_clock.id, ts);
+
+    if (log_clock.offset != 0) {
+        ns = (int64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec
+             + log_clock.offset;
+        ts->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+        ts->tv_nsec = (long)(ns % NSEC_PER_SEC);
+    }
+}
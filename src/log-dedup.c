@@ -0,0 +1,156 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <pthread.h>
+#include <util/log.h>
+
+#include "log-private.h"
+
+/**
+ * Duplicate suppression mechanics:
+ *
+ * Each output with duplicate suppression has a struct log_dedup,
+ * holding the hash and length of the body of the last message it
+ * output: the message without its timestamp. A message with the same
+ * hash and length is a repeat, and is counted instead of output.
+ *
+ * Repeats are reported as "last message repeated N times" before the
+ * next different message, once the first unreported repeat is
+ * timeout old (when the next repeat arrives), and on log_flush(). There
+ * is no timer: the flusher thread outputs with the buffer locked, which
+ * a report from it would take again. The lock of a log_dedup is held
+ * while the message and any report are output, so reports stay in order
+ * with messages.
+ */
+struct log_dedup {
+    pthread_mutex_t lock;
+    uint64_t        timeout; /* nanoseconds between reports of repeats */
+    uint64_t        hash;    /* hash of the last body */
+    size_t          len;     /* length of the last body, 0 if none */
+    log_level_t     level;   /* level of the last message */
+    uint64_t        count;   /* unreported repeats */
+    uint64_t        since;   /* time of the first unreported repeat */
+};
+
+#define NSEC_PER_MSEC 1000000ULL
+
+/* multiplier of the body hash, 2^64 divided by the golden ratio */
+#define HASH_MULT 0x9e3779b97f4a7c15ULL
+
+/*
+ * Hashes the len bytes of s, a word at a time.
+ */
+static uint64_t
+_log_dedup_hash(const char *s, size_t len)
+{
+    uint64_t h = len * HASH_MULT;
+    uint64_t w;
+
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8); /* NOLINT */
+        h = (h ^ w) * HASH_MULT;
+        h ^= h >> 32;
+    }
+
+    if (len > 0) {
+        w = 0;
+        memcpy(&w, s, len); /* NOLINT */
+        h = (h ^ w) * HASH_MULT;
+        h ^= h >> 32;
+    }
+
+    return h;
+}
+
+struct log_dedup *
+log_dedup_create(unsigned timeout_ms)
+{
+    /* not xmalloc(), which may log */
+    struct log_dedup *d = calloc(1, sizeof(*d));
+
+    if (d == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    d->timeout = timeout_ms * NSEC_PER_MSEC;
+
+    return d;
+}
+
+void
+log_dedup_destroy(struct log_dedup *d)
+{
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+bool
+log_dedup_begin(struct log_dedup *d, const char *body, size_t len,
+                log_level_t level, uint64_t now, uint64_t *repeats,
+                log_level_t *rlevel)
+{
+    uint64_t hash = _log_dedup_hash(body, len);
+
+    pthread_mutex_lock(&d->lock);
+
+    *repeats = 0;
+    *rlevel = d->level;
+
+    if (len == d->len && hash == d->hash) {
+        if (d->count++ == 0) {
+            d->since = now;
+        }
+
+        if (now - d->since >= d->timeout) {
+            *repeats = d->count;
+            d->count = 0;
+        }
+
+        return false;
+    }
+
+    *repeats = d->count;
+    d->count = 0;
+    d->hash = hash;
+    d->len = len;
+    d->level = level;
+
+    return true;
+}
+
+void
+log_dedup_end(struct log_dedup *d)
+{
+    pthread_mutex_unlock(&d->lock);
+}
+
+uint64_t
+log_dedup_pending(struct log_dedup *d, log_level_t *level)
+{
+    uint64_t n;
+
+    pthread_mutex_lock(&d->lock);
+
+    n = d->count;
+    d->count = 0;
+    *level = d->level;
+
+    return n;
+}
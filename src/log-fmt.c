@@ -0,0 +1,462 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+
+#include "log-fmt.h"
+
+const char *
+log_fmt_spec_end(const char *spec)
+{
+    const char *p = spec + 1;
+
+    /* flags, width, precision and length modifiers */
+    while (*p != '\0' && strchr("-+ #0123456789.*hlLqjzt'I", *p) != NULL) {
+        p++;
+    }
+
+    /* conversion specifier */
+    if (*p != '\0') {
+        p++;
+    }
+
+    return p;
+}
+
+int
+log_fmt_parse(const char *fmt, struct log_arg *args, int max)
+{
+    const char *p;
+    const char *end;
+    int         n = 0;
+    int         longs;
+    int         prec;
+    uint8_t     type;
+
+    for (p = strchr(fmt, '%'); p != NULL; p = strchr(end, '%')) {
+        end = log_fmt_spec_end(p);
+
+        if (p[1] == '%') {
+            continue;
+        }
+
+        longs = 0;
+        prec = LOG_PREC_NONE;
+        type = LOG_ARG_INT;
+
+        for (p++; p < end - 1; p++) {
+            switch (*p) {
+            case '*':
+                if (n == max) {
+                    return -1;
+                }
+                args[n].type = LOG_ARG_INT;
+                args[n++].prec = LOG_PREC_NONE;
+
+                if (p[-1] == '.') {
+                    prec = LOG_PREC_STAR;
+                }
+                break;
+            case '.':
+                if (p[1] >= '0' && p[1] <= '9') {
+                    prec = atoi(p + 1);
+                } else if (p[1] != '*') {
+                    prec = 0;
+                }
+                break;
+            case 'l':
+                longs++;
+                break;
+            case 'L':
+            case 'q':
+                longs = 2;
+                break;
+            case 'j':
+                type = LOG_ARG_INTMAX;
+                break;
+            case 'z':
+                type = LOG_ARG_SIZE;
+                break;
+            case 't':
+                type = LOG_ARG_PTRDIFF;
+                break;
+            default:
+                break;
+            }
+        }
+
+        switch (*p) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            if (longs == 1) {
+                type = LOG_ARG_LONG;
+            } else if (longs >= 2) {
+                type = LOG_ARG_LLONG;
+            }
+            break;
+        case 'c':
+            if (longs > 0) {
+                return -1; /* wide character */
+            }
+            type = LOG_ARG_INT;
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            type = longs >= 2 ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 'p':
+            type = LOG_ARG_PTR;
+            break;
+        case 's':
+            if (longs > 0) {
+                return -1; /* wide string */
+            }
+            type = LOG_ARG_STR;
+            break;
+        default:
+            return -1; /* %n, %m, or unknown */
+        }
+
+        if (n == max) {
+            return -1;
+        }
+
+        args[n].type = type;
+        args[n++].prec = type == LOG_ARG_STR ? prec : LOG_PREC_NONE;
+    }
+
+    return n;
+}
+
+int
+log_fmt_encode(char *buf, size_t size, const struct log_arg *args,
+               int nargs, va_list ap)
+{
+    size_t      len = 0;
+    size_t      max;
+    size_t      vlen;
+    int         star = -1;
+    int         i;
+    const char *s;
+    uint16_t    slen;
+    union {
+        int         i;
+        long        l;
+        long long   ll;
+        size_t      z;
+        intmax_t    j;
+        ptrdiff_t   t;
+        double      d;
+        long double ld;
+        void *      p;
+    } v;
+
+    for (i = 0; i < nargs; i++) {
+        switch (args[i].type) {
+        case LOG_ARG_INT:
+            v.i = va_arg(ap, int);
+            vlen = sizeof(v.i);
+            star = v.i;
+            break;
+        case LOG_ARG_LONG:
+            v.l = va_arg(ap, long);
+            vlen = sizeof(v.l);
+            break;
+        case LOG_ARG_LLONG:
+            v.ll = va_arg(ap, long long);
+            vlen = sizeof(v.ll);
+            break;
+        case LOG_ARG_SIZE:
+            v.z = va_arg(ap, size_t);
+            vlen = sizeof(v.z);
+            break;
+        case LOG_ARG_INTMAX:
+            v.j = va_arg(ap, intmax_t);
+            vlen = sizeof(v.j);
+            break;
+        case LOG_ARG_PTRDIFF:
+            v.t = va_arg(ap, ptrdiff_t);
+            vlen = sizeof(v.t);
+            break;
+        case LOG_ARG_DOUBLE:
+            v.d = va_arg(ap, double);
+            vlen = sizeof(v.d);
+            break;
+        case LOG_ARG_LDOUBLE:
+            v.ld = va_arg(ap, long double);
+            vlen = sizeof(v.ld);
+            break;
+        case LOG_ARG_PTR:
+            v.p = va_arg(ap, void *);
+            vlen = sizeof(v.p);
+            break;
+        case LOG_ARG_STR:
+        default:
+            s = va_arg(ap, const char *);
+            if (s == NULL) {
+                s = "(null)";
+            }
+
+            if (len + 2 > size) {
+                return -1;
+            }
+
+            max = size - len - 2;
+            if (args[i].prec >= 0 && (size_t)args[i].prec < max) {
+                max = (size_t)args[i].prec;
+            } else if (args[i].prec == LOG_PREC_STAR && star >= 0
+                       && (size_t)star < max) {
+                max = (size_t)star;
+            }
+
+            slen = (uint16_t)strnlen(s, max);
+            memcpy(buf + len, &slen, 2);    /* NOLINT */
+            memcpy(buf + len + 2, s, slen); /* NOLINT */
+            len += 2 + slen;
+            continue;
+        }
+
+        if (len + vlen > size) {
+            return -1;
+        }
+
+        memcpy(buf + len, &v, vlen); /* NOLINT */
+        len += vlen;
+    }
+
+    return (int)len;
+}
+
+/*
+ * Takes n bytes of argument data from *data into v, returning false
+ * if fewer than n bytes remain.
+ */
+static bool
+_log_fmt_take(const char **data, const char *end, void *v, size_t n)
+{
+    if ((size_t)(end - *data) < n) {
+        return false;
+    }
+
+    memcpy(v, *data, n); /* NOLINT */
+    *data += n;
+
+    return true;
+}
+
+/*
+ * Appends the n bytes of str to the len bytes of buf, as much as fits
+ * in size bytes with a NUL.
+ */
+static void
+_log_fmt_append(char *buf, size_t size, size_t *len, const char *str,
+                size_t n)
+{
+    if (*len + n >= size) {
+        n = size - *len - 1;
+    }
+
+    memcpy(buf + *len, str, n); /* NOLINT */
+    *len += n;
+    buf[*len] = '\0';
+}
+
+/*
+ * Formats the value _val with the conversion spec _spec, which takes
+ * _nstars '*' arguments from _stars, at the end of the _len bytes of
+ * _buf, with print.
+ */
+#define FORMAT_SPEC(_buf, _size, _len, _spec, _stars, _nstars, _val)   \
+    do {                                                               \
+        size_t _n = (_size) - (_len);                                  \
+        int    _r;                                                     \
+        switch (_nstars) {                                             \
+        case 0:                                                        \
+            _r = print((_buf) + (_len), _n, _spec, _val);              \
+            break;                                                     \
+        case 1:                                                        \
+            _r = print((_buf) + (_len), _n, _spec, (_stars)[0], _val); \
+            break;                                                     \
+        default:                                                       \
+            _r = print((_buf) + (_len), _n, _spec, (_stars)[0],        \
+                       (_stars)[1], _val);                             \
+            break;                                                     \
+        }                                                              \
+        if (_r > 0) {                                                  \
+            (_len) += (size_t)_r < _n ? (size_t)_r : _n - 1;           \
+        }                                                              \
+    } while (0)
+
+#define TAKE(_v)                                             \
+    do {                                                     \
+        if (!_log_fmt_take(&data, end, &(_v), sizeof(_v))) { \
+            return -1;                                       \
+        }                                                    \
+    } while (0)
+
+int
+log_fmt_format(char *buf, size_t size, const char *fmt,
+               const struct log_arg *args, int nargs, const char *data,
+               size_t len, log_fmt_print_fn print)
+{
+    const char *end = data + len;
+    const char *p = fmt;
+    const char *e;
+    const char *q;
+    char        spec[64];
+    size_t      n = 0;
+    size_t      w;
+    int         stars[2];
+    int         nstars;
+    int         i = 0;
+    uint16_t    slen;
+    union {
+        int         i;
+        long        l;
+        long long   ll;
+        size_t      z;
+        intmax_t    j;
+        ptrdiff_t   t;
+        double      d;
+        long double ld;
+        void *      p;
+    } v;
+
+    if (size == 0) {
+        return -1;
+    }
+
+    buf[0] = '\0';
+
+    while (*p != '\0') {
+        if (*p != '%') {
+            e = strchr(p, '%');
+            if (e == NULL) {
+                e = p + strlen(p);
+            }
+            _log_fmt_append(buf, size, &n, p, e - p);
+            p = e;
+            continue;
+        }
+
+        e = log_fmt_spec_end(p);
+        if (p[1] == '%') {
+            _log_fmt_append(buf, size, &n, "%", 1);
+            p = e;
+            continue;
+        }
+
+        if ((size_t)(e - p) + 4 >= sizeof(spec)) {
+            return -1;
+        }
+
+        memcpy(spec, p, e - p); /* NOLINT */
+        spec[e - p] = '\0';
+        p = e;
+
+        /* '*' widths and precisions precede the value, as ints */
+        for (nstars = 0, q = strchr(spec, '*'); q != NULL;
+             nstars++, i++, q = strchr(q + 1, '*')) {
+            if (nstars == 2 || i >= nargs) {
+                return -1;
+            }
+            TAKE(stars[nstars]);
+        }
+
+        if (i >= nargs) {
+            return -1;
+        }
+
+        switch (args[i].type) {
+        case LOG_ARG_INT:
+            TAKE(v.i);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.i);
+            break;
+        case LOG_ARG_LONG:
+            TAKE(v.l);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.l);
+            break;
+        case LOG_ARG_LLONG:
+            TAKE(v.ll);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.ll);
+            break;
+        case LOG_ARG_SIZE:
+            TAKE(v.z);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.z);
+            break;
+        case LOG_ARG_INTMAX:
+            TAKE(v.j);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.j);
+            break;
+        case LOG_ARG_PTRDIFF:
+            TAKE(v.t);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.t);
+            break;
+        case LOG_ARG_DOUBLE:
+            TAKE(v.d);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.d);
+            break;
+        case LOG_ARG_LDOUBLE:
+            TAKE(v.ld);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.ld);
+            break;
+        case LOG_ARG_PTR:
+            TAKE(v.p);
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, v.p);
+            break;
+        case LOG_ARG_STR:
+        default:
+            TAKE(slen);
+            if ((size_t)(end - data) < slen) {
+                return -1;
+            }
+
+            /*
+             * The encoded string is not NUL-terminated, and already
+             * truncated to its precision: replace the precision, if
+             * any, with the encoded length.
+             */
+            w = strcspn(spec, ".s");
+            memcpy(spec + w, ".*s", 4); /* NOLINT */
+            if (strchr(spec, '*') == spec + w + 1) {
+                stars[0] = slen;
+                nstars = 1;
+            } else {
+                stars[1] = slen;
+                nstars = 2;
+            }
+            FORMAT_SPEC(buf, size, n, spec, stars, nstars, data);
+            data += slen;
+            break;
+        }
+
+        i++;
+    }
+
+    return (int)n;
+}
@@ -0,0 +1,150 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <portable/macros.h>
+#include <portable/system.h>
+
+BEGIN_DECLS
+
+/*
+ * Binary log format, shared by the logging module and log-decode.
+ *
+ * A binary log is a sequence of records, each starting with a
+ * struct log_rec header. All fields are in host byte order and are
+ * unaligned; use memcpy() to access them.
+ *
+ * LOG_REC_SESSION starts the output of one log_init_opts() call, and
+ * invalidates any sites defined before it:
+ *     uint32_t magic        LOG_BIN_MAGIC
+ *     uint8_t  version      LOG_BIN_VERSION
+ *     uint8_t  precision    log_precision_t of timestamps
+ *     uint8_t  long_size    sizeof(long)
+ *     uint8_t  ptr_size     sizeof(void *)
+ *
+ * LOG_REC_SITE defines a call site, before its first event:
+ *     uint32_t id
+ *     uint32_t line
+ *     char     file[]       NUL-terminated
+ *     char     fmt[]        NUL-terminated
+ *
+ * LOG_REC_EVENT is one message logged at a defined site:
+ *     uint32_t id
+ *     int64_t  sec          timestamp
+ *     uint32_t nsec
+ *     uint8_t  args[]       raw arguments, see log_fmt_parse()
+ *
+ * LOG_REC_TEXT is one preformatted message, logged without a site or
+ * with a format the binary encoding does not support:
+ *     int64_t  sec          timestamp
+ *     uint32_t nsec
+ *     uint32_t line
+ *     char     file[]       NUL-terminated
+ *     char     text[]       to the end of the record
+ */
+#define LOG_BIN_MAGIC   0x474f4c55 /* "ULOG" */
+#define LOG_BIN_VERSION 1
+
+enum log_rec_type {
+    LOG_REC_SESSION,
+    LOG_REC_SITE,
+    LOG_REC_EVENT,
+    LOG_REC_TEXT
+};
+
+struct log_rec {
+    uint16_t len;   /* record length, including this header */
+    uint8_t  type;  /* enum log_rec_type */
+    uint8_t  level; /* log_level_t, for events and text */
+};
+
+/* maximum number of arguments of a binary-encoded format */
+#define LOG_FMT_MAX_ARGS 32
+
+/*
+ * Argument types. Each is encoded with the native size of its C type,
+ * except LOG_ARG_STR, which is encoded as a uint16_t length followed
+ * by that many bytes.
+ */
+enum log_arg_type {
+    LOG_ARG_INT,     /* int (and promoted char/short), '*' widths */
+    LOG_ARG_LONG,    /* long */
+    LOG_ARG_LLONG,   /* long long */
+    LOG_ARG_SIZE,    /* size_t */
+    LOG_ARG_INTMAX,  /* intmax_t */
+    LOG_ARG_PTRDIFF, /* ptrdiff_t */
+    LOG_ARG_DOUBLE,  /* double (and promoted float) */
+    LOG_ARG_LDOUBLE, /* long double */
+    LOG_ARG_PTR,     /* void * */
+    LOG_ARG_STR      /* char * */
+};
+
+/* precision of a LOG_ARG_STR argument, if not a literal value */
+#define LOG_PREC_NONE (-1) /* no precision */
+#define LOG_PREC_STAR (-2) /* given by the preceding LOG_ARG_INT */
+
+struct log_arg {
+    uint8_t type; /* enum log_arg_type */
+    int     prec; /* string precision, or LOG_PREC_* */
+};
+
+/*
+ * Parses the conversions of a printf format into at most max
+ * arguments. Returns the number of arguments, or -1 if fmt uses a
+ * conversion the binary encoding does not support (e.g. %n or wide
+ * characters) or has more than max arguments.
+ */
+int log_fmt_parse(const char *fmt, struct log_arg *args, int max)
+    __attribute__((nonnull));
+
+/*
+ * Returns a pointer to the end of the conversion specification that
+ * starts at spec, which points to a '%'.
+ */
+const char *log_fmt_spec_end(const char *spec) __attribute__((nonnull));
+
+/*
+ * Encodes the nargs arguments of a format, parsed by log_fmt_parse(),
+ * from ap into buf of size bytes. String arguments are truncated to
+ * their precision. Returns the number of bytes encoded, or -1 if they
+ * do not fit.
+ */
+int log_fmt_encode(char *buf, size_t size, const struct log_arg *args,
+                   int nargs, va_list ap) __attribute__((nonnull(1)));
+
+/*
+ * Formats one conversion specification and its arguments into buf of
+ * size bytes, NUL-terminated, as snprintf() does.
+ */
+typedef int (*log_fmt_print_fn)(char *buf, size_t size, const char *fmt,
+                                ...);
+
+/*
+ * Formats fmt into buf of size bytes, taking its nargs arguments,
+ * parsed by log_fmt_parse(), from the len bytes of data encoded by
+ * log_fmt_encode(), and formatting each conversion with print, e.g.
+ * snprintf(). Returns the length of the formatted string, which is
+ * truncated to fit, or -1 if data is malformed.
+ */
+int log_fmt_format(char *buf, size_t size, const char *fmt,
+                   const struct log_arg *args, int nargs, const char *data,
+                   size_t len, log_fmt_print_fn print)
+    __attribute__((nonnull(1, 3, 8)));
+
+END_DECLS
@@ -0,0 +1,273 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "str.h"
+
+/**
+ * Structured field encoding:
+ *
+ * A logfmt field is output as " key=value", and a JSON field as
+ * ",\"key\":value". Keys are copied verbatim. Strings are quoted in
+ * JSON, and in logfmt only if they are empty or contain a space, '=',
+ * '"' or a control character; within quotes, '"', '\\' and control
+ * characters are escaped as in JSON. Bytes from 0x80 are copied
+ * as is, so UTF-8 passes through.
+ *
+ * Fields are output whole or not at all, so a message truncated to
+ * LOG_MAX_LEN still parses.
+ */
+
+/* the byte must be escaped within quotes */
+#define KV_ESCAPE 0x1
+
+/* the byte requires a logfmt value to be quoted */
+#define KV_QUOTE 0x2
+
+static const uint8_t log_kv_class[256] = {
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, /* 00 */
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, /* 10 */
+    2, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 20 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, /* 30 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 40 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0, /* 50 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 60 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, /* 70 */
+};
+
+/* level names, indexed by log_level_t */
+static const char *const log_kv_levels[] = {
+    "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug",
+};
+
+/*
+ * Copies the n bytes of s to *p. Returns false if they do not fit
+ * before end.
+ */
+static inline bool
+_kv_put(char **p, char *end, const char *s, size_t n)
+{
+    if (n > (size_t)(end - *p)) {
+        return false;
+    }
+
+    memcpy(*p, s, n); /* NOLINT */
+    *p += n;
+
+    return true;
+}
+
+/*
+ * Outputs the len bytes of s as a string value.
+ */
+static bool
+_kv_string(char **p, char *end, bool json, const char *s, size_t len)
+{
+    const uint8_t *c = (const uint8_t *)s;
+    char           esc[6] = {'\\', 'u', '0', '0', 0, 0};
+    size_t         run = 0;
+    size_t         i;
+
+    if (s == NULL) {
+        return _kv_put(p, end, "null", 4);
+    }
+
+    /* most values need neither quotes nor escapes */
+    for (i = 0; i < len && !(log_kv_class[c[i]] & KV_QUOTE); i++) {
+        /* scan */
+    }
+
+    if (i == len && len > 0 && !json) {
+        return _kv_put(p, end, s, len);
+    }
+
+    if (!_kv_put(p, end, "\"", 1)) {
+        return false;
+    }
+
+    for (; i < len; i++) {
+        if (!(log_kv_class[c[i]] & KV_ESCAPE)) {
+            continue;
+        }
+
+        if (!_kv_put(p, end, s + run, i - run)) {
+            return false;
+        }
+        run = i + 1;
+
+        switch (c[i]) {
+        case '"':
+        case '\\':
+            esc[1] = (char)c[i];
+            break;
+        case '\n':
+            esc[1] = 'n';
+            break;
+        case '\r':
+            esc[1] = 'r';
+            break;
+        case '\t':
+            esc[1] = 't';
+            break;
+        default:
+            esc[1] = 'u';
+            esc[4] = "0123456789abcdef"[c[i] >> 4];
+            esc[5] = "0123456789abcdef"[c[i] & 0xf];
+            if (!_kv_put(p, end, esc, 6)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (!_kv_put(p, end, esc, 2)) {
+            return false;
+        }
+    }
+
+    return _kv_put(p, end, s + run, len - run) && _kv_put(p, end, "\"", 1);
+}
+
+/*
+ * Outputs an unsigned integer value, preceded by sign if not NULL and
+ * followed by unit if not NULL.
+ */
+static bool
+_kv_number(char **p, char *end, const char *sign, unsigned long long u,
+           const char *unit)
+{
+    char  num[24];
+    char *n = str_utoa(num + sizeof(num), u);
+
+    return (sign == NULL || _kv_put(p, end, sign, 1))
+           && _kv_put(p, end, n, (size_t)(num + sizeof(num) - n))
+           && (unit == NULL || _kv_put(p, end, unit, strlen(unit)));
+}
+
+/*
+ * Outputs a signed integer value, followed by unit if not NULL.
+ */
+static bool
+_kv_signed(char **p, char *end, long long v, const char *unit)
+{
+    if (v < 0) {
+        return _kv_number(p, end, "-", 0ULL - (unsigned long long)v, unit);
+    }
+
+    return _kv_number(p, end, NULL, (unsigned long long)v, unit);
+}
+
+/*
+ * Outputs the separator and key of a field.
+ */
+static bool
+_kv_key(char **p, char *end, bool json, const char *key, size_t keylen)
+{
+    if (json) {
+        return _kv_put(p, end, ",\"", 2) && _kv_put(p, end, key, keylen)
+               && _kv_put(p, end, "\":", 2);
+    }
+
+    return _kv_put(p, end, " ", 1) && _kv_put(p, end, key, keylen)
+           && _kv_put(p, end, "=", 1);
+}
+
+size_t
+log_kv_header(char *buf, size_t size, bool json, log_level_t level,
+              const char *file, int line, const char *text, size_t tlen)
+{
+    char *      p = buf;
+    char *      end = buf + size;
+    char *      field;
+    const char *name = log_kv_levels[(unsigned)level & 7];
+
+    field = p;
+    if (!_kv_key(&p, end, json, "level", 5)
+        || !_kv_string(&p, end, json, name, strlen(name))) {
+        return (size_t)(field - buf);
+    }
+
+    if (file != NULL) {
+        field = p;
+        if (!_kv_key(&p, end, json, "file", 4)
+            || !_kv_string(&p, end, json, file, strlen(file))
+            || !_kv_key(&p, end, json, "line", 4)
+            || !_kv_signed(&p, end, line, NULL)) {
+            return (size_t)(field - buf);
+        }
+    }
+
+    field = p;
+    if (!_kv_key(&p, end, json, "msg", 3)
+        || !_kv_string(&p, end, json, text, tlen)) {
+        return (size_t)(field - buf);
+    }
+
+    return (size_t)(p - buf);
+}
+
+size_t
+log_kv_fields(char *buf, size_t size, bool json, const struct log_kv *kv,
+              size_t n)
+{
+    char * p = buf;
+    char * end = buf + size;
+    char * field;
+    size_t i;
+    bool   ok;
+
+    for (i = 0; i < n; i++) {
+        field = p;
+        ok = _kv_key(&p, end, json, kv[i].key, kv[i].keylen);
+
+        switch (kv[i].type) {
+        case LOG_KV_STR:
+            ok = ok
+                 && _kv_string(&p, end, json, kv[i].value.s,
+                               kv[i].value.s != NULL ? strlen(kv[i].value.s)
+                                                     : 0);
+            break;
+        case LOG_KV_INT:
+            ok = ok && _kv_signed(&p, end, kv[i].value.i, NULL);
+            break;
+        case LOG_KV_UINT:
+            ok = ok && _kv_number(&p, end, NULL, kv[i].value.u, NULL);
+            break;
+        case LOG_KV_BOOL:
+            ok = ok
+                 && (kv[i].value.i ? _kv_put(&p, end, "true", 4)
+                                   : _kv_put(&p, end, "false", 5));
+            break;
+        case LOG_KV_DUR_US:
+            ok = ok
+                 && _kv_signed(&p, end, kv[i].value.i, json ? NULL : "us");
+            break;
+        default:
+            ok = ok && _kv_put(&p, end, "null", 4);
+            break;
+        }
+
+        if (!ok) {
+            return (size_t)(field - buf);
+        }
+    }
+
+    return (size_t)(p - buf);
+}
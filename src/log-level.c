@@ -0,0 +1,357 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <signal.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "util-private.h"
+
+/**
+ * Per-module level mechanics:
+ *
+ * Each call site of the logging macros holds its effective level in
+ * site->output, and the level its macro admits in site->level, so the
+ * macros check a message with a single load and compare. The first
+ * message from a site registers it: the site is linked into log_sites
+ * and its level is resolved, from the override for its module if
+ * there is one, and otherwise from log_threshold. site->level also
+ * admits the levels of any sinks, which module levels do not apply
+ * to, and while the flight recorder runs, every level.
+ *
+ * Until registered, site->level admits every message, so an
+ * unregistered site always reaches log_write_site(), which registers
+ * it.
+ *
+ * Whenever an override or log_threshold changes, every registered
+ * site is resolved again. Sites are static, so they are never
+ * unlinked. Registration and updates are serialized by log_level_lock.
+ * Levels are stored atomically, and loaded relaxed by the macros and
+ * log_loggable(): a call loads the level once, so a change never
+ * splits a message between levels.
+ *
+ * The handlers of log_level_signals() cannot take log_level_lock, so
+ * they write '+' or '-' to log_level_pipe, and log_level_thread reads
+ * it and makes the change.
+ */
+struct log_module {
+    char *             name;  /* module name */
+    log_level_t        level; /* level of the module's sites */
+    struct log_module *next;
+};
+
+static pthread_mutex_t log_level_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* registered sites */
+static struct log_site *log_sites = NULL;
+
+/* per-module level overrides */
+static struct log_module *log_modules = NULL;
+
+/* up signal of log_level_signals(), and the pipe to log_level_thread */
+static int       log_level_up = 0;
+static int       log_level_pipe[2] = {-1, -1};
+static pthread_t log_level_thread;
+
+/*
+ * Returns true if site belongs to module, which is LOG_MODULE where
+ * the site was compiled, or else the basename of its source file
+ * without extensions (e.g. "buffer" for src/buffer.c).
+ */
+static bool
+_log_site_in(const struct log_site *site, const char *module)
+{
+    const char *base;
+    size_t      len;
+
+    if (site->module != NULL) {
+        return strcmp(site->module, module) == 0;
+    }
+
+    base = strrchr(site->file, '/');
+    base = base != NULL ? base + 1 : site->file;
+    len = strcspn(base, ".");
+
+    return strncmp(base, module, len) == 0 && module[len] == '\0';
+}
+
+/*
+ * Resolves the level of site, with log_level_lock held.
+ */
+static void
+_log_site_resolve(struct log_site *site)
+{
+    struct log_module *m;
+    log_level_t        level;
+    int                admit;
+
+    level = __atomic_load_n(&log_threshold, __ATOMIC_RELAXED);
+
+    for (m = log_modules; m != NULL; m = m->next) {
+        if (_log_site_in(site, m->name)) {
+            level = m->level;
+            break;
+        }
+    }
+
+    /*
+     * The macros also admit the levels of sinks, and while recording,
+     * every level.
+     */
+    admit = (int)level > log_sinks_level ? (int)level : log_sinks_level;
+    if (__atomic_load_n(&log_recording, __ATOMIC_RELAXED)) {
+        admit = LOG_DEBUG;
+    }
+
+    __atomic_store_n(&site->output, (int)level, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->level, admit, __ATOMIC_RELAXED);
+}
+
+/*
+ * Resolves every registered site, with log_level_lock held.
+ */
+static void
+_log_sites_resolve(void)
+{
+    struct log_site *site;
+
+    for (site = log_sites; site != NULL; site = site->next) {
+        _log_site_resolve(site);
+    }
+}
+
+void
+log_site_register(struct log_site *site)
+{
+    pthread_mutex_lock(&log_level_lock);
+
+    if (!site->registered) {
+        site->next = log_sites;
+        log_sites = site;
+        _log_site_resolve(site);
+        __atomic_store_n(&site->registered, true, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&log_level_lock);
+}
+
+void
+log_levels_update(void)
+{
+    pthread_mutex_lock(&log_level_lock);
+    _log_sites_resolve();
+    pthread_mutex_unlock(&log_level_lock);
+}
+
+UTIL_EXPORT bool
+log_set_module_level(const char *module, log_level_t level)
+{
+    struct log_module *m;
+
+    pthread_mutex_lock(&log_level_lock);
+
+    for (m = log_modules; m != NULL; m = m->next) {
+        if (strcmp(m->name, module) == 0) {
+            break;
+        }
+    }
+
+    if (m == NULL) {
+        /* malloc() rather than xmalloc(), which may log */
+        m = malloc(sizeof(*m));
+        if (m != NULL) {
+            m->name = strdup(module);
+        }
+
+        if (m == NULL || m->name == NULL) {
+            pthread_mutex_unlock(&log_level_lock);
+            free(m);
+            return false;
+        }
+
+        m->next = log_modules;
+        log_modules = m;
+    }
+
+    m->level = level;
+    _log_sites_resolve();
+
+    pthread_mutex_unlock(&log_level_lock);
+
+    return true;
+}
+
+UTIL_EXPORT void
+log_clear_module_level(const char *module)
+{
+    struct log_module **mp;
+    struct log_module * m;
+
+    pthread_mutex_lock(&log_level_lock);
+
+    for (mp = &log_modules; *mp != NULL; mp = &(*mp)->next) {
+        if (strcmp((*mp)->name, module) == 0) {
+            m = *mp;
+            *mp = m->next;
+            free(m->name);
+            free(m);
+            _log_sites_resolve();
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&log_level_lock);
+}
+
+UTIL_EXPORT void
+log_set_level(log_level_t level)
+{
+    pthread_mutex_lock(&log_level_lock);
+    __atomic_store_n(&log_threshold, level, __ATOMIC_RELAXED);
+    _log_sites_resolve();
+    pthread_mutex_unlock(&log_level_lock);
+}
+
+/*
+ * Handles the signals of log_level_signals(). Async-signal-safe.
+ */
+static void
+_log_level_signal(int sig)
+{
+    int  errno_save = errno;
+    char c = sig == __atomic_load_n(&log_level_up, __ATOMIC_RELAXED) ? '+'
+                                                                     : '-';
+
+    if (write(log_level_pipe[1], &c, 1) < 0) {
+        /* the pipe is full, so the change is dropped */
+    }
+
+    errno = errno_save;
+}
+
+static void *
+_log_level_run(void *arg)
+{
+    log_level_t level;
+    ssize_t     n;
+    char        c;
+
+    UNUSED(arg);
+
+    for (;;) {
+        n = read(log_level_pipe[0], &c, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&log_level_lock);
+        level = __atomic_load_n(&log_threshold, __ATOMIC_RELAXED);
+        if (c == '+' && level < LOG_DEBUG) {
+            level++;
+        } else if (c == '-' && level > LOG_EMERG) {
+            level--;
+        }
+        __atomic_store_n(&log_threshold, level, __ATOMIC_RELAXED);
+        _log_sites_resolve();
+        pthread_mutex_unlock(&log_level_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Creates log_level_pipe and starts log_level_thread, once.
+ */
+static bool
+_log_level_start(void)
+{
+    sigset_t set;
+    sigset_t old;
+    int      err;
+
+    if (log_level_pipe[0] >= 0) {
+        return true;
+    }
+
+    if (pipe(log_level_pipe) < 0) {
+        log_stderr("creating log level pipe failed: %s", strerror(errno));
+        return false;
+    }
+
+    /* the handlers never block, nor leak the pipe into children */
+    fcntl(log_level_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(log_level_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(log_level_pipe[1], F_SETFL, O_NONBLOCK);
+
+    /* the thread need not handle any signal */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+    err = pthread_create(&log_level_thread, NULL, _log_level_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        log_stderr("starting log level thread failed: %s", strerror(err));
+        close(log_level_pipe[0]);
+        close(log_level_pipe[1]);
+        log_level_pipe[0] = log_level_pipe[1] = -1;
+        return false;
+    }
+
+    pthread_detach(log_level_thread);
+
+    return true;
+}
+
+UTIL_EXPORT bool
+log_level_signals(int up, int down)
+{
+    struct sigaction sa;
+    bool             ok = false;
+
+    pthread_mutex_lock(&log_level_lock);
+
+    if (!_log_level_start()) {
+        goto out;
+    }
+
+    __atomic_store_n(&log_level_up, up, __ATOMIC_RELAXED);
+
+    memset(&sa, 0, sizeof(sa)); /* NOLINT */
+    sa.sa_handler = _log_level_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(up, &sa, NULL) < 0 || sigaction(down, &sa, NULL) < 0) {
+        log_stderr("installing log level signal handlers failed: %s",
+                   strerror(errno));
+        goto out;
+    }
+
+    ok = true;
+
+out:
+    pthread_mutex_unlock(&log_level_lock);
+
+    return ok;
+}
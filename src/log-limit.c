@@ -0,0 +1,248 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "util-private.h"
+
+/**
+ * Rate limit mechanics:
+ *
+ * Each call site of the limited macros has a static struct log_limit,
+ * updated only with atomic operations.
+ *
+ * log_every_n() and log_first_n() count calls with a fetch-and-add.
+ *
+ * log_ratelimited() is a token bucket holding up to per_sec tokens,
+ * refilled at per_sec tokens per second, implemented as the generic
+ * cell rate algorithm: the bucket is the single "theoretical arrival
+ * time" tat, which advances by one interval per admitted message and
+ * may run ahead of the clock by at most a second's worth of intervals.
+ * An admission is a compare-and-swap of tat.
+ *
+ * Suppressed calls are counted. At most once per LOG_SUPPRESSED_MS, a
+ * call to a site with suppressed messages reports their number, from
+ * the site's file and line. A limit is pushed onto log_limits at its
+ * first suppressed call, so log_flush() and log_deinit() can report
+ * counts left over when a site is no longer called. Limits are static,
+ * and never leave the list.
+ */
+static struct log_limit *log_limits = NULL;
+
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+static uint64_t
+_log_limit_now(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Accounts for a call to a limited site at time now, which is
+ * suppressed unless pass, and reports suppressed calls when due.
+ * Returns pass.
+ */
+/*
+ * Reports the calls suppressed by limit, if any.
+ */
+static void
+_log_limit_report(struct log_site *site, struct log_limit *limit,
+                  log_level_t level)
+{
+    uint64_t n = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+
+    if (n > 0) {
+        log_write_report(site, level, "suppressed %llu messages",
+                         (unsigned long long)n);
+    }
+}
+
+static bool
+_log_limit_account(struct log_site *site, struct log_limit *limit,
+                   log_level_t level, bool pass, uint64_t now)
+{
+    uint64_t reported;
+
+    if (!pass) {
+        __atomic_store_n(&limit->level, (int)level, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&limit->listed, __ATOMIC_ACQUIRE)
+            && !__atomic_exchange_n(&limit->listed, true, __ATOMIC_ACQ_REL)) {
+            limit->site = site;
+            limit->next = __atomic_load_n(&log_limits, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&log_limits, &limit->next,
+                                                limit, true, __ATOMIC_RELEASE,
+                                                __ATOMIC_RELAXED)) {
+                /* limit->next was reloaded; retry */
+            }
+        }
+        __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
+        log_stats_suppressed();
+    }
+
+    if (__atomic_load_n(&limit->suppressed, __ATOMIC_RELAXED) == 0) {
+        return pass;
+    }
+
+    if (now == 0) {
+        now = _log_limit_now();
+    }
+
+    /* the report period starts at the first suppressed call */
+    reported = __atomic_load_n(&limit->reported, __ATOMIC_RELAXED);
+    if (reported == 0) {
+        __atomic_compare_exchange_n(&limit->reported, &reported, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return pass;
+    }
+
+    if (now - reported < LOG_SUPPRESSED_MS * NSEC_PER_MSEC
+        || !__atomic_compare_exchange_n(&limit->reported, &reported, now,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+        return pass; /* not due, or reported by another thread */
+    }
+
+    _log_limit_report(site, limit, level);
+
+    return pass;
+}
+
+void
+log_limit_flush(void)
+{
+    struct log_limit *limit;
+
+    for (limit = __atomic_load_n(&log_limits, __ATOMIC_ACQUIRE);
+         limit != NULL; limit = limit->next) {
+        if (__atomic_load_n(&limit->suppressed, __ATOMIC_RELAXED) > 0) {
+            /* the next suppressed call starts a new report period */
+            __atomic_store_n(&limit->reported, 0, __ATOMIC_RELAXED);
+            _log_limit_report(
+                limit->site, limit,
+                (log_level_t)__atomic_load_n(&limit->level,
+                                             __ATOMIC_RELAXED));
+        }
+    }
+}
+
+/*
+ * Registers site, if needed, and returns true if level passes it.
+ */
+static bool
+_log_limit_loggable(struct log_site *site, log_level_t level)
+{
+    int output;
+    int sinks;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        log_site_register(site);
+    }
+
+    /* both are stored concurrently, as by log_set_level() */
+    output = __atomic_load_n(&site->output, __ATOMIC_RELAXED);
+    sinks = __atomic_load_n(&log_sinks_level, __ATOMIC_RELAXED);
+
+    return (int)level <= output || (int)level <= sinks;
+}
+
+UTIL_EXPORT bool
+log_limit_every_n(struct log_site *site, struct log_limit *limit,
+                  log_level_t level, uint64_t n)
+{
+    uint64_t count;
+
+    if (!_log_limit_loggable(site, level)) {
+        return false;
+    }
+
+    count = __atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED);
+
+    return _log_limit_account(site, limit, level, n > 0 && count % n == 0,
+                              0);
+}
+
+UTIL_EXPORT bool
+log_limit_first_n(struct log_site *site, struct log_limit *limit,
+                  log_level_t level, uint64_t n)
+{
+    uint64_t count;
+
+    if (!_log_limit_loggable(site, level)) {
+        return false;
+    }
+
+    /* stop counting once suppressed, so the count cannot wrap */
+    count = __atomic_load_n(&limit->count, __ATOMIC_RELAXED);
+    if (count < n) {
+        count = __atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED);
+    }
+
+    return _log_limit_account(site, limit, level, count < n, 0);
+}
+
+UTIL_EXPORT bool
+log_limit_rate(struct log_site *site, struct log_limit *limit,
+               log_level_t level, uint64_t per_sec)
+{
+    uint64_t now;
+    uint64_t interval;
+    uint64_t tat;
+    uint64_t next;
+    bool     pass;
+
+    if (!_log_limit_loggable(site, level)) {
+        return false;
+    }
+
+    now = _log_limit_now();
+
+    if (per_sec == 0) {
+        return _log_limit_account(site, limit, level, false, now);
+    }
+
+    interval = per_sec < NSEC_PER_SEC ? NSEC_PER_SEC / per_sec : 1;
+
+    tat = __atomic_load_n(&limit->tat, __ATOMIC_RELAXED);
+    do {
+        next = tat > now ? tat : now;
+
+        /* a full bucket lets tat run ahead by (per_sec - 1) intervals */
+        pass = next - now <= NSEC_PER_SEC - interval;
+        if (!pass) {
+            break;
+        }
+
+        next += interval;
+    } while (!__atomic_compare_exchange_n(&limit->tat, &tat, next, true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return _log_limit_account(site, limit, level, pass, now);
+}
@@ -0,0 +1,330 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <util/log.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#    include <sys/mman.h>
+#endif
+
+#include "log-private.h"
+#include "util-private.h"
+#include "xmalloc.h"
+
+/**
+ * Memory-mapped output mechanics:
+ *
+ * The log file is divided into extents of m->extent bytes. A writer
+ * claims the next len bytes of the file with a fetch-and-add of
+ * m->pos, and copies its message into the mapping of the extent (or
+ * two) holding them, with no system call.
+ *
+ * Each extent is preallocated with posix_fallocate() and mapped the
+ * first time a writer claims bytes in it, into one of WINDOWS slots;
+ * slot i holds extents i, i + WINDOWS, i + 2 * WINDOWS ... Mapping
+ * takes m->lock, and waits if the slot still holds an older extent.
+ *
+ * w->written counts the bytes of a window's extent copied so far.
+ * The writer that completes an extent schedules its writeback with
+ * msync(MS_ASYNC), unmaps it and frees the slot.
+ *
+ * An extent that cannot be preallocated or mapped (e.g. the disk is
+ * full) still takes its slot, with no mapping: its writers drop their
+ * messages but count their bytes as written, so the slot is freed
+ * like any other and writers waiting for it are not stranded.
+ *
+ * log_mmap_write_safe(), for signal handlers, takes no lock and makes
+ * no system call: it claims bytes only within the current extent, and
+ * only if it is already mapped, with a compare-and-swap of m->pos. If
+ * its bytes complete the extent, it leaves the window to be retired
+ * by the next writer that needs its slot, which waits for it with a
+ * timeout.
+ *
+ * Until log_deinit() truncates the file to m->pos, the file is longer
+ * than its contents, which are followed by zeros.
+ */
+#define WINDOWS 4
+
+struct window {
+    char *   base;    /* mapping of the extent, or NULL if it failed */
+    uint64_t tag;     /* extent index + 1, or 0 if the slot is free */
+    size_t   written; /* bytes of the extent written */
+    bool     orphan;  /* completed by a signal handler; not retired */
+};
+
+struct log_mmap {
+    int      fd;     /* log file descriptor (const) */
+    size_t   extent; /* bytes per extent, a multiple of the page size */
+    uint64_t start;  /* file offset of the first message (const) */
+    uint64_t pos;    /* file offset of the next claim */
+
+    struct window   windows[WINDOWS];
+    pthread_mutex_t lock;
+    pthread_cond_t  freed; /* signals a slot is freed */
+};
+
+#ifdef HAVE_SYS_MMAN_H
+
+/*
+ * Returns the window of extent idx, mapping it if needed. Its base is
+ * NULL if the extent cannot be mapped.
+ */
+static struct window *
+_log_mmap_window(struct log_mmap *m, uint64_t idx)
+{
+    struct window *w = &m->windows[idx % WINDOWS];
+    uint64_t       tag;
+    off_t          off = (off_t)(idx * m->extent);
+    void *          base;
+    struct timespec ts;
+
+    if (__atomic_load_n(&w->tag, __ATOMIC_ACQUIRE) == idx + 1) {
+        return w;
+    }
+
+    pthread_mutex_lock(&m->lock);
+
+    while ((tag = __atomic_load_n(&w->tag, __ATOMIC_ACQUIRE)) != idx + 1) {
+        if (tag != 0 && __atomic_load_n(&w->orphan, __ATOMIC_ACQUIRE)) {
+            /* completed by log_mmap_write_safe(); retire it here */
+            msync(w->base, m->extent, MS_ASYNC);
+            munmap(w->base, m->extent);
+            w->base = NULL;
+            w->orphan = false;
+            __atomic_store_n(&w->tag, 0, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&m->freed);
+            continue;
+        }
+
+        if (tag != 0) {
+            /* an older extent is still being written */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&m->freed, &m->lock, &ts);
+            continue;
+        }
+
+        base = MAP_FAILED;
+        if (posix_fallocate(m->fd, off, (off_t)m->extent) == 0) {
+            base = mmap(NULL, m->extent, PROT_WRITE, MAP_SHARED, m->fd,
+                        off);
+        }
+
+        /* bytes before the first message count as written */
+        w->base = base != MAP_FAILED ? base : NULL;
+        w->written = idx == m->start / m->extent ? m->start % m->extent : 0;
+        __atomic_store_n(&w->tag, idx + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&m->lock);
+
+    return w;
+}
+
+/*
+ * Retires a window whose extent is completely written.
+ */
+static void
+_log_mmap_retire(struct log_mmap *m, struct window *w)
+{
+    if (w->base != NULL) {
+        msync(w->base, m->extent, MS_ASYNC);
+        munmap(w->base, m->extent);
+    }
+
+    pthread_mutex_lock(&m->lock);
+    w->base = NULL;
+    __atomic_store_n(&w->tag, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&m->freed);
+    pthread_mutex_unlock(&m->lock);
+}
+
+struct log_mmap *
+log_mmap_start(int fd, size_t extent)
+{
+    struct log_mmap *m;
+    struct stat      st;
+    size_t           page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &st) < 0) {
+        log_stderr("mapping log file failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    m = xmalloc(sizeof(*m));
+    if (m == NULL) {
+        return NULL;
+    }
+
+    memset(m->windows, 0, sizeof(m->windows)); /* NOLINT */
+    m->fd = fd;
+    m->extent = (extent + page - 1) / page * page;
+    m->start = (uint64_t)st.st_size;
+    m->pos = m->start;
+
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->freed, NULL);
+
+    return m;
+}
+
+bool
+log_mmap_write_safe(struct log_mmap *m, const char *buf, size_t len)
+{
+    struct window *w;
+    uint64_t       pos = __atomic_load_n(&m->pos, __ATOMIC_RELAXED);
+
+    /*
+     * The extent holding pos cannot be retired while pos is unclaimed,
+     * so it stays mapped once the claim succeeds.
+     */
+    do {
+        w = &m->windows[pos / m->extent % WINDOWS];
+        if (pos % m->extent + len > m->extent
+            || __atomic_load_n(&w->tag, __ATOMIC_ACQUIRE)
+                   != pos / m->extent + 1
+            || w->base == NULL) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&m->pos, &pos, pos + len, true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    memcpy(w->base + pos % m->extent, buf, len); /* NOLINT */
+
+    if (__atomic_add_fetch(&w->written, len, __ATOMIC_ACQ_REL)
+        == m->extent) {
+        __atomic_store_n(&w->orphan, true, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+bool
+log_mmap_write(struct log_mmap *m, const char *buf, size_t len)
+{
+    struct window *w;
+    uint64_t       pos;
+    size_t         off;
+    size_t         n;
+    bool           done = true;
+
+    pos = __atomic_fetch_add(&m->pos, len, __ATOMIC_RELAXED);
+
+    while (len > 0) {
+        w = _log_mmap_window(m, pos / m->extent);
+
+        off = pos % m->extent;
+        n = len < m->extent - off ? len : m->extent - off;
+
+        /* the bytes of a failed extent are dropped, but still count */
+        if (w->base != NULL) {
+            memcpy(w->base + off, buf, n); /* NOLINT */
+        } else {
+            done = false;
+        }
+
+        if (__atomic_add_fetch(&w->written, n, __ATOMIC_ACQ_REL)
+            == m->extent) {
+            _log_mmap_retire(m, w);
+        }
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+
+    return done;
+}
+
+void
+log_mmap_stop(struct log_mmap *m)
+{
+    struct window *w;
+    int            i;
+
+    for (i = 0; i < WINDOWS; i++) {
+        w = &m->windows[i];
+        if (w->tag != 0 && w->base != NULL) {
+            msync(w->base, m->extent, MS_ASYNC);
+            munmap(w->base, m->extent);
+        }
+        w->tag = 0;
+        w->orphan = false;
+    }
+
+    if (ftruncate(m->fd, (off_t)m->pos) < 0) {
+        log_stats_error();
+    }
+
+    pthread_cond_destroy(&m->freed);
+    pthread_mutex_destroy(&m->lock);
+
+    xfree(m);
+}
+
+#else /* !HAVE_SYS_MMAN_H */
+
+struct log_mmap *
+log_mmap_start(int fd, size_t extent)
+{
+    UNUSED(fd);
+    UNUSED(extent);
+
+    log_stderr("mapping log file failed: mmap is not supported");
+
+    return NULL;
+}
+
+bool
+log_mmap_write(struct log_mmap *m, const char *buf, size_t len)
+{
+    UNUSED(m);
+    UNUSED(buf);
+    UNUSED(len);
+
+    return false;
+}
+
+bool
+log_mmap_write_safe(struct log_mmap *m, const char *buf, size_t len)
+{
+    UNUSED(m);
+    UNUSED(buf);
+    UNUSED(len);
+
+    return false;
+}
+
+void
+log_mmap_stop(struct log_mmap *m)
+{
+    UNUSED(m);
+}
+
+#endif /* HAVE_SYS_MMAN_H */
@@ -0,0 +1,490 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <portable/macros.h>
+#include <portable/system.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-fmt.h"
+
+BEGIN_DECLS
+
+/* log fd mode */
+#define FD_MODE 0644
+
+/* number of errors during logging */
+extern uint64_t log_nerror;
+
+/*
+ * Counts an error during logging. Async-signal-safe.
+ */
+static inline void
+log_stats_error(void)
+{
+    __atomic_add_fetch(&log_nerror, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count, in the calling thread's shard, a message logged at level, len
+ * bytes of output, a message truncated to LOG_MAX_LEN and a message
+ * suppressed by rate limiting, for log_stats().
+ */
+void log_stats_message(log_level_t level);
+void log_stats_bytes(size_t len);
+void log_stats_truncated(void);
+void log_stats_suppressed(void);
+
+/*
+ * Outputs a message at level from site, as log_write_site() does but
+ * without recording it, for reports about the site.
+ */
+void log_write_report(struct log_site *site, log_level_t level,
+                      const char *msg, ...)
+    __attribute__((nonnull, format(printf, 3, 4)));
+
+/*
+ * Reports the calls suppressed by every limited site since its last
+ * report.
+ */
+void log_limit_flush(void);
+
+/*
+ * Counts the latency of a call that started at start, a reading of
+ * log_clock_now(), in the calling thread's histogram.
+ */
+void log_stats_latency(const struct timespec *start) __attribute__((nonnull));
+
+/*
+ * Prepares async-signal-safe logging: records the UTC offset of local
+ * time, and loads what backtrace() needs.
+ */
+void log_safe_start(void);
+
+/*
+ * Formats the seconds of sec, in local time, into buf of size bytes
+ * by fmt, which may contain only %Y, %m, %d, %H, %M and %S, and returns
+ * its length. Async-signal-safe.
+ */
+size_t log_safe_time(char *buf, size_t size, const char *fmt, time_t sec)
+    __attribute__((nonnull));
+
+/*
+ * Formats a message into buf of size bytes, without a terminating
+ * '\0', and returns its length; see log_write_signal_safe() for the
+ * conversions. Async-signal-safe.
+ */
+size_t log_safe_vformat(char *buf, size_t size, const char *fmt,
+                        va_list args) __attribute__((nonnull));
+size_t log_safe_format(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((nonnull));
+
+/*
+ * Starts reading timestamps from the source type, or from the
+ * cheapest realtime clock of precision for LOG_CLOCK_DEFAULT.
+ */
+void log_clock_start(log_clock_t type, log_precision_t precision);
+
+/*
+ * Reads the timestamp of a message, in wall time.
+ */
+void log_clock_now(struct timespec *ts) __attribute__((nonnull));
+
+/* a parsed format, see log_fmt_parse() */
+struct log_spec {
+    int            nargs;   /* number of arguments */
+    struct log_arg args[1]; /* nargs arguments */
+};
+
+/*
+ * Outputs a formatted message (or binary record) of len bytes,
+ * according to the configured mode.
+ */
+void log_output(log_level_t level, const char *buf, size_t len)
+    __attribute__((nonnull));
+
+/*
+ * Outputs a message of len bytes directly to the log file (or stderr),
+ * bypassing asynchronous and buffered mode. Async-signal-safe: a
+ * memory-mapped log gets the message only if it fits in what is
+ * already mapped (see log_mmap_write_safe()).
+ */
+void log_output_direct(const char *buf, size_t len) __attribute__((nonnull));
+
+/*
+ * Outputs a preformatted message logged at level from file:line
+ * (omitted if file is NULL) at ts (now if NULL) with
+ * log_output_direct(), for dumps of the flight recorder and signal
+ * handlers. Async-signal-safe.
+ */
+void log_dump(log_level_t level, const char *file, int line,
+              const struct timespec *ts, const char *text, size_t tlen)
+    __attribute__((nonnull(5)));
+
+/*
+ * Appends the level, file and line (omitted if file is NULL) and
+ * message fields of a structured message, in JSON if json or else in
+ * logfmt, to buf of size bytes. Returns the length appended; fields
+ * that do not fit are omitted.
+ */
+size_t log_kv_header(char *buf, size_t size, bool json, log_level_t level,
+                     const char *file, int line, const char *text,
+                     size_t tlen) __attribute__((nonnull(1, 7)));
+
+/*
+ * Appends the n fields of kv, in JSON if json or else in logfmt, to
+ * buf of size bytes, as log_kv_header() does.
+ */
+size_t log_kv_fields(char *buf, size_t size, bool json,
+                     const struct log_kv *kv, size_t n)
+    __attribute__((nonnull));
+
+/*
+ * The least severe level of any sink added by log_add_sink(), or -1.
+ */
+extern int log_sinks_level;
+
+/* styles of log_thread_tag() */
+enum {
+    LOG_THREAD_TEXT,   /* " [tid name cpu]" */
+    LOG_THREAD_LOGFMT, /* " tid=N thread=name cpu=N" */
+    LOG_THREAD_JSON    /* ",\"tid\":N,\"thread\":\"name\",\"cpu\":N" */
+};
+
+/*
+ * Formats the id, name (if any) and CPU of the calling thread in
+ * style into buf of size bytes, and returns its length, or 0 if it
+ * does not fit.
+ */
+size_t log_thread_tag(char *buf, size_t size, int style)
+    __attribute__((nonnull));
+
+/*
+ * Returns the name of the program, or NULL.
+ */
+const char *log_progname(void);
+
+/*
+ * Adds a sink; see log_add_sink(). Messages are in LOG_FORMAT_TEXT if
+ * text is true.
+ */
+bool log_sink_add(const struct log_sink_options *opts, bool text)
+    __attribute__((nonnull));
+
+/*
+ * Duplicate suppression state of an output.
+ */
+struct log_dedup;
+
+/*
+ * Creates duplicate suppression state reporting repeats at least
+ * every timeout_ms milliseconds. Returns NULL on failure.
+ */
+struct log_dedup *log_dedup_create(unsigned timeout_ms);
+
+void log_dedup_destroy(struct log_dedup *d) __attribute__((nonnull));
+
+/*
+ * Locks d and compares the body of a message of len bytes (the message
+ * without its timestamp), at level and now nanoseconds, to the last.
+ * Returns true if the message is to be output. Sets *repeats to the
+ * number of repeats to be reported first, at *rlevel, if any. The
+ * caller outputs both and then calls log_dedup_end().
+ */
+bool log_dedup_begin(struct log_dedup *d, const char *body, size_t len,
+                     log_level_t level, uint64_t now, uint64_t *repeats,
+                     log_level_t *rlevel) __attribute__((nonnull));
+
+/*
+ * Unlocks d.
+ */
+void log_dedup_end(struct log_dedup *d) __attribute__((nonnull));
+
+/*
+ * Locks d, and returns (and resets) the number of unreported repeats,
+ * at *level. The caller reports them and then calls log_dedup_end().
+ */
+uint64_t log_dedup_pending(struct log_dedup *d, log_level_t *level)
+    __attribute__((nonnull));
+
+/*
+ * Formats "last message repeated n times" at level and ts, in the
+ * format of the log, into buf of LOG_MAX_LEN bytes, and returns its
+ * length. Sets *tslen to the length of its timestamp.
+ */
+size_t log_format_repeated(char *buf, log_level_t level, uint64_t n,
+                           const struct timespec *ts, size_t *tslen)
+    __attribute__((nonnull));
+
+/*
+ * An output of a formatted message of len bytes, whose timestamp ts is
+ * its first tslen bytes.
+ */
+typedef void (*log_output_fn)(void *arg, log_level_t level,
+                              const char *buf, size_t len, size_t tslen,
+                              const struct timespec *ts);
+
+/*
+ * Outputs a formatted message of len bytes, whose timestamp ts is its
+ * first tslen bytes, with output(arg, ...) unless it repeats the last
+ * message of d, preceded by any report of repeats.
+ */
+void log_output_dedup(struct log_dedup *d, log_level_t level,
+                      const char *buf, size_t len, size_t tslen,
+                      const struct timespec *ts, log_output_fn output,
+                      void *arg) __attribute__((nonnull(1, 3, 6, 7)));
+
+/*
+ * Reports the repeats pending in d, if any, with output(arg, ...).
+ */
+void log_dedup_flush(struct log_dedup *d, log_output_fn output, void *arg)
+    __attribute__((nonnull(1, 2)));
+
+/*
+ * Writes a formatted message of len bytes, whose timestamp ts is its
+ * first tslen bytes, to each sink whose level it passes.
+ */
+void log_sinks_output(log_level_t level, const char *buf, size_t len,
+                      size_t tslen, const struct timespec *ts)
+    __attribute__((nonnull));
+
+/*
+ * Writes any messages buffered by sinks.
+ */
+void log_sinks_flush(void);
+
+/*
+ * Closes and removes every sink.
+ */
+void log_sinks_stop(void);
+
+/*
+ * Registers site, resolving its level, if it is not yet registered.
+ */
+void log_site_register(struct log_site *site) __attribute__((nonnull));
+
+/*
+ * Resolves the level of every registered site, after log_threshold
+ * changes.
+ */
+void log_levels_update(void);
+
+/*
+ * Starts the asynchronous writer thread, which drains a queue of
+ * capacity formatted messages to fd.
+ */
+bool log_async_start(int fd, size_t capacity, log_overflow_t overflow);
+
+/*
+ * Queues a formatted message of len bytes for the writer thread,
+ * copying it to the heap if it is longer than LOG_MAX_LEN. Returns
+ * false if the message was dropped.
+ */
+bool log_async_push(const char *buf, size_t len) __attribute__((nonnull));
+
+/*
+ * Waits until every message queued before the call is written.
+ */
+void log_async_flush(void);
+
+/*
+ * Drains the queue and stops the writer thread.
+ */
+void log_async_stop(void);
+
+/*
+ * Returns the number of messages dropped because the queue was full.
+ */
+uint64_t log_async_dropped(void);
+
+/*
+ * Starts buffering output to fd in a buffer of size bytes, which is
+ * written at least every flush_ms milliseconds by a flusher thread.
+ * Returns NULL on failure.
+ */
+struct log_buffer *log_buffer_start(int fd, size_t size, unsigned flush_ms);
+
+/*
+ * Starts buffering up to batch datagrams, of size bytes in all, to the
+ * datagram socket fd, which are sent together at least every flush_ms
+ * milliseconds by a flusher thread. Returns NULL on failure.
+ */
+struct log_buffer *log_buffer_start_batch(int fd, unsigned batch,
+                                          size_t size, unsigned flush_ms);
+
+/*
+ * Appends a datagram of the n parts of iov to a buffer started by
+ * log_buffer_start_batch(), sending the batch if it is full or if
+ * flush is true.
+ */
+void log_buffer_send(struct log_buffer *b, const struct iovec *iov, int n,
+                     bool flush) __attribute__((nonnull));
+
+/*
+ * Appends a formatted message of len bytes to the buffer, writing the
+ * buffer if it is full or if flush is true.
+ */
+void log_buffer_write(struct log_buffer *b, const char *buf, size_t len,
+                      bool flush) __attribute__((nonnull));
+
+/*
+ * Writes any buffered messages.
+ */
+void log_buffer_flush(struct log_buffer *b) __attribute__((nonnull));
+
+/*
+ * Writes any buffered messages, stops the flusher thread and frees b.
+ */
+void log_buffer_stop(struct log_buffer *b) __attribute__((nonnull));
+
+/*
+ * Starts a binary log session, outputting its LOG_REC_SESSION record.
+ */
+void log_binary_start(log_precision_t precision);
+
+/*
+ * Returns the parsed format of site, parsing fmt the first time the
+ * site is seen, or NULL if fmt is not encodable (see log_fmt_parse())
+ * or is not the format the site was first seen with.
+ */
+const struct log_spec *log_binary_spec(struct log_site *site,
+                                       const char *fmt)
+    __attribute__((nonnull));
+
+/*
+ * Outputs a LOG_REC_EVENT record for a message logged at site with
+ * format fmt, registering the site first if needed. Returns false if
+ * the message cannot be binary-encoded, in which case args is not
+ * consumed meaningfully and the caller must log it as text.
+ */
+bool log_binary_event(struct log_site *site, log_level_t level,
+                      const struct timespec *ts, const char *fmt,
+                      va_list args) __attribute__((nonnull));
+
+/*
+ * Outputs a LOG_REC_TEXT record for a preformatted message, with
+ * log_output_direct() if direct.
+ */
+void log_binary_text(log_level_t level, const char *file, int line,
+                     const struct timespec *ts, const char *text,
+                     size_t tlen, bool direct) __attribute__((nonnull));
+
+/*
+ * Starts output to a memory map of fd, preallocated and mapped in
+ * extents of (at least) extent bytes, after its current contents.
+ * Returns NULL on failure.
+ */
+struct log_mmap *log_mmap_start(int fd, size_t extent);
+
+/*
+ * Copies a message of len bytes into the memory map. Returns false if
+ * the file cannot be extended or mapped.
+ */
+bool log_mmap_write(struct log_mmap *m, const char *buf, size_t len)
+    __attribute__((nonnull));
+
+/*
+ * Copies a message of len bytes into the memory map if it fits in the
+ * part of the file already mapped. Returns false, dropping it,
+ * otherwise. Async-signal-safe.
+ */
+bool log_mmap_write_safe(struct log_mmap *m, const char *buf, size_t len)
+    __attribute__((nonnull));
+
+/*
+ * Unmaps the log file, truncates it to the length of its contents and
+ * frees m.
+ */
+void log_mmap_stop(struct log_mmap *m) __attribute__((nonnull));
+
+/*
+ * Starts the rotator thread, which renames the log file name and
+ * switches fd to a new file after size bytes are written to it or
+ * every secs seconds, keeping keep renamed files. It calls flush
+ * before switching fd and rotated after, while no writer holds the
+ * rotator (see log_rotate_hold()).
+ */
+bool log_rotate_start(const char *name, int fd, size_t size, unsigned secs,
+                      unsigned keep, void (*flush)(void),
+                      void (*rotated)(void)) __attribute__((nonnull(1)));
+
+/*
+ * Holds off switching files until log_rotate_release(), for output
+ * that must not straddle two files. Must not be held recursively.
+ */
+void log_rotate_hold(void);
+
+/*
+ * Releases log_rotate_hold().
+ */
+void log_rotate_release(void);
+
+/*
+ * Accounts for len bytes of output, requesting rotation when due.
+ */
+void log_rotate_written(size_t len);
+
+/*
+ * Requests the rotator thread to reopen the log file. Returns false if
+ * it is not running. Async-signal-safe.
+ */
+bool log_rotate_reopen(void);
+
+/*
+ * Stops the rotator thread.
+ */
+void log_rotate_stop(void);
+
+/*
+ * Opens name and dup2()s it onto fd. Async-signal-safe.
+ */
+bool log_reopen_fd(const char *name, int fd) __attribute__((nonnull));
+
+/*
+ * True while the flight recorder is recording.
+ */
+extern bool log_recording;
+
+/*
+ * Starts recording messages in per-thread rings of (at least) size
+ * bytes, and dumping them on fatal signals.
+ */
+bool log_recorder_start(size_t size);
+
+/*
+ * Records a message logged at site in the calling thread's ring.
+ */
+void log_recorder_record(struct log_site *site, log_level_t level,
+                         const struct timespec *ts, const char *fmt,
+                         va_list args) __attribute__((nonnull));
+
+/*
+ * Dumps the rings once, without flushing pending messages, when the
+ * process is about to crash. Does nothing unless recording.
+ */
+void log_recorder_crash(void);
+
+/*
+ * Stops recording, restoring the previous actions of fatal signals.
+ */
+void log_recorder_stop(void);
+
+END_DECLS
@@ -0,0 +1,468 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-fmt.h"
+#include "log-private.h"
+#include "util-private.h"
+
+/**
+ * Flight recorder mechanics:
+ *
+ * While recording, every call site admits messages at every level
+ * (see log-level.c), and log_write_site() records each message in the
+ * calling thread's ring before applying the site's output level.
+ *
+ * A message is recorded in binary form, as the binary log does: the
+ * site, the raw timestamp and the encoded arguments. It is formatted
+ * only when the rings are dumped.
+ *
+ * Each thread owns a ring of r->size bytes, which only it writes, so
+ * recording takes no lock. r->head and r->tail are the positions of
+ * the next and the oldest record; positions only increase, and are
+ * taken modulo r->size. A record never wraps: the space left at the
+ * end of the ring is filled with a pad record instead. Room for a new
+ * record is made by dropping the oldest records.
+ *
+ * Rings are linked into log_rings and never freed: when a thread
+ * exits, its ring is released for reuse by a new thread, but is still
+ * dumped until then. Each log_init_opts() starts a new generation;
+ * rings of older generations are not dumped, and are reset when they
+ * are reused.
+ *
+ * Dumps may run concurrently with recording threads, e.g. from a
+ * fatal signal, so a dump rereads r->tail after copying each record,
+ * before following its site, and again after formatting it, and skips
+ * records overwritten meanwhile. Dumps format with log_safe_vformat(),
+ * whose unsupported conversions are output as is, and output with
+ * log_dump(), which takes no lock even for a memory-mapped log, so
+ * they are async-signal-safe.
+ */
+struct ring {
+    struct ring *next;  /* next ring in log_rings (const) */
+    size_t       size;  /* capacity of buf (const) */
+    unsigned     id;    /* thread number, for dumps */
+    unsigned     gen;   /* generation the ring belongs to */
+    bool         owned; /* the ring is owned by a thread */
+    uint64_t     head;  /* position of the next record */
+    uint64_t     tail;  /* position of the oldest record */
+    char         buf[];
+};
+
+struct rec {
+    uint32_t               len;    /* length, including header and padding */
+    uint16_t               arglen; /* bytes of encoded arguments */
+    uint8_t                level;  /* log_level_t */
+    uint8_t                flags;  /* REC_* */
+    int64_t                sec;    /* timestamp */
+    long                   nsec;
+    const struct log_site *site;
+};
+
+#define REC_PAD 0x1 /* pad to the end of the ring */
+#define REC_RAW 0x2 /* arguments are not encoded */
+
+/* alignment of records */
+#define REC_ALIGN 8
+
+/* length of a pad record, the minimum space left at the end of a ring */
+#define PAD_LEN REC_ALIGN
+
+/* the minimum ring size, holding a few of the largest records */
+#define RING_MIN (4 * (sizeof(struct rec) + LOG_MAX_LEN))
+
+/* fatal signals that dump the rings */
+static const int log_fatal_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE,
+                                        SIGABRT};
+
+#define NSIGNALS (sizeof(log_fatal_signals) / sizeof(log_fatal_signals[0]))
+
+bool log_recording = false;
+
+/* all rings */
+static struct ring *log_rings = NULL;
+
+/* size of rings of the current generation */
+static size_t log_ring_size = 0;
+
+/* current generation */
+static unsigned log_ring_gen = 0;
+
+/* last thread number assigned */
+static unsigned log_ring_threads = 0;
+
+/* ring of the calling thread */
+static THREAD_LOCAL struct ring *log_ring = NULL;
+
+/* releases the ring of an exiting thread */
+static pthread_key_t  log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+/* the rings were dumped for a crash */
+static bool log_crashed = false;
+
+static struct sigaction log_old_actions[NSIGNALS];
+
+static void
+_log_ring_release(void *arg)
+{
+    struct ring *r = arg;
+
+    __atomic_store_n(&r->owned, false, __ATOMIC_RELEASE);
+}
+
+static void
+_log_ring_key_create(void)
+{
+    pthread_key_create(&log_ring_key, _log_ring_release);
+}
+
+/*
+ * Acquires a ring of the current generation for the calling thread,
+ * reusing a released ring if one fits. Returns NULL if one cannot be
+ * allocated.
+ */
+static struct ring *
+_log_ring_acquire(void)
+{
+    struct ring *r = log_ring;
+    size_t       size = __atomic_load_n(&log_ring_size, __ATOMIC_ACQUIRE);
+    bool         owned;
+
+    if (r != NULL) {
+        _log_ring_release(r); /* of an older generation */
+        log_ring = NULL;
+    }
+
+    for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r != NULL;
+         r = r->next) {
+        owned = false;
+        if (r->size == size
+            && __atomic_compare_exchange_n(&r->owned, &owned, true, false,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (r == NULL) {
+        /* malloc() rather than xmalloc(), which may log */
+        r = malloc(sizeof(struct ring) + size);
+        if (r == NULL) {
+            return NULL;
+        }
+
+        r->size = size;
+        r->owned = true;
+        r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    r->id = __atomic_add_fetch(&log_ring_threads, 1, __ATOMIC_RELAXED);
+    r->head = 0;
+    r->tail = 0;
+    __atomic_store_n(&r->gen, __atomic_load_n(&log_ring_gen, __ATOMIC_RELAXED),
+                     __ATOMIC_RELEASE);
+
+    pthread_setspecific(log_ring_key, r);
+    log_ring = r;
+
+    return r;
+}
+
+/*
+ * Drops the oldest records of r until len bytes are free after head.
+ */
+static void
+_log_ring_make_room(struct ring *r, size_t len)
+{
+    uint64_t tail = r->tail;
+    uint32_t rlen;
+
+    while (r->head + len - tail > r->size) {
+        memcpy(&rlen, r->buf + tail % r->size, sizeof(rlen)); /* NOLINT */
+        tail += rlen;
+    }
+
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+void
+log_recorder_record(struct log_site *site, log_level_t level,
+                    const struct timespec *ts, const char *fmt,
+                    va_list args)
+{
+    struct ring *          r = log_ring;
+    const struct log_spec *spec;
+    struct rec             rec;
+    char                   data[LOG_MAX_LEN];
+    int                    n = -1;
+    size_t                 len;
+    size_t                 left;
+    uint32_t               padlen;
+
+    if (r == NULL
+        || r->gen != __atomic_load_n(&log_ring_gen, __ATOMIC_RELAXED)) {
+        r = _log_ring_acquire();
+        if (r == NULL) {
+            return;
+        }
+    }
+
+    spec = log_binary_spec(site, fmt);
+    if (spec != NULL) {
+        n = log_fmt_encode(data, sizeof(data), spec->args, spec->nargs,
+                           args);
+    }
+
+    rec.arglen = n > 0 ? (uint16_t)n : 0;
+    rec.level = (uint8_t)level;
+    rec.flags = n < 0 ? REC_RAW : 0;
+    rec.sec = ts->tv_sec;
+    rec.nsec = ts->tv_nsec;
+    rec.site = site;
+    len = (sizeof(rec) + rec.arglen + REC_ALIGN - 1) & ~(REC_ALIGN - 1);
+    rec.len = (uint32_t)len;
+
+    left = r->size - r->head % r->size;
+    if (left < len) {
+        /* pad to the end of the ring */
+        _log_ring_make_room(r, left);
+        padlen = (uint32_t)left;
+        memcpy(r->buf + r->head % r->size, &padlen, 4); /* NOLINT */
+        r->buf[r->head % r->size + 7] = REC_PAD;
+        __atomic_store_n(&r->head, r->head + left, __ATOMIC_RELEASE);
+    }
+
+    _log_ring_make_room(r, len);
+    memcpy(r->buf + r->head % r->size, &rec, sizeof(rec)); /* NOLINT */
+    memcpy(r->buf + r->head % r->size + sizeof(rec), data, /* NOLINT */
+           rec.arglen);
+    __atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+}
+
+/*
+ * Formats one conversion for log_fmt_format() as snprintf() does, but
+ * with log_safe_vformat(), which outputs the conversions it does not
+ * support as is. Async-signal-safe.
+ */
+static int
+_log_ring_print(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    size_t  len;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    va_start(args, fmt);
+    len = log_safe_vformat(buf, size - 1, fmt, args);
+    va_end(args);
+    buf[len] = '\0';
+
+    return (int)len;
+}
+
+/*
+ * Dumps the records of ring r. Async-signal-safe.
+ */
+static void
+_log_ring_dump(struct ring *r)
+{
+    const struct log_spec *spec;
+    struct rec             rec;
+    struct timespec        ts;
+    char                   text[LOG_MAX_LEN];
+    uint64_t               pos;
+    uint64_t               head;
+    uint64_t               tail;
+    size_t                 n = 0;
+    size_t                 len;
+    int                    flen;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    pos = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (pos == head) {
+        return;
+    }
+
+    len = log_safe_format(text, sizeof(text), "flight recorder: thread %u",
+                          r->id);
+    log_dump(LOG_EMERG, NULL, 0, NULL, text, len);
+
+    while (pos < head) {
+        memcpy(&rec, r->buf + pos % r->size, PAD_LEN); /* NOLINT */
+        if (rec.len < PAD_LEN || rec.len > r->size - pos % r->size) {
+            break; /* overwritten */
+        }
+
+        if (!(rec.flags & REC_PAD)) {
+            memcpy(&rec, r->buf + pos % r->size, sizeof(rec)); /* NOLINT */
+
+            /* skip the record if it was overwritten while copied */
+            tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (tail > pos) {
+                pos = tail;
+                continue;
+            }
+
+            flen = -1;
+            spec = rec.site->spec;
+            if (!(rec.flags & REC_RAW) && spec != NULL) {
+                flen = log_fmt_format(text, sizeof(text), rec.site->fmt,
+                                      spec->args, spec->nargs,
+                                      r->buf + pos % r->size + sizeof(rec),
+                                      rec.arglen, _log_ring_print);
+            }
+            len = flen >= 0 ? (size_t)flen
+                            : log_safe_format(text, sizeof(text), "%s",
+                                              rec.site->fmt);
+
+            /* skip the record if it was overwritten while formatted */
+            tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (tail > pos) {
+                pos = tail;
+                continue;
+            }
+
+            ts.tv_sec = rec.sec;
+            ts.tv_nsec = rec.nsec;
+            log_dump((log_level_t)rec.level, rec.site->file, rec.site->line,
+                     &ts, text, len);
+            n++;
+        }
+
+        pos += rec.len;
+    }
+
+    len = log_safe_format(text, sizeof(text),
+                          "flight recorder: end of thread %u, %zu messages",
+                          r->id, n);
+    log_dump(LOG_EMERG, NULL, 0, NULL, text, len);
+}
+
+/*
+ * Dumps the rings of the current generation.
+ */
+static void
+_log_recorder_dump(void)
+{
+    struct ring *r;
+    unsigned     gen = __atomic_load_n(&log_ring_gen, __ATOMIC_RELAXED);
+
+    if (!__atomic_load_n(&log_recording, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r != NULL;
+         r = r->next) {
+        if (__atomic_load_n(&r->gen, __ATOMIC_ACQUIRE) == gen) {
+            _log_ring_dump(r);
+        }
+    }
+}
+
+UTIL_EXPORT void
+log_recorder_dump(void)
+{
+    /* output pending messages first, to keep the log in order */
+    log_flush();
+    _log_recorder_dump();
+}
+
+void
+log_recorder_crash(void)
+{
+    /* pending messages are not flushed, which may deadlock */
+    if (!__atomic_exchange_n(&log_crashed, true, __ATOMIC_ACQ_REL)) {
+        _log_recorder_dump();
+    }
+}
+
+/*
+ * Dumps the rings on a fatal signal, then restores the previous
+ * action of the signal and raises it again.
+ */
+static void
+_log_recorder_signal(int sig)
+{
+    size_t i;
+
+    log_recorder_crash();
+
+    for (i = 0; i < NSIGNALS; i++) {
+        if (log_fatal_signals[i] == sig) {
+            sigaction(sig, &log_old_actions[i], NULL);
+        }
+    }
+
+    raise(sig);
+}
+
+bool
+log_recorder_start(size_t size)
+{
+    struct sigaction sa;
+    size_t           i;
+
+    pthread_once(&log_ring_once, _log_ring_key_create);
+
+    size = size < RING_MIN ? RING_MIN : size;
+    size = (size + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+
+    __atomic_store_n(&log_ring_size, size, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&log_ring_gen, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_crashed, false, __ATOMIC_RELAXED);
+
+    memset(&sa, 0, sizeof(sa)); /* NOLINT */
+    sa.sa_handler = _log_recorder_signal;
+    sigemptyset(&sa.sa_mask);
+
+    for (i = 0; i < NSIGNALS; i++) {
+        sigaction(log_fatal_signals[i], &sa, &log_old_actions[i]);
+    }
+
+    __atomic_store_n(&log_recording, true, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void
+log_recorder_stop(void)
+{
+    size_t i;
+
+    if (!log_recording) {
+        return;
+    }
+
+    __atomic_store_n(&log_recording, false, __ATOMIC_RELEASE);
+
+    for (i = 0; i < NSIGNALS; i++) {
+        sigaction(log_fatal_signals[i], &log_old_actions[i], NULL);
+    }
+}
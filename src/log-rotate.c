@@ -0,0 +1,309 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "assert.h"
+#include "log-private.h"
+#include "util-private.h"
+
+/**
+ * Rotation mechanics:
+ *
+ * Writers never change, close or wait for the log file descriptor.
+ * Instead, the rotator thread opens the new file and dup2()s it onto
+ * the descriptor writers use, which atomically switches it to the
+ * new file: a write in progress completes to the old file, and every
+ * later write goes to the new one. Renaming the old files happens
+ * before, with writes still going to the (renamed) current file, so
+ * no message is lost.
+ *
+ * The rotator thread waits on a semaphore, posted by log_output()
+ * when r->written passes r->size, and by log_reopen(); sem_post() is
+ * async-signal-safe, so log_reopen() may be called from a signal
+ * handler. Time-based rotation is a timeout of the wait.
+ *
+ * A binary log cannot be switched under a writer: each file must begin
+ * with its session record and define its sites before their events.
+ * Binary writers hold log_rotate_lock for reading, with log_rotate_hold(),
+ * and the rotator holds it for writing while it flushes what is still
+ * buffered to the old file, switches files and starts the new session.
+ */
+static struct rotate {
+    const char *name;  /* log file name (const) */
+    int         fd;    /* log file descriptor (const) */
+    size_t      size;  /* rotate after this many bytes, or 0 (const) */
+    unsigned    secs;  /* rotate after this many seconds, or 0 (const) */
+    unsigned    keep;  /* number of rotated files kept (const) */
+    void (*flush)(void);   /* called before each switch (const) */
+    void (*rotated)(void); /* called after each switch (const) */
+
+    size_t written; /* bytes written to the current file */
+    bool   rotate;  /* size-based rotation is requested */
+    bool   reopen;  /* log_reopen() is requested */
+    bool   stop;    /* rotator thread should exit */
+    bool   running;
+
+    pthread_t thread;
+    sem_t     wake; /* signals the rotator thread */
+} rotate;
+
+/* prefer the rotator, which would otherwise wait for a pause in logging */
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t log_rotate_lock
+    = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t log_rotate_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+bool
+log_reopen_fd(const char *name, int fd)
+{
+    int newfd;
+
+    newfd = open(name, O_WRONLY | O_APPEND | O_CREAT, FD_MODE);
+    if (newfd < 0) {
+        return false;
+    }
+
+    if (newfd != fd && dup2(newfd, fd) < 0) {
+        close(newfd);
+        return false;
+    }
+
+    if (newfd != fd) {
+        close(newfd);
+    }
+
+    return true;
+}
+
+/*
+ * Renames name to name.1, shifting older files up to name.<keep>, and
+ * switches the log to a new file.
+ */
+static void
+_log_rotate(void)
+{
+    struct rotate *r = &rotate;
+    size_t         len = strlen(r->name) + 12;
+    char *         from = malloc(len);
+    char *         to = malloc(len);
+    unsigned       i;
+
+    if (from == NULL || to == NULL) {
+        log_stats_error();
+        free(from);
+        free(to);
+        return;
+    }
+
+    for (i = r->keep; i > 1; i--) {
+        snprintf(from, len, "%s.%u", r->name, i - 1);
+        snprintf(to, len, "%s.%u", r->name, i);
+        rename(from, to); /* fails if there is no such file yet */
+    }
+
+    snprintf(to, len, "%s.1", r->name);
+    if (rename(r->name, to) < 0 && errno != ENOENT) {
+        log_stats_error();
+    }
+
+    free(from);
+    free(to);
+}
+
+/*
+ * Reopens the log file after a rotation or log_reopen().
+ */
+static void
+_log_rotate_reopen(void)
+{
+    struct rotate *r = &rotate;
+    struct stat    st;
+
+    pthread_rwlock_wrlock(&log_rotate_lock);
+
+    if (r->flush != NULL) {
+        r->flush();
+    }
+
+    if (!log_reopen_fd(r->name, r->fd)) {
+        log_stats_error();
+        pthread_rwlock_unlock(&log_rotate_lock);
+        return;
+    }
+
+    __atomic_store_n(&r->written,
+                     fstat(r->fd, &st) == 0 ? (size_t)st.st_size : 0,
+                     __ATOMIC_RELAXED);
+
+    if (r->rotated != NULL) {
+        r->rotated();
+    }
+
+    pthread_rwlock_unlock(&log_rotate_lock);
+}
+
+static void *
+_log_rotate_run(void *arg)
+{
+    struct rotate * r = &rotate;
+    struct timespec deadline;
+    int             err;
+
+    UNUSED(arg);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += r->secs;
+
+    for (;;) {
+        if (r->secs > 0) {
+            err = sem_timedwait(&r->wake, &deadline) < 0 ? errno : 0;
+        } else {
+            err = sem_wait(&r->wake) < 0 ? errno : 0;
+        }
+
+        if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        if (err == ETIMEDOUT
+            || __atomic_exchange_n(&r->rotate, false, __ATOMIC_ACQ_REL)) {
+            _log_rotate();
+            _log_rotate_reopen();
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += r->secs;
+        }
+
+        if (__atomic_exchange_n(&r->reopen, false, __ATOMIC_ACQ_REL)) {
+            _log_rotate_reopen();
+        }
+    }
+
+    return NULL;
+}
+
+bool
+log_rotate_start(const char *name, int fd, size_t size, unsigned secs,
+                 unsigned keep, void (*flush)(void), void (*rotated)(void))
+{
+    struct rotate *r = &rotate;
+    struct stat    st;
+    int            err;
+
+    ASSERT(!r->running);
+
+    r->name = name;
+    r->fd = fd;
+    r->size = size;
+    r->secs = secs;
+    r->keep = keep > 0 ? keep : 1;
+    r->flush = flush;
+    r->rotated = rotated;
+    r->written = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    r->rotate = false;
+    r->reopen = false;
+    r->stop = false;
+
+    if (sem_init(&r->wake, 0, 0) < 0) {
+        log_stderr("starting log rotator failed: %s", strerror(errno));
+        return false;
+    }
+
+    err = pthread_create(&r->thread, NULL, _log_rotate_run, NULL);
+    if (err != 0) {
+        log_stderr("starting log rotator thread failed: %s", strerror(err));
+        sem_destroy(&r->wake);
+        return false;
+    }
+
+    __atomic_store_n(&r->running, true, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void
+log_rotate_hold(void)
+{
+    pthread_rwlock_rdlock(&log_rotate_lock);
+}
+
+void
+log_rotate_release(void)
+{
+    pthread_rwlock_unlock(&log_rotate_lock);
+}
+
+void
+log_rotate_written(size_t len)
+{
+    struct rotate *r = &rotate;
+    size_t         written;
+
+    if (r->size == 0) {
+        return;
+    }
+
+    written = __atomic_add_fetch(&r->written, len, __ATOMIC_RELAXED);
+    if (written >= r->size && written - len < r->size
+        && !__atomic_exchange_n(&r->rotate, true, __ATOMIC_ACQ_REL)) {
+        sem_post(&r->wake);
+    }
+}
+
+bool
+log_rotate_reopen(void)
+{
+    struct rotate *r = &rotate;
+
+    if (!__atomic_load_n(&r->running, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    __atomic_store_n(&r->reopen, true, __ATOMIC_RELEASE);
+    sem_post(&r->wake);
+
+    return true;
+}
+
+void
+log_rotate_stop(void)
+{
+    struct rotate *r = &rotate;
+
+    if (!r->running) {
+        return;
+    }
+
+    __atomic_store_n(&r->stop, true, __ATOMIC_RELEASE);
+    sem_post(&r->wake);
+
+    pthread_join(r->thread, NULL);
+
+    sem_destroy(&r->wake);
+    __atomic_store_n(&r->running, false, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,296 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "str.h"
+
+/**
+ * Async-signal-safe formatting:
+ *
+ * Only memory on the stack and pure code are used: no locks, no
+ * allocation, no locale and no stdio. Timestamps are converted to
+ * calendar time arithmetically, in the UTC offset the local time zone
+ * had at log_safe_start(); a later change of the offset, such as for
+ * daylight saving time, is not seen until the next log_init_opts().
+ */
+
+/* seconds east of UTC of local time, at log_safe_start() */
+static long log_utc_offset = 0;
+
+void
+log_safe_start(void)
+{
+#ifdef HAVE_BACKTRACE
+    void *frame[1];
+#endif
+    time_t    now = time(NULL);
+    struct tm tm;
+
+    /* interpreting UTC as local time is off by the UTC offset */
+    gmtime_r(&now, &tm);
+    tm.tm_isdst = -1;
+    log_utc_offset = (long)(now - mktime(&tm));
+
+#ifdef HAVE_BACKTRACE
+    /* the first backtrace() may load libgcc, which allocates */
+    backtrace(frame, 1);
+#endif
+}
+
+/*
+ * Copies the n bytes of s to *p, as many as fit before end.
+ */
+static inline void
+_safe_put(char **p, char *end, const char *s, size_t n)
+{
+    size_t room = (size_t)(end - *p);
+
+    n = n < room ? n : room;
+    memcpy(*p, s, n); /* NOLINT */
+    *p += n;
+}
+
+/*
+ * Outputs the width least significant decimal digits of u.
+ */
+static void
+_safe_digits(char **p, char *end, unsigned long u, int width)
+{
+    char d[24];
+    int  i;
+
+    for (i = width - 1; i >= 0; i--) {
+        d[i] = (char)('0' + u % 10);
+        u /= 10;
+    }
+
+    _safe_put(p, end, d, (size_t)width);
+}
+
+size_t
+log_safe_time(char *buf, size_t size, const char *fmt, time_t sec)
+{
+    char *    p = buf;
+    char *    end = buf + size;
+    long long days;
+    long long z;
+    long long era;
+    long      doe;
+    long      yoe;
+    long      doy;
+    long      mp;
+    long      secs;
+    long long y;
+    long      m;
+    long      d;
+
+    sec += log_utc_offset;
+    days = (long long)sec / 86400;
+    secs = (long)((long long)sec % 86400);
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+
+    /* civil date of days since 1970-01-01, in the proleptic calendar */
+    z = days + 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = (long)(z - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+
+    for (; *fmt != '\0' && p < end; fmt++) {
+        if (*fmt != '%' || fmt[1] == '\0') {
+            *p++ = *fmt;
+            continue;
+        }
+
+        switch (*++fmt) {
+        case 'Y':
+            _safe_digits(&p, end, (unsigned long)y, 4);
+            break;
+        case 'm':
+            _safe_digits(&p, end, (unsigned long)m, 2);
+            break;
+        case 'd':
+            _safe_digits(&p, end, (unsigned long)d, 2);
+            break;
+        case 'H':
+            _safe_digits(&p, end, (unsigned long)(secs / 3600), 2);
+            break;
+        case 'M':
+            _safe_digits(&p, end, (unsigned long)(secs / 60 % 60), 2);
+            break;
+        case 'S':
+            _safe_digits(&p, end, (unsigned long)(secs % 60), 2);
+            break;
+        default:
+            *p++ = *fmt;
+            break;
+        }
+    }
+
+    return (size_t)(p - buf);
+}
+
+size_t
+log_safe_vformat(char *buf, size_t size, const char *fmt, va_list args)
+{
+    char *             p = buf;
+    char *             end = buf + size;
+    const char *       f;
+    const char *       s;
+    char               num[24];
+    char *             n;
+    unsigned long long u;
+    long long          v;
+    int                lmod;
+    int                prec;
+    char               c;
+
+    for (;;) {
+        for (f = fmt; *f != '%' && *f != '\0'; f++) {
+            /* find the next conversion */
+        }
+        _safe_put(&p, end, fmt, (size_t)(f - fmt));
+        if (*f == '\0') {
+            break;
+        }
+        fmt = f++;
+
+        /* flags and widths are accepted, and ignored */
+        while (*f == '-' || *f == '0' || *f == '#' || *f == ' '
+               || *f == '+' || (*f >= '1' && *f <= '9')) {
+            f++;
+        }
+
+        prec = -1;
+        if (*f == '.') {
+            f++;
+            if (*f == '*') {
+                prec = va_arg(args, int);
+                f++;
+            } else {
+                for (prec = 0; *f >= '0' && *f <= '9'; f++) {
+                    prec = prec * 10 + (*f - '0');
+                }
+            }
+        }
+
+        lmod = 0;
+        if (*f == 'z') {
+            lmod = 'z';
+            f++;
+        } else if (*f == 'l') {
+            lmod = 'l';
+            if (*++f == 'l') {
+                lmod = 'L';
+                f++;
+            }
+        }
+
+        n = num + sizeof(num);
+
+        switch (*f) {
+        case '%':
+            _safe_put(&p, end, "%", 1);
+            break;
+        case 'c':
+            c = (char)va_arg(args, int);
+            _safe_put(&p, end, &c, 1);
+            break;
+        case 's':
+            s = va_arg(args, const char *);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            _safe_put(&p, end, s, prec >= 0 ? strnlen(s, (size_t)prec)
+                                            : strlen(s));
+            break;
+        case 'd':
+        case 'i':
+            v = lmod == 'L'   ? va_arg(args, long long)
+                : lmod == 'l' ? va_arg(args, long)
+                : lmod == 'z' ? (long long)va_arg(args, ssize_t)
+                              : va_arg(args, int);
+            n = str_utoa(n, v < 0 ? 0ULL - (unsigned long long)v
+                                  : (unsigned long long)v);
+            if (v < 0) {
+                *--n = '-';
+            }
+            _safe_put(&p, end, n, (size_t)(num + sizeof(num) - n));
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'p':
+            if (*f == 'p') {
+                u = (unsigned long long)(uintptr_t)va_arg(args, void *);
+            } else {
+                u = lmod == 'L'   ? va_arg(args, unsigned long long)
+                    : lmod == 'l' ? va_arg(args, unsigned long)
+                    : lmod == 'z' ? va_arg(args, size_t)
+                                  : va_arg(args, unsigned);
+            }
+            if (*f == 'u') {
+                n = str_utoa(n, u);
+            } else {
+                s = *f == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+                do {
+                    *--n = s[u & 0xf];
+                    u >>= 4;
+                } while (u != 0);
+                if (*f == 'p') {
+                    *--n = 'x';
+                    *--n = '0';
+                }
+            }
+            _safe_put(&p, end, n, (size_t)(num + sizeof(num) - n));
+            break;
+        default:
+            /* the arguments cannot be followed: output the rest as is */
+            _safe_put(&p, end, fmt, strlen(fmt));
+            return (size_t)(p - buf);
+        }
+
+        fmt = f + 1;
+    }
+
+    return (size_t)(p - buf);
+}
+
+size_t
+log_safe_format(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    size_t  len;
+
+    va_start(args, fmt);
+    len = log_safe_vformat(buf, size, fmt, args);
+    va_end(args);
+
+    return len;
+}
@@ -0,0 +1,499 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "str.h"
+#include "util-private.h"
+#include "xwrite.h"
+
+/**
+ * Sink mechanics:
+ *
+ * Sinks are added to log_sinks under log_sink_lock, and published by
+ * a release store of log_nsinks; log_sinks_output() reads them without
+ * locking. They are only removed by log_sinks_stop(), from
+ * log_deinit(), which must not race with logging.
+ *
+ * log_sinks_level is the least severe level of any sink, or -1. The
+ * macros admit it (see log-level.c), so a message may be formatted
+ * for the sinks only.
+ *
+ * LOG_SINK_SYSLOG and LOG_SINK_JOURNAL write each message as one
+ * datagram, without libc's syslog(3): its header, most of which is
+ * formatted once by log_sink_add(), and the message, gathered by
+ * sendmsg(2) or copied into a batch of datagrams (see log-buffer.c).
+ * The levels are syslog severities, so map to priorities directly.
+ */
+struct sink {
+    log_sink_type_t    type;
+    log_level_t        level;
+    int                fd;     /* output, or socket of a datagram sink */
+    bool               owned;  /* fd was opened for the sink */
+    bool               text;   /* messages are in LOG_FORMAT_TEXT */
+    struct log_buffer *buffer; /* buffer of messages, or NULL */
+    struct log_mmap *  map;    /* mapping of LOG_SINK_MMAP */
+    struct log_dedup * dedup;  /* duplicate suppression, or NULL */
+    size_t             hlen;   /* length of header */
+
+    /*
+     * Constant fields of the datagram header: for LOG_SINK_SYSLOG,
+     * " HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA ", following the
+     * timestamp; for LOG_SINK_JOURNAL, the fields other than PRIORITY
+     * and MESSAGE.
+     */
+    char header[384];
+};
+
+/* syslog facility of messages, LOG_USER in <syslog.h> */
+#define SYSLOG_FACILITY 1
+
+/* most datagrams batched by a sink */
+#define SINK_MAX_BATCH 1024
+
+/* longest datagram header, without the constant fields */
+#define SINK_MAX_HEADER 64
+
+/* longest APP-NAME of RFC 5424 */
+#define SYSLOG_MAX_IDENT 48
+
+int log_sinks_level = -1;
+
+static struct sink     log_sinks[LOG_MAX_SINKS];
+static unsigned        log_nsinks = 0;
+static pthread_mutex_t log_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Per-thread cache of the "YYYY-mm-ddTHH:MM:SS" prefix of RFC 5424
+ * timestamps, which changes at most once per second.
+ */
+static THREAD_LOCAL struct {
+    time_t sec;     /* second the prefix was formatted for, plus one */
+    char   buf[24]; /* formatted prefix */
+} log_sink_ts;
+
+/*
+ * Connects a datagram socket to the socket at path. Returns the
+ * socket, or -1 on failure.
+ */
+static int
+_log_sink_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int                fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr)); /* NOLINT */
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path); /* NOLINT */
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Formats the constant fields of the datagram header of s, with the
+ * identifier ident (the program name if NULL).
+ */
+static void
+_log_sink_header(struct sink *s, const char *ident)
+{
+    char   host[256];
+    char   app[SYSLOG_MAX_IDENT + 1];
+    size_t i;
+
+    ident = ident != NULL ? ident : log_progname();
+    ident = ident != NULL && *ident != '\0' ? ident : "-";
+
+    if (s->type == LOG_SINK_JOURNAL) {
+        s->hlen = (size_t)scnformat(s->header, sizeof(s->header),
+                                    "SYSLOG_FACILITY=%d\n"
+                                    "SYSLOG_IDENTIFIER=%s\n"
+                                    "SYSLOG_PID=%ld\n",
+                                    SYSLOG_FACILITY, ident, (long)getpid());
+        return;
+    }
+
+    /* RFC 5424 fields are printable ASCII, without spaces */
+    for (i = 0; i < SYSLOG_MAX_IDENT && ident[i] != '\0'; i++) {
+        app[i] = ident[i] > ' ' && ident[i] < 0x7f ? ident[i] : '_';
+    }
+    app[i] = '\0';
+
+    if (gethostname(host, sizeof(host)) < 0 || host[0] == '\0') {
+        strcpy(host, "-"); /* NOLINT */
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    s->hlen = (size_t)scnformat(s->header, sizeof(s->header),
+                                " %s %s %ld - - ", host, app,
+                                (long)getpid());
+}
+
+/*
+ * Formats pri, of up to three digits, into p, and returns its length.
+ */
+static size_t
+_log_sink_pri(char *p, int pri)
+{
+    char  digits[4];
+    char *d = str_utoa(digits + sizeof(digits), (unsigned long long)pri);
+
+    memcpy(p, d, (size_t)(digits + sizeof(digits) - d)); /* NOLINT */
+
+    return (size_t)(digits + sizeof(digits) - d);
+}
+
+/*
+ * Formats the RFC 5424 timestamp of ts, in UTC and microseconds, into
+ * p, and returns its length.
+ */
+static size_t
+_log_sink_time(char *p, const struct timespec *ts)
+{
+    struct tm tm;
+    char      frac[8];
+    char *    f = frac + sizeof(frac);
+    long      usec = ts->tv_nsec / 1000;
+    int       i;
+
+    if (log_sink_ts.sec != ts->tv_sec + 1) {
+        gmtime_r(&ts->tv_sec, &tm);
+        strftime(log_sink_ts.buf, sizeof(log_sink_ts.buf),
+                 "%Y-%m-%dT%H:%M:%S", &tm);
+        log_sink_ts.sec = ts->tv_sec + 1;
+    }
+
+    *--f = 'Z';
+    for (i = 0; i < 6; i++, usec /= 10) {
+        *--f = (char)('0' + usec % 10);
+    }
+    *--f = '.';
+
+    memcpy(p, log_sink_ts.buf, 19);                      /* NOLINT */
+    memcpy(p + 19, f, (size_t)(frac + sizeof(frac) - f)); /* NOLINT */
+
+    return 19 + (size_t)(frac + sizeof(frac) - f);
+}
+
+/*
+ * Sends a formatted message of len bytes, whose timestamp ts is its
+ * first tslen bytes, to the socket of s as one datagram, without its
+ * newline.
+ */
+static void
+_log_sink_send(struct sink *s, log_level_t level, const char *buf,
+               size_t len, size_t tslen, const struct timespec *ts)
+{
+    struct iovec iov[3];
+    char         head[SINK_MAX_HEADER + sizeof(s->header)];
+    char *       p = head;
+    uint64_t     n;
+    int          i;
+
+    if (len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+
+    /* the header carries the timestamp */
+    if (s->text && tslen < len) {
+        buf += tslen + 1;
+        len -= tslen + 1;
+    }
+
+    if (s->type == LOG_SINK_JOURNAL) {
+        memcpy(p, "PRIORITY=", 9); /* NOLINT */
+        p += 9;
+        *p++ = (char)('0' + (int)level);
+        *p++ = '\n';
+        memcpy(p, s->header, s->hlen); /* NOLINT */
+        p += s->hlen;
+
+        /* the binary form of MESSAGE, which may contain newlines */
+        memcpy(p, "MESSAGE\n", 8); /* NOLINT */
+        p += 8;
+        for (i = 0, n = len; i < 8; i++, n >>= 8) {
+            *p++ = (char)(n & 0xff);
+        }
+    } else {
+        /* "<PRI>1 TIMESTAMP", PRI being the facility and severity */
+        *p++ = '<';
+        p += _log_sink_pri(p, SYSLOG_FACILITY * 8 + (int)level);
+        memcpy(p, ">1 ", 3); /* NOLINT */
+        p += 3;
+        p += _log_sink_time(p, ts);
+        memcpy(p, s->header, s->hlen); /* NOLINT */
+        p += s->hlen;
+    }
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = (size_t)(p - head);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+
+    /* a journal field ends in a newline */
+    i = s->type == LOG_SINK_JOURNAL ? 3 : 2;
+
+    if (s->buffer != NULL) {
+        log_buffer_send(s->buffer, iov, i, level <= LOG_CRIT);
+    } else if (writev(s->fd, iov, i) < 0) {
+        log_stats_error();
+    }
+}
+
+/*
+ * Writes a formatted message of len bytes, whose timestamp ts is its
+ * first tslen bytes, to the sink arg.
+ */
+static void
+_log_sink_write(void *arg, log_level_t level, const char *buf, size_t len,
+                size_t tslen, const struct timespec *ts)
+{
+    struct sink *s = arg;
+
+    log_stats_bytes(len);
+    if (s->type == LOG_SINK_SYSLOG || s->type == LOG_SINK_JOURNAL) {
+        _log_sink_send(s, level, buf, len, tslen, ts);
+    } else if (s->buffer != NULL) {
+        log_buffer_write(s->buffer, buf, len, level <= LOG_CRIT);
+    } else if (s->map != NULL) {
+        if (!log_mmap_write(s->map, buf, len)) {
+            log_stats_error();
+        }
+    } else if (xwrite(s->fd, buf, len) < 0) {
+        log_stats_error();
+    }
+}
+
+/*
+ * Closes the outputs of s.
+ */
+static void
+_log_sink_close(struct sink *s)
+{
+    if (s->buffer != NULL) {
+        log_buffer_stop(s->buffer);
+    }
+    if (s->map != NULL) {
+        log_mmap_stop(s->map);
+    }
+    if (s->owned) {
+        close(s->fd);
+    }
+}
+
+bool
+log_sink_add(const struct log_sink_options *opts, bool text)
+{
+    struct sink  sink;
+    const char * name = opts->filename;
+    unsigned     batch;
+    unsigned     n;
+    bool         ok = false;
+
+    memset(&sink, 0, sizeof(sink)); /* NOLINT */
+    sink.type = opts->type;
+    sink.level = opts->level;
+    sink.fd = -1;
+    sink.text = text;
+
+    pthread_mutex_lock(&log_sink_lock);
+
+    n = log_nsinks;
+    if (n == LOG_MAX_SINKS) {
+        log_stderr("adding log sink failed: too many sinks");
+        goto out;
+    }
+
+    switch (opts->type) {
+    case LOG_SINK_FD:
+        sink.fd = opts->fd;
+        break;
+    case LOG_SINK_FILE:
+    case LOG_SINK_MMAP:
+        if (name == NULL) {
+            log_stderr("adding log sink failed: no file name");
+            goto out;
+        }
+        /* a shared writable mapping requires read access */
+        sink.fd = open(name,
+                       (opts->type == LOG_SINK_MMAP ? O_RDWR : O_WRONLY)
+                           | O_APPEND | O_CREAT,
+                       FD_MODE);
+        break;
+    case LOG_SINK_SYSLOG:
+        name = name != NULL ? name : LOG_SYSLOG_PATH;
+        sink.fd = _log_sink_connect(name);
+        break;
+    case LOG_SINK_JOURNAL:
+        name = name != NULL ? name : LOG_JOURNAL_PATH;
+        sink.fd = _log_sink_connect(name);
+        break;
+    default:
+        log_stderr("adding log sink failed: unknown type %d",
+                   (int)opts->type);
+        goto out;
+    }
+
+    if (sink.fd < 0) {
+        log_stderr("opening log sink '%s' failed: %s",
+                   name != NULL ? name : "", strerror(errno));
+        goto out;
+    }
+    sink.owned = opts->type != LOG_SINK_FD;
+
+    if (opts->type == LOG_SINK_SYSLOG || opts->type == LOG_SINK_JOURNAL) {
+        _log_sink_header(&sink, opts->ident);
+    }
+
+    if (opts->type == LOG_SINK_FILE && opts->buffer > 0) {
+        sink.buffer = log_buffer_start(sink.fd, opts->buffer, LOG_FLUSH_MS);
+        if (sink.buffer == NULL) {
+            close(sink.fd);
+            goto out;
+        }
+    } else if (opts->type == LOG_SINK_MMAP) {
+        sink.map = log_mmap_start(sink.fd, opts->mmap);
+        if (sink.map == NULL) {
+            close(sink.fd);
+            goto out;
+        }
+    } else if (sink.hlen > 0 && opts->buffer > 0) {
+        batch = opts->buffer < SINK_MAX_BATCH ? (unsigned)opts->buffer
+                                              : SINK_MAX_BATCH;
+        sink.buffer = log_buffer_start_batch(
+            sink.fd, batch,
+            batch * (SINK_MAX_HEADER + sink.hlen + LOG_MAX_LEN + 1),
+            LOG_FLUSH_MS);
+        if (sink.buffer == NULL) {
+            close(sink.fd);
+            goto out;
+        }
+    }
+
+    if (opts->dedup_ms > 0) {
+        sink.dedup = log_dedup_create(opts->dedup_ms);
+        if (sink.dedup == NULL) {
+            log_stderr("adding log sink failed: %s", strerror(ENOMEM));
+            _log_sink_close(&sink);
+            goto out;
+        }
+    }
+
+    log_sinks[n] = sink;
+    __atomic_store_n(&log_nsinks, n + 1, __ATOMIC_RELEASE);
+
+    if ((int)opts->level > log_sinks_level) {
+        __atomic_store_n(&log_sinks_level, (int)opts->level,
+                         __ATOMIC_RELAXED);
+    }
+
+    ok = true;
+
+out:
+    pthread_mutex_unlock(&log_sink_lock);
+
+    return ok;
+}
+
+void
+log_sinks_output(log_level_t level, const char *buf, size_t len,
+                 size_t tslen, const struct timespec *ts)
+{
+    struct sink *s;
+    unsigned     n = __atomic_load_n(&log_nsinks, __ATOMIC_ACQUIRE);
+    unsigned     i;
+
+    for (i = 0; i < n; i++) {
+        s = &log_sinks[i];
+        if (level > s->level) {
+            continue;
+        }
+
+        if (s->dedup != NULL) {
+            log_output_dedup(s->dedup, level, buf, len, tslen, ts,
+                             _log_sink_write, s);
+        } else {
+            _log_sink_write(s, level, buf, len, tslen, ts);
+        }
+    }
+}
+
+void
+log_sinks_flush(void)
+{
+    unsigned n = __atomic_load_n(&log_nsinks, __ATOMIC_ACQUIRE);
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (log_sinks[i].dedup != NULL) {
+            log_dedup_flush(log_sinks[i].dedup, _log_sink_write,
+                            &log_sinks[i]);
+        }
+        if (log_sinks[i].buffer != NULL) {
+            log_buffer_flush(log_sinks[i].buffer);
+        }
+    }
+}
+
+void
+log_sinks_stop(void)
+{
+    struct sink *s;
+    unsigned     i;
+
+    pthread_mutex_lock(&log_sink_lock);
+
+    for (i = 0; i < log_nsinks; i++) {
+        s = &log_sinks[i];
+        if (s->dedup != NULL) {
+            log_dedup_flush(s->dedup, _log_sink_write, s);
+            log_dedup_destroy(s->dedup);
+        }
+        _log_sink_close(s);
+    }
+
+    __atomic_store_n(&log_nsinks, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_sinks_level, -1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&log_sink_lock);
+}
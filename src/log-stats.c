@@ -0,0 +1,232 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <pthread.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-private.h"
+#include "util-private.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+/**
+ * Statistics mechanics:
+ *
+ * Each thread counts into its own shard, which only it writes, with
+ * relaxed loads and stores rather than atomic read-modify-writes, so
+ * counting takes no lock and shares no cache line. log_stats() sums
+ * the shards with relaxed loads; each counter is exact, but counters
+ * may be sampled at slightly different times.
+ *
+ * Shards are linked into log_shards and never freed: when a thread
+ * exits, its shard is released for reuse by a new thread, which keeps
+ * adding to its counts. Counts are therefore never lost, and the
+ * number of shards is the peak number of logging threads.
+ */
+struct shard {
+    struct shard *next;  /* next shard in log_shards (const) */
+    bool          owned; /* the shard is owned by a thread */
+    uint64_t      messages[LOG_DEBUG + 1];
+    uint64_t      bytes;
+    uint64_t      truncated;
+    uint64_t      suppressed;
+    uint64_t      latency[LOG_LATENCY_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* number of errors during logging */
+uint64_t log_nerror = 0;
+
+/* all shards */
+static struct shard *log_shards = NULL;
+
+/* shard of the calling thread */
+static THREAD_LOCAL struct shard *log_shard = NULL;
+
+/* releases the shard of an exiting thread */
+static pthread_key_t  log_shard_key;
+static pthread_once_t log_shard_once = PTHREAD_ONCE_INIT;
+
+static void
+_log_shard_release(void *arg)
+{
+    struct shard *s = arg;
+
+    __atomic_store_n(&s->owned, false, __ATOMIC_RELEASE);
+}
+
+static void
+_log_shard_key_create(void)
+{
+    pthread_key_create(&log_shard_key, _log_shard_release);
+}
+
+/*
+ * Acquires a shard for the calling thread, reusing a released shard if
+ * there is one. Returns NULL if one cannot be allocated, in which case
+ * the thread's counts are not kept.
+ */
+static struct shard *
+_log_shard_acquire(void)
+{
+    struct shard *s;
+    bool          owned;
+
+    pthread_once(&log_shard_once, _log_shard_key_create);
+
+    for (s = __atomic_load_n(&log_shards, __ATOMIC_ACQUIRE); s != NULL;
+         s = s->next) {
+        owned = false;
+        if (__atomic_compare_exchange_n(&s->owned, &owned, true, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (s == NULL) {
+        /* not xmalloc(), which may log */
+        if (posix_memalign((void **)&s, CACHE_LINE_SIZE, sizeof(*s)) != 0) {
+            return NULL;
+        }
+
+        memset(s, 0, sizeof(*s)); /* NOLINT */
+        s->owned = true;
+        s->next = __atomic_load_n(&log_shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_shards, &s->next, s, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(log_shard_key, s);
+    log_shard = s;
+
+    return s;
+}
+
+static inline struct shard *
+_log_shard(void)
+{
+    struct shard *s = log_shard;
+
+    return s != NULL ? s : _log_shard_acquire();
+}
+
+/*
+ * Adds n to a counter of the calling thread's shard.
+ */
+static inline void
+_log_count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+void
+log_stats_message(log_level_t level)
+{
+    struct shard *s = _log_shard();
+
+    if (s != NULL) {
+        _log_count(&s->messages[(unsigned)level & 7], 1);
+    }
+}
+
+void
+log_stats_bytes(size_t len)
+{
+    struct shard *s = _log_shard();
+
+    if (s != NULL) {
+        _log_count(&s->bytes, len);
+    }
+}
+
+void
+log_stats_truncated(void)
+{
+    struct shard *s = _log_shard();
+
+    if (s != NULL) {
+        _log_count(&s->truncated, 1);
+    }
+}
+
+void
+log_stats_suppressed(void)
+{
+    struct shard *s = _log_shard();
+
+    if (s != NULL) {
+        _log_count(&s->suppressed, 1);
+    }
+}
+
+void
+log_stats_latency(const struct timespec *start)
+{
+    struct shard *  s = _log_shard();
+    struct timespec now;
+    int64_t         ns;
+    unsigned        i;
+
+    if (s == NULL) {
+        return;
+    }
+
+    log_clock_now(&now);
+    ns = (int64_t)(now.tv_sec - start->tv_sec) * NSEC_PER_SEC
+         + (now.tv_nsec - start->tv_nsec);
+
+    /* bucket i counts calls taking [2^i, 2^(i+1)) nanoseconds */
+    i = ns > 1 ? 63 - (unsigned)__builtin_clzll((uint64_t)ns) : 0;
+    if (i >= LOG_LATENCY_BUCKETS) {
+        i = LOG_LATENCY_BUCKETS - 1;
+    }
+
+    _log_count(&s->latency[i], 1);
+}
+
+UTIL_EXPORT void
+log_stats(struct log_stats *stats)
+{
+    struct shard *s;
+    unsigned      i;
+
+    memset(stats, 0, sizeof(*stats)); /* NOLINT */
+
+    for (s = __atomic_load_n(&log_shards, __ATOMIC_ACQUIRE); s != NULL;
+         s = s->next) {
+        for (i = 0; i <= LOG_DEBUG; i++) {
+            stats->messages[i] +=
+                __atomic_load_n(&s->messages[i], __ATOMIC_RELAXED);
+        }
+        stats->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+        stats->truncated += __atomic_load_n(&s->truncated, __ATOMIC_RELAXED);
+        stats->suppressed +=
+            __atomic_load_n(&s->suppressed, __ATOMIC_RELAXED);
+        for (i = 0; i < LOG_LATENCY_BUCKETS; i++) {
+            stats->latency[i] +=
+                __atomic_load_n(&s->latency[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    stats->errors = __atomic_load_n(&log_nerror, __ATOMIC_RELAXED);
+    stats->dropped = log_async_dropped();
+}
@@ -0,0 +1,219 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <sched.h>
+#include <util/log.h>
+
+#ifdef __linux__
+#    include <sys/syscall.h>
+#endif
+
+#include "log-private.h"
+#include "str.h"
+#include "util-private.h"
+
+/**
+ * Thread tagging mechanics:
+ *
+ * Each thread formats the constant part of its tag (its id, and its
+ * name if it has one) once, into a per-thread cache, in the style of
+ * the log. Only the CPU is looked up per message, by sched_getcpu(),
+ * which glibc answers from the vDSO or the rseq area without a system
+ * call. The cache is reformatted when the style or name changes, and
+ * cleared in the child after fork(), whose thread has a new id.
+ *
+ * A thread's name is the one given to log_set_thread_name(), or else
+ * the one its first message finds set by pthread_setname_np(), unless
+ * that is only inherited from the process.
+ */
+
+/* longest thread name, as for pthread_setname_np() */
+#define THREAD_NAME_MAX 16
+
+static THREAD_LOCAL struct {
+    bool   valid;                 /* prefix is formatted */
+    int    style;                 /* style prefix was formatted in */
+    bool   named;                 /* name was set by log_set_thread_name() */
+    char   name[THREAD_NAME_MAX]; /* name of the thread, or "" */
+    size_t len;                   /* length of prefix */
+    char   prefix[64];            /* formatted tag, without the CPU */
+} log_thread;
+
+static pthread_once_t log_thread_once = PTHREAD_ONCE_INIT;
+
+const char *
+log_progname(void)
+{
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME
+    return program_invocation_short_name;
+#elif defined(HAVE_GETPROGNAME)
+    return getprogname();
+#else
+    return NULL;
+#endif
+}
+
+static void
+_log_thread_atfork(void)
+{
+    log_thread.valid = false;
+}
+
+static void
+_log_thread_init(void)
+{
+    pthread_atfork(NULL, NULL, _log_thread_atfork);
+}
+
+static long
+_log_thread_id(void)
+{
+#if defined(HAVE_GETTID)
+    return (long)gettid();
+#elif defined(SYS_gettid)
+    return (long)syscall(SYS_gettid);
+#else
+    return (long)getpid();
+#endif
+}
+
+/*
+ * Copies name into the cache, replacing characters that would need
+ * quoting or escaping with '_'.
+ */
+static void
+_log_thread_name(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < THREAD_NAME_MAX - 1 && name[i] != '\0'; i++) {
+        log_thread.name[i] = name[i] > ' ' && name[i] < 0x7f
+                                     && name[i] != '"' && name[i] != '\\'
+                                     && name[i] != '='
+                                 ? name[i]
+                                 : '_';
+    }
+    log_thread.name[i] = '\0';
+}
+
+/*
+ * Formats the cached tag of the calling thread in style.
+ */
+static void
+_log_thread_format(int style)
+{
+    char * p = log_thread.prefix;
+    size_t size = sizeof(log_thread.prefix);
+    long   tid;
+
+    pthread_once(&log_thread_once, _log_thread_init);
+
+    tid = _log_thread_id();
+
+#ifdef HAVE_PTHREAD_GETNAME_NP
+    if (!log_thread.named) {
+        const char *prog = log_progname();
+        char        name[THREAD_NAME_MAX];
+
+        log_thread.name[0] = '\0';
+        if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0
+            && (prog == NULL
+                || strncmp(name, prog, THREAD_NAME_MAX - 1) != 0)) {
+            _log_thread_name(name);
+        }
+    }
+#endif
+
+    switch (style) {
+    case LOG_THREAD_LOGFMT:
+        log_thread.len = (size_t)(
+            log_thread.name[0] != '\0'
+                ? scnformat(p, size, " tid=%ld thread=%s cpu=", tid,
+                            log_thread.name)
+                : scnformat(p, size, " tid=%ld cpu=", tid));
+        break;
+    case LOG_THREAD_JSON:
+        log_thread.len = (size_t)(
+            log_thread.name[0] != '\0'
+                ? scnformat(p, size,
+                            ",\"tid\":%ld,\"thread\":\"%s\",\"cpu\":", tid,
+                            log_thread.name)
+                : scnformat(p, size, ",\"tid\":%ld,\"cpu\":", tid));
+        break;
+    default:
+        log_thread.len = (size_t)(
+            log_thread.name[0] != '\0'
+                ? scnformat(p, size, " [%ld %s ", tid, log_thread.name)
+                : scnformat(p, size, " [%ld ", tid));
+        break;
+    }
+
+    log_thread.style = style;
+    log_thread.valid = true;
+}
+
+size_t
+log_thread_tag(char *buf, size_t size, int style)
+{
+    const char *none = style == LOG_THREAD_JSON ? "null" : "-";
+    char        cpu[24];
+    char *      c = cpu + sizeof(cpu);
+    size_t      len;
+    int         n = -1;
+
+    if (!log_thread.valid || log_thread.style != style) {
+        _log_thread_format(style);
+    }
+
+#ifdef HAVE_SCHED_GETCPU
+    n = sched_getcpu();
+#endif
+
+    if (style == LOG_THREAD_TEXT) {
+        *--c = ']';
+    }
+    if (n >= 0) {
+        c = str_utoa(c, (unsigned long long)n);
+    } else {
+        c -= strlen(none);
+        memcpy(c, none, strlen(none)); /* NOLINT */
+    }
+
+    len = log_thread.len + (size_t)(cpu + sizeof(cpu) - c);
+    if (len > size) {
+        return 0;
+    }
+
+    memcpy(buf, log_thread.prefix, log_thread.len); /* NOLINT */
+    memcpy(buf + log_thread.len, c, len - log_thread.len); /* NOLINT */
+
+    return len;
+}
+
+UTIL_EXPORT void
+log_set_thread_name(const char *name)
+{
+    log_thread.named = name != NULL;
+    if (name != NULL) {
+        _log_thread_name(name);
+    }
+    log_thread.valid = false;
+}
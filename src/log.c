@@ -19,41 +19,160 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <portable/system.h>
-#include <sys/time.h>
+#include <pthread.h>
 #include <time.h>
 #include <util/log.h>
 
+#include "log-private.h"
 #include "str.h"
 #include "util-private.h"
 #include "xwrite.h"
 
-/* log fd mode */
-#define FD_MODE 0644
+/* log_flush() is registered to run at process exit */
+static bool log_atexit = false;
 
-/* number of errors during logging */
-static uint32_t log_nerror = 0;
+/* messages less severe than this are not logged; see log_loggable() */
+UTIL_EXPORT log_level_t log_threshold = LOG_EMERG;
 
 static struct logger {
-    char *      name;  /* log file name */
-    log_level_t level; /* log level */
-    int         fd;    /* log file descriptor */
-} logger;
+    char *          name;      /* log file name */
+    int             fd;        /* log file descriptor */
+    bool            async;     /* messages are queued for the writer thread */
+    struct log_buffer *buffer; /* buffer of messages, or NULL */
+    bool            binary;    /* output is LOG_FORMAT_BINARY */
+    bool            fields;    /* output is logfmt or JSON fields */
+    bool            json;      /* output is LOG_FORMAT_JSON */
+    bool            rotating;  /* the rotator thread is running */
+    struct log_mmap *map;      /* memory map of output, or NULL */
+    struct log_dedup *dedup;   /* duplicate suppression, or NULL */
+    bool            thread;    /* messages are tagged with their thread */
+    bool            latency;   /* message latency is measured */
+    log_precision_t precision; /* timestamp resolution */
+    const char *    ts_format; /* strftime() format of timestamps */
+    const char *    ts_close;  /* suffix of timestamps */
+} logger = {.ts_format = "[%Y-%m-%d %H:%M:%S.", .ts_close = "]"};
+
+/*
+ * Per-thread cache of the "[YYYY-mm-dd HH:MM:SS." timestamp prefix (or
+ * its structured equivalent), which changes at most once per second.
+ */
+static THREAD_LOCAL struct {
+    time_t      sec;     /* second the prefix was formatted for */
+    const char *format;  /* logger.ts_format the prefix was formatted by */
+    size_t      len;     /* length of prefix */
+    char        buf[32]; /* formatted prefix */
+} log_ts;
+
+/*
+ * Per-thread buffer of messages longer than LOG_MAX_LEN, grown as
+ * needed and reused, and freed when the thread exits.
+ */
+static THREAD_LOCAL char * log_scratch = NULL;
+static THREAD_LOCAL size_t log_scratch_size = 0;
+static pthread_key_t       log_scratch_key;
+static pthread_once_t      log_scratch_once = PTHREAD_ONCE_INIT;
 
 /* internal helper for logging to stdout/stderr */
 void _log_std(int fd, const char *msg, va_list args)
     __attribute__((format(printf, 2, 0)));
 
+/*
+ * Called by the rotator thread before switching to a new file, so
+ * buffered messages are written to the file they were logged to.
+ */
+static void
+_log_rotate_flush(void)
+{
+    if (logger.async) {
+        log_async_flush();
+    } else if (logger.buffer != NULL) {
+        log_buffer_flush(logger.buffer);
+    }
+}
+
+/*
+ * Called by the rotator thread after switching to a new file, which
+ * must begin a new binary log session.
+ */
+static void
+_log_rotated(void)
+{
+    if (logger.binary) {
+        log_binary_start(logger.precision);
+    }
+}
+
+/*
+ * Outputs a message to the log, for log_output_dedup().
+ */
+static void
+_log_output_primary(void *arg, log_level_t level, const char *buf,
+                    size_t len, size_t tslen, const struct timespec *ts)
+{
+    UNUSED(arg);
+    UNUSED(tslen);
+    UNUSED(ts);
+
+    log_output(level, buf, len);
+}
+
 UTIL_EXPORT bool
 log_init(log_level_t level, char *filename)
+{
+    struct log_options opts;
+
+    memset(&opts, 0, sizeof(opts)); /* NOLINT */
+    opts.level = level;
+    opts.filename = filename;
+
+    return log_init_opts(&opts);
+}
+
+UTIL_EXPORT bool
+log_init_opts(const struct log_options *opts)
 {
     struct logger *l = &logger;
+    char *         filename = opts->filename;
 
-    l->level = level;
+    __atomic_store_n(&log_threshold, opts->level, __ATOMIC_RELAXED);
+    log_safe_start();
+    if (opts->recorder > 0) {
+        log_recorder_start(opts->recorder);
+    }
+    log_levels_update();
     l->name = filename;
+    l->async = false;
+    l->buffer = NULL;
+    l->rotating = false;
+    l->map = NULL;
+    l->dedup = NULL;
+    l->binary = opts->format == LOG_FORMAT_BINARY;
+    l->latency = opts->latency;
+    l->thread = opts->thread;
+    l->fields = opts->format == LOG_FORMAT_LOGFMT
+                || opts->format == LOG_FORMAT_JSON;
+    l->json = opts->format == LOG_FORMAT_JSON;
+    if (opts->format == LOG_FORMAT_LOGFMT) {
+        l->ts_format = "ts=%Y-%m-%dT%H:%M:%S.";
+        l->ts_close = "";
+    } else if (opts->format == LOG_FORMAT_JSON) {
+        l->ts_format = "{\"ts\":\"%Y-%m-%dT%H:%M:%S.";
+        l->ts_close = "\"";
+    } else {
+        l->ts_format = "[%Y-%m-%d %H:%M:%S.";
+        l->ts_close = "]";
+    }
+    l->precision = opts->precision;
+    log_clock_start(opts->clock, l->precision);
+
     if (filename == NULL || !strnlen(filename, LOG_MAX_FILENAME)) {
         l->fd = STDERR_FILENO;
     } else {
-        l->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, FD_MODE);
+        /* a shared writable mapping requires read access */
+        l->fd = open(filename,
+                     (opts->mmap > 0 ? O_RDWR : O_WRONLY) | O_APPEND
+                         | O_CREAT,
+                     FD_MODE);
         if (l->fd < 0) {
             log_stderr("opening log file '%s' failed: %s", filename,
                        strerror(errno));
@@ -61,44 +180,524 @@ log_init(log_level_t level, char *filename)
         }
     }
 
+    if (opts->mmap > 0 && l->fd != STDERR_FILENO) {
+        l->map = log_mmap_start(l->fd, opts->mmap);
+        if (l->map == NULL) {
+            log_deinit();
+            return false;
+        }
+    } else if (opts->async > 0) {
+        if (!log_async_start(l->fd, opts->async, opts->overflow)) {
+            log_deinit();
+            return false;
+        }
+        l->async = true;
+    } else if (opts->buffer > 0) {
+        l->buffer = log_buffer_start(l->fd, opts->buffer,
+                                     opts->flush_ms ? opts->flush_ms
+                                                    : LOG_FLUSH_MS);
+        if (l->buffer == NULL) {
+            log_deinit();
+            return false;
+        }
+    }
+
+    if (l->fd != STDERR_FILENO && l->map == NULL
+        && (opts->rotate_size > 0 || opts->rotate_secs > 0)) {
+        if (!log_rotate_start(filename, l->fd, opts->rotate_size,
+                              opts->rotate_secs, opts->rotate_keep,
+                              _log_rotate_flush, _log_rotated)) {
+            log_deinit();
+            return false;
+        }
+        l->rotating = true;
+    }
+
+    if (opts->dedup_ms > 0 && !l->binary) {
+        l->dedup = log_dedup_create(opts->dedup_ms);
+        if (l->dedup == NULL) {
+            log_deinit();
+            return false;
+        }
+    }
+
+    if ((l->async || l->buffer != NULL) && !log_atexit) {
+        log_atexit = atexit(log_flush) == 0;
+    }
+
+    if (l->binary) {
+        log_binary_start(l->precision);
+    }
+
     return true;
 }
 
 UTIL_EXPORT bool
 log_loggable(log_level_t level)
 {
-    struct logger *l = &logger;
-
-    if (level <= l->level) {
+    if (level <= __atomic_load_n(&log_threshold, __ATOMIC_RELAXED)
+        || (int)level <= __atomic_load_n(&log_sinks_level, __ATOMIC_RELAXED)) {
         return true;
     }
 
     return false;
 }
 
+UTIL_EXPORT bool
+log_add_sink(const struct log_sink_options *opts)
+{
+    struct logger *l = &logger;
+
+    if (l->binary) {
+        log_stderr("adding log sink failed: binary log format");
+        return false;
+    }
+
+    if (!log_sink_add(opts, !l->fields)) {
+        return false;
+    }
+
+    log_levels_update();
+
+    return true;
+}
+
+UTIL_EXPORT uint64_t
+log_dropped(void)
+{
+    return log_async_dropped();
+}
+
+UTIL_EXPORT void
+log_flush(void)
+{
+    struct logger *l = &logger;
+
+    log_limit_flush();
+
+    if (l->dedup != NULL) {
+        log_dedup_flush(l->dedup, _log_output_primary, NULL);
+    }
+
+    if (l->async) {
+        log_async_flush();
+    } else if (l->buffer != NULL) {
+        log_buffer_flush(l->buffer);
+    }
+
+    log_sinks_flush();
+}
+
 UTIL_EXPORT void
 log_deinit(void)
 {
     struct logger *l = &logger;
 
+    log_limit_flush();
+
+    if (l->dedup != NULL) {
+        log_dedup_flush(l->dedup, _log_output_primary, NULL);
+        log_dedup_destroy(l->dedup);
+        l->dedup = NULL;
+    }
+
+    if (l->async) {
+        log_async_stop();
+        l->async = false;
+    }
+
+    if (l->buffer != NULL) {
+        log_buffer_stop(l->buffer);
+        l->buffer = NULL;
+    }
+
+    if (l->rotating) {
+        log_rotate_stop();
+        l->rotating = false;
+    }
+
+    if (l->map != NULL) {
+        log_mmap_stop(l->map);
+        l->map = NULL;
+    }
+
+    if (log_sinks_level >= 0) {
+        log_sinks_stop();
+        log_levels_update();
+    }
+
+    if (log_recording) {
+        log_recorder_stop();
+        log_levels_update();
+    }
+
     if (l->fd < 0 || l->fd == STDERR_FILENO) {
         return;
     }
 
     close(l->fd);
+    l->fd = -1;
 }
 
 UTIL_EXPORT void
-log_write(const char *file, int line, const char *msg, ...)
+log_reopen(void)
+{
+    struct logger *l = &logger;
+
+    if (l->rotating && log_rotate_reopen()) {
+        return;
+    }
+
+    if (l->fd < 0 || l->fd == STDERR_FILENO || l->name == NULL
+        || l->map != NULL) {
+        return;
+    }
+
+    /* open(), dup2() and close() are async-signal-safe */
+    if (!log_reopen_fd(l->name, l->fd)) {
+        log_stats_error();
+    }
+}
+
+/*
+ * Appends the fractional seconds of ts and the suffix of timestamps to
+ * the len bytes of a timestamp prefix in buf, and returns its length.
+ * Async-signal-safe.
+ */
+static size_t
+_log_timestamp_close(char *buf, size_t len, const struct timespec *ts)
+{
+    struct logger *l = &logger;
+    long           frac;
+    int            digits;
+    int            i;
+
+    if (l->precision == LOG_PRECISION_NSEC) {
+        frac = ts->tv_nsec;
+        digits = 9;
+    } else if (l->precision == LOG_PRECISION_USEC) {
+        frac = ts->tv_nsec / 1000;
+        digits = 6;
+    } else {
+        frac = ts->tv_nsec / 1000000;
+        digits = 3;
+    }
+
+    for (i = digits - 1; i >= 0; i--) {
+        buf[len + i] = (char)('0' + frac % 10);
+        frac /= 10;
+    }
+    len += digits;
+
+    for (i = 0; l->ts_close[i] != '\0'; i++) {
+        buf[len++] = l->ts_close[i];
+    }
+
+    return len;
+}
+
+/*
+ * Formats the "[YYYY-mm-dd HH:MM:SS.mmm]" timestamp into buf, which
+ * must have room for at least 40 bytes, and returns its length. In
+ * LOG_FORMAT_LOGFMT and LOG_FORMAT_JSON, the timestamp is the first
+ * field instead, e.g. "ts=YYYY-mm-ddTHH:MM:SS.mmm".
+ *
+ * localtime_r() and strftime() run only when the second changes;
+ * otherwise the cached prefix is copied and only the fractional
+ * digits are formatted.
+ */
+static size_t
+_log_timestamp(char *buf, const struct timespec *ts)
+{
+    struct logger *l = &logger;
+    struct tm      tm;
+
+    if (ts->tv_sec != log_ts.sec || log_ts.format != l->ts_format) {
+        localtime_r(&ts->tv_sec, &tm);
+        log_ts.len = strftime(log_ts.buf, sizeof(log_ts.buf), l->ts_format,
+                              &tm);
+        log_ts.sec = ts->tv_sec;
+        log_ts.format = l->ts_format;
+    }
+
+    memcpy(buf, log_ts.buf, log_ts.len); /* NOLINT */
+
+    return _log_timestamp_close(buf, log_ts.len, ts);
+}
+
+void
+log_output(log_level_t level, const char *buf, size_t len)
+{
+    struct logger *l = &logger;
+
+    log_stats_bytes(len);
+
+    if (l->rotating) {
+        log_rotate_written(len);
+    }
+
+    if (l->map != NULL) {
+        if (!log_mmap_write(l->map, buf, len)) {
+            log_stats_error();
+        }
+    } else if (l->async) {
+        log_async_push(buf, len);
+    } else if (l->buffer != NULL) {
+        log_buffer_write(l->buffer, buf, len, level <= LOG_CRIT);
+    } else if (xwrite(l->fd, buf, len) < 0) {
+        log_stats_error();
+    }
+}
+
+void
+log_output_direct(const char *buf, size_t len)
+{
+    struct logger *l = &logger;
+
+    if (l->map != NULL) {
+        if (!log_mmap_write_safe(l->map, buf, len)) {
+            log_stats_error();
+        }
+    } else if (xwrite(l->fd >= 0 ? l->fd : STDERR_FILENO, buf, len) < 0) {
+        log_stats_error();
+    }
+}
+
+size_t
+log_format_repeated(char *buf, log_level_t level, uint64_t n,
+                    const struct timespec *ts, size_t *tslen)
+{
+    struct logger *l = &logger;
+    char           text[48];
+    size_t         tlen;
+    size_t         len;
+
+    tlen = scnformat(text, sizeof(text), "last message repeated %llu times",
+                     (unsigned long long)n);
+
+    len = _log_timestamp(buf, ts);
+    *tslen = len;
+    if (l->fields) {
+        len += log_kv_header(buf + len, LOG_MAX_LEN - 2 - len, l->json,
+                             level, NULL, 0, text, tlen);
+        if (l->json) {
+            buf[len++] = '}';
+        }
+    } else {
+        len += scnformat(buf + len, LOG_MAX_LEN - len, " %s", text);
+    }
+    buf[len++] = '\n';
+
+    return len;
+}
+
+/*
+ * Outputs "last message repeated n times" at level with output.
+ */
+static void
+_log_report_repeated(log_level_t level, uint64_t n, log_output_fn output,
+                     void *arg)
+{
+    char            buf[LOG_MAX_LEN];
+    struct timespec ts;
+    size_t          tslen;
+    size_t          len;
+
+    log_clock_now(&ts);
+    len = log_format_repeated(buf, level, n, &ts, &tslen);
+    output(arg, level, buf, len, tslen, &ts);
+}
+
+void
+log_output_dedup(struct log_dedup *d, log_level_t level, const char *buf,
+                 size_t len, size_t tslen, const struct timespec *ts,
+                 log_output_fn output, void *arg)
+{
+    uint64_t    now = (uint64_t)ts->tv_sec * 1000000000ULL
+                   + (uint64_t)ts->tv_nsec;
+    uint64_t    repeats;
+    log_level_t rlevel;
+    bool        write;
+
+    write = log_dedup_begin(d, buf + tslen, len - tslen, level, now,
+                            &repeats, &rlevel);
+
+    if (repeats > 0) {
+        _log_report_repeated(rlevel, repeats, output, arg);
+    }
+
+    if (write) {
+        output(arg, level, buf, len, tslen, ts);
+    }
+
+    log_dedup_end(d);
+}
+
+void
+log_dedup_flush(struct log_dedup *d, log_output_fn output, void *arg)
+{
+    uint64_t    repeats;
+    log_level_t rlevel;
+
+    repeats = log_dedup_pending(d, &rlevel);
+    if (repeats > 0) {
+        _log_report_repeated(rlevel, repeats, output, arg);
+    }
+    log_dedup_end(d);
+}
+
+/*
+ * Outputs a formatted message, whose timestamp is the first tslen bytes,
+ * to the log if primary is true, and to the sinks at level.
+ */
+static inline void
+_log_dispatch(log_level_t level, bool primary, const char *buf, size_t len,
+              size_t tslen, const struct timespec *ts)
 {
     struct logger *l = &logger;
-    int            len;
-    int            size;
-    int            errno_save;
-    char           buf[LOG_MAX_LEN];
-    va_list        args;
-    ssize_t        n;
-    struct timeval tv;
+
+    if (primary) {
+        if (l->dedup != NULL) {
+            log_output_dedup(l->dedup, level, buf, len, tslen, ts,
+                             _log_output_primary, NULL);
+        } else {
+            log_output(level, buf, len);
+        }
+    }
+
+    if ((int)level <= __atomic_load_n(&log_sinks_level, __ATOMIC_RELAXED)) {
+        log_sinks_output(level, buf, len, tslen, ts);
+    }
+}
+
+/*
+ * Formats a message as LOG_FORMAT_LOGFMT or LOG_FORMAT_JSON into buf of
+ * LOG_MAX_LEN bytes, followed by the n fields of kv, and returns its
+ * length. Sets *tslen to the length of its timestamp, unless NULL.
+ */
+static size_t
+_log_structured(char *buf, log_level_t level, const char *file, int line,
+                const struct timespec *ts, const char *text, size_t tlen,
+                const struct log_kv *kv, size_t n, size_t *tslen)
+{
+    struct logger *l = &logger;
+    size_t         size = LOG_MAX_LEN - 2; /* room for "}\n" */
+    size_t         len;
+
+    len = _log_timestamp(buf, ts);
+    if (tslen != NULL) {
+        *tslen = len;
+    }
+    if (l->thread) {
+        len += log_thread_tag(buf + len, size - len,
+                              l->json ? LOG_THREAD_JSON : LOG_THREAD_LOGFMT);
+    }
+    len += log_kv_header(buf + len, size - len, l->json, level, file, line,
+                         text, tlen);
+    len += log_kv_fields(buf + len, size - len, l->json, kv, n);
+
+    if (l->json) {
+        buf[len++] = '}';
+    }
+    buf[len++] = '\n';
+
+    return len;
+}
+
+static void
+_log_scratch_key_create(void)
+{
+    pthread_key_create(&log_scratch_key, free);
+}
+
+/*
+ * Returns the calling thread's scratch buffer, grown to at least size
+ * bytes, or NULL if it cannot be.
+ */
+static char *
+_log_scratch(size_t size)
+{
+    char *p;
+
+    if (size <= log_scratch_size) {
+        return log_scratch;
+    }
+
+    pthread_once(&log_scratch_once, _log_scratch_key_create);
+
+    /* realloc() rather than xrealloc(), which may log */
+    p = realloc(log_scratch, size);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    pthread_setspecific(log_scratch_key, p);
+    log_scratch = p;
+    log_scratch_size = size;
+
+    return p;
+}
+
+/*
+ * Formats a message that filled buf after a prefix of plen bytes, and
+ * so may be longer than *mlen bytes, again in full (up to
+ * LOG_MAX_LONG_LEN) after a copy of the prefix in the scratch buffer.
+ * Returns the scratch buffer, or buf if the message was complete or
+ * cannot be formatted again, and updates *mlen. The result has room
+ * for a '\n' after the message.
+ */
+static char *
+_log_long(char *buf, int plen, int *mlen, const char *msg, va_list args)
+{
+    char *  p;
+    int     need;
+    va_list copy;
+
+    va_copy(copy, args);
+    need = vsnprintf(NULL, 0, msg, copy);
+    va_end(copy);
+
+    if (need <= *mlen) {
+        return buf;
+    }
+
+    if (plen + need >= LOG_MAX_LONG_LEN) {
+        need = LOG_MAX_LONG_LEN - plen - 1;
+        log_stats_truncated();
+    }
+
+    p = _log_scratch((size_t)(plen + need + 1));
+    if (p == NULL) {
+        log_stats_truncated();
+        return buf;
+    }
+
+    memcpy(p, buf, (size_t)plen); /* NOLINT */
+    vsnprintf(p + plen, (size_t)need + 1, msg, args);
+    *mlen = need;
+
+    return p;
+}
+
+/*
+ * Formats and outputs a message, to the log only if primary is true.
+ */
+static void
+_log_vwrite(struct log_site *site, log_level_t level, const char *file,
+            int line, const struct timespec *now, bool primary,
+            const char *msg, va_list args)
+{
+    struct logger * l = &logger;
+    int             len;
+    int             size;
+    int             errno_save;
+    char            buf[LOG_MAX_LEN];
+    struct timespec ts;
+    va_list         copy;
+    bool            done;
+    char *          out;
+    int             mlen;
+    size_t          tslen;
 
     if (l->fd < 0) {
         return;
@@ -108,25 +707,349 @@ log_write(const char *file, int line, const char *msg, ...)
     len = 0;            /* length of output buffer */
     size = LOG_MAX_LEN; /* size of output buffer */
 
-    gettimeofday(&tv, NULL);
-    buf[len++] = '[';
-    len += strftime(buf + len, size - len, "%Y-%m-%d %H:%M:%S.",
-                    localtime(&tv.tv_sec));
-    len += scnprintf(buf + len, size - len, "%03ld", tv.tv_usec / 1000);
-    len += scnprintf(buf + len, size - len, "] %s:%d ", file, line);
+    if (now != NULL) {
+        ts = *now;
+    } else {
+        log_clock_now(&ts);
+    }
+
+    log_stats_message(level);
+
+    if (l->binary) {
+        if (l->rotating) {
+            log_rotate_hold();
+        }
+
+        done = false;
+        if (site != NULL) {
+            va_copy(copy, args);
+            done = log_binary_event(site, level, &ts, msg, copy);
+            va_end(copy);
+        }
+
+        if (!done) {
+            len = vscnformat(buf, size, msg, args);
+            if (len == size - 1) {
+                log_stats_truncated();
+            }
+            log_binary_text(level, file, line, &ts, buf, len, false);
+        }
+
+        if (l->rotating) {
+            log_rotate_release();
+        }
+    } else if (l->fields) {
+        char text[LOG_MAX_LEN];
+        int  tlen = vscnformat(text, sizeof(text), msg, args);
+
+        if (tlen == (int)sizeof(text) - 1) {
+            log_stats_truncated();
+        }
+
+        len = (int)_log_structured(buf, level, file, line, &ts, text,
+                                   (size_t)tlen, NULL, 0, &tslen);
+        _log_dispatch(level, primary, buf, len, tslen, &ts);
+    } else {
+        len += _log_timestamp(buf, &ts);
+        tslen = (size_t)len;
+        if (l->thread) {
+            len += (int)log_thread_tag(buf + len, (size_t)(size - len),
+                                       LOG_THREAD_TEXT);
+        }
+        len += scnformat(buf + len, size - len, " %s:%d ", file, line);
+
+        /* most messages fit in buf, formatted once on the stack */
+        va_copy(copy, args);
+        out = buf;
+        mlen = vscnformat(buf + len, size - len, msg, args);
+        if (len + mlen == size - 1) {
+            out = _log_long(buf, len, &mlen, msg, copy);
+        }
+        va_end(copy);
+        len += mlen;
+
+        /* the '\n' replaces the terminating '\0', so it always fits */
+        out[len++] = '\n';
+
+        _log_dispatch(level, primary, out, len, tslen, &ts);
+    }
+
+    if (l->latency) {
+        log_stats_latency(&ts);
+    }
+
+    errno = errno_save;
+}
+
+UTIL_EXPORT void
+log_write(const char *file, int line, const char *msg, ...)
+{
+    log_level_t level = __atomic_load_n(&log_threshold, __ATOMIC_RELAXED);
+    va_list     args;
+
+    va_start(args, msg);
+    _log_vwrite(NULL, level, file, line, NULL, true, msg, args);
+    va_end(args);
+}
+
+UTIL_EXPORT void
+log_write_level(log_level_t level, const char *file, int line,
+                const char *msg, ...)
+{
+    va_list args;
+
+    va_start(args, msg);
+    _log_vwrite(NULL, level, file, line, NULL, true, msg, args);
+    va_end(args);
+}
+
+UTIL_EXPORT void
+log_write_site(struct log_site *site, log_level_t level, const char *msg, ...)
+{
+    struct timespec ts;
+    va_list         args;
+    bool            primary;
+    int             sinks;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        log_site_register(site);
+    }
+
+    /* site->level admits the sinks, site->output the log */
+    primary = (int)level <= __atomic_load_n(&site->output, __ATOMIC_RELAXED);
+    sinks = __atomic_load_n(&log_sinks_level, __ATOMIC_RELAXED);
+
+    if (!__atomic_load_n(&log_recording, __ATOMIC_RELAXED)) {
+        if (!primary && (int)level > sinks) {
+            return;
+        }
+
+        va_start(args, msg);
+        _log_vwrite(site, level, site->file, site->line, NULL, primary, msg,
+                    args);
+        va_end(args);
+        return;
+    }
+
+    /* record messages at every level, and output those at site->output */
+    log_clock_now(&ts);
+
+    va_start(args, msg);
+    log_recorder_record(site, level, &ts, msg, args);
+    va_end(args);
+
+    if (!primary && (int)level > sinks) {
+        return;
+    }
+
+    va_start(args, msg);
+    _log_vwrite(site, level, site->file, site->line, &ts, primary, msg,
+                args);
+    va_end(args);
+}
+
+void
+log_write_report(struct log_site *site, log_level_t level, const char *msg,
+                 ...)
+{
+    va_list args;
+    bool    primary;
+    int     sinks;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        log_site_register(site);
+    }
+
+    primary = (int)level <= __atomic_load_n(&site->output, __ATOMIC_RELAXED);
+    sinks = __atomic_load_n(&log_sinks_level, __ATOMIC_RELAXED);
+    if (!primary && (int)level > sinks) {
+        return;
+    }
 
     va_start(args, msg);
-    len += vscnprintf(buf + len, size - len, msg, args);
+    _log_vwrite(site, level, site->file, site->line, NULL, primary, msg,
+                args);
     va_end(args);
+}
+
+UTIL_EXPORT void
+log_write_kv(struct log_site *site, log_level_t level, const char *msg,
+             const struct log_kv *kv, size_t n)
+{
+    struct logger * l = &logger;
+    struct timespec ts;
+    char            buf[LOG_MAX_LEN];
+    size_t          size = LOG_MAX_LEN - 1; /* room for '\n' */
+    size_t          len = 0;
+    size_t          mlen = strlen(msg);
+    size_t          tslen = 0;
+    int             errno_save;
+    bool            primary;
+    int             sinks;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        log_site_register(site);
+    }
 
+    /* structured messages are not recorded by the flight recorder */
+    primary = (int)level <= __atomic_load_n(&site->output, __ATOMIC_RELAXED);
+    sinks = __atomic_load_n(&log_sinks_level, __ATOMIC_RELAXED);
+    if ((!primary && (int)level > sinks) || l->fd < 0) {
+        return;
+    }
+
+    errno_save = errno;
+    log_clock_now(&ts);
+    log_stats_message(level);
+
+    if (l->fields) {
+        len = _log_structured(buf, level, site->file, site->line, &ts, msg,
+                              mlen, kv, n, &tslen);
+        _log_dispatch(level, primary, buf, len, tslen, &ts);
+    } else {
+        /* the message, followed by the fields in logfmt */
+        if (!l->binary) {
+            len = _log_timestamp(buf, &ts);
+            tslen = len;
+            if (l->thread) {
+                len += log_thread_tag(buf + len, size - len, LOG_THREAD_TEXT);
+            }
+            len += scnformat(buf + len, size - len, " %s:%d ", site->file,
+                             site->line);
+        }
+
+        if (mlen > size - len) {
+            mlen = size - len;
+            log_stats_truncated();
+        }
+        memcpy(buf + len, msg, mlen); /* NOLINT */
+        len += mlen;
+        len += log_kv_fields(buf + len, size - len, false, kv, n);
+
+        if (l->binary) {
+            if (l->rotating) {
+                log_rotate_hold();
+            }
+            log_binary_text(level, site->file, site->line, &ts, buf, len,
+                            false);
+            if (l->rotating) {
+                log_rotate_release();
+            }
+        } else {
+            buf[len++] = '\n';
+            _log_dispatch(level, primary, buf, len, tslen, &ts);
+        }
+    }
+
+    if (l->latency) {
+        log_stats_latency(&ts);
+    }
+
+    errno = errno_save;
+}
+
+void
+log_dump(log_level_t level, const char *file, int line,
+         const struct timespec *ts, const char *text, size_t tlen)
+{
+    struct logger * l = &logger;
+    struct timespec now;
+    char            buf[LOG_MAX_LEN];
+    size_t          size = LOG_MAX_LEN - 2; /* room for "}\n" */
+    size_t          len;
+
+    if (ts == NULL) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts = &now;
+    }
+
+    if (l->binary) {
+        log_binary_text(level, file != NULL ? file : "", line, ts, text, tlen,
+                        true);
+        return;
+    }
+
+    len = log_safe_time(buf, size, l->ts_format, ts->tv_sec);
+    len = _log_timestamp_close(buf, len, ts);
+
+    if (l->fields) {
+        len += log_kv_header(buf + len, size - len, l->json, level, file,
+                             line, text, tlen);
+        if (l->json) {
+            buf[len++] = '}';
+        }
+    } else if (file != NULL) {
+        len += log_safe_format(buf + len, size - len, " %s:%d %.*s", file,
+                               line, (int)tlen, text);
+    } else {
+        len += log_safe_format(buf + len, size - len, " %.*s", (int)tlen,
+                               text);
+    }
     buf[len++] = '\n';
 
-    n = xwrite(l->fd, buf, len);
-    if (n < 0) {
-        log_nerror++;
+    log_output_direct(buf, len);
+}
+
+UTIL_EXPORT void
+log_write_signal_safe(log_level_t level, const char *file, int line,
+                      const char *msg, ...)
+{
+    char    text[LOG_MAX_LEN];
+    size_t  tlen;
+    int     errno_save = errno;
+    va_list args;
+
+    if (level > __atomic_load_n(&log_threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    va_start(args, msg);
+    tlen = log_safe_vformat(text, sizeof(text), msg, args);
+    va_end(args);
+
+    log_dump(level, file, line, NULL, text, tlen);
+
+    errno = errno_save;
+}
+
+UTIL_EXPORT void
+log_backtrace_signal_safe(log_level_t level, const char *file, int line)
+{
+#ifdef HAVE_BACKTRACE
+    struct logger *l = &logger;
+    void *         stack[LOG_BACKTRACE_SIZE];
+    char           text[32];
+    size_t         tlen;
+    int            errno_save = errno;
+    int            size;
+    int            i;
+
+    if (level > __atomic_load_n(&log_threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    size = backtrace(stack, LOG_BACKTRACE_SIZE);
+
+    log_dump(level, file, line, NULL, "backtrace:", 10);
+
+    /* skip this frame */
+    if (!l->binary && !l->fields && l->map == NULL) {
+        backtrace_symbols_fd(stack + 1, size - 1,
+                             l->fd >= 0 ? l->fd : STDERR_FILENO);
+    } else {
+        for (i = 1; i < size; i++) {
+            tlen = log_safe_format(text, sizeof(text), "[%d] %p", i - 1,
+                                   stack[i]);
+            log_dump(level, file, line, NULL, text, tlen);
+        }
     }
 
     errno = errno_save;
+#else
+    UNUSED(level);
+    UNUSED(file);
+    UNUSED(line);
+#endif /* !HAVE_BACKTRACE */
 }
 
 void
@@ -142,13 +1065,13 @@ _log_std(int fd, const char *msg, va_list args)
     len = 0;                /* length of output buffer */
     size = 4 * LOG_MAX_LEN; /* size of output buffer */
 
-    len += vscnprintf(buf, size, msg, args);
+    len += vscnformat(buf, size, msg, args);
 
     buf[len++] = '\n';
 
     n = xwrite(fd, buf, len);
     if (n < 0) {
-        log_nerror += 1;
+        log_stats_error();
     }
 
     errno = errno_save;
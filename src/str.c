@@ -54,7 +54,7 @@ _vscnprintf(char *buf, size_t size, const char *fmt, va_list args)
      *
      * See: http://lwn.net/Articles/69419/
      */
-    if (n <= 0) {
+    if (n <= 0 || size == 0) {
         return 0;
     }
 
@@ -64,3 +64,413 @@ _vscnprintf(char *buf, size_t size, const char *fmt, va_list args)
 
     return (int)(size - 1);
 }
+
+/* decimal digit pairs, "00" to "99" */
+static const char str_dec_pairs[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* hexadecimal digit pairs, "00" to "ff" */
+static const char str_hex_pairs[512] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* conversion flags */
+#define FMT_LEFT 0x01  /* '-' */
+#define FMT_ZERO 0x02  /* '0' */
+#define FMT_ALT 0x04   /* '#' */
+#define FMT_WSTAR 0x08 /* width is '*' */
+#define FMT_PSTAR 0x10 /* precision is '*' */
+
+/* length modifiers */
+#define FMT_INT 0
+#define FMT_LONG 1
+#define FMT_LLONG 2
+#define FMT_SIZE 3
+
+/* the largest width or precision parsed without vsnprintf() */
+#define FMT_MAX_WIDTH 9999
+
+char *
+str_utoa(char *end, unsigned long long u)
+{
+    unsigned i;
+
+    while (u >= 100) {
+        i = (unsigned)(u % 100) * 2;
+        u /= 100;
+        end -= 2;
+        end[0] = str_dec_pairs[i];
+        end[1] = str_dec_pairs[i + 1];
+    }
+
+    if (u >= 10) {
+        i = (unsigned)u * 2;
+        end -= 2;
+        end[0] = str_dec_pairs[i];
+        end[1] = str_dec_pairs[i + 1];
+    } else {
+        *--end = (char)('0' + u);
+    }
+
+    return end;
+}
+
+/*
+ * Writes the hexadecimal digits of u backwards from end, returning the
+ * first digit.
+ */
+static char *
+_str_xtoa(char *end, unsigned long long u, bool upper)
+{
+    unsigned i;
+
+    if (upper) {
+        do {
+            *--end = "0123456789ABCDEF"[u & 0xf];
+            u >>= 4;
+        } while (u != 0);
+
+        return end;
+    }
+
+    while (u >= 0x100) {
+        i = (unsigned)(u & 0xff) * 2;
+        u >>= 8;
+        end -= 2;
+        end[0] = str_hex_pairs[i];
+        end[1] = str_hex_pairs[i + 1];
+    }
+
+    if (u >= 0x10) {
+        i = (unsigned)u * 2;
+        end -= 2;
+        end[0] = str_hex_pairs[i];
+        end[1] = str_hex_pairs[i + 1];
+    } else {
+        *--end = str_hex_pairs[u * 2 + 1];
+    }
+
+    return end;
+}
+
+/*
+ * Copies up to n characters of s to *p, without passing end.
+ */
+static inline void
+_str_put(char **p, char *end, const char *s, size_t n)
+{
+    if (n > (size_t)(end - *p)) {
+        n = (size_t)(end - *p);
+    }
+
+    if (n > 16) {
+        memcpy(*p, s, n); /* NOLINT */
+        *p += n;
+        return;
+    }
+
+    /* most pieces of a log message are too short for memcpy() to pay */
+    while (n-- > 0) {
+        *(*p)++ = *s++;
+    }
+}
+
+/*
+ * Copies up to n characters c to *p, without passing end.
+ */
+static inline void
+_str_fill(char **p, char *end, char c, size_t n)
+{
+    if (n > (size_t)(end - *p)) {
+        n = (size_t)(end - *p);
+    }
+
+    memset(*p, c, n); /* NOLINT */
+    *p += n;
+}
+
+/*
+ * Outputs a field of the len characters of s after prefix, padded to
+ * width as flags specify.
+ */
+static void
+_str_field(char **p, char *end, const char *prefix, const char *s,
+           size_t len, int width, int flags)
+{
+    size_t plen = strlen(prefix);
+    size_t pad = 0;
+
+    if (width == 0) {
+        _str_put(p, end, prefix, plen);
+        _str_put(p, end, s, len);
+        return;
+    }
+
+    if ((size_t)width > plen + len) {
+        pad = (size_t)width - plen - len;
+    }
+
+    if (!(flags & (FMT_LEFT | FMT_ZERO))) {
+        _str_fill(p, end, ' ', pad);
+    }
+
+    _str_put(p, end, prefix, plen);
+
+    if (flags & FMT_ZERO) {
+        _str_fill(p, end, '0', pad);
+    }
+
+    _str_put(p, end, s, len);
+
+    if (flags & FMT_LEFT) {
+        _str_fill(p, end, ' ', pad);
+    }
+}
+
+/*
+ * Parses the decimal number at *f into *n. Returns false if it is
+ * larger than FMT_MAX_WIDTH.
+ */
+static bool
+_str_parse_width(const char **f, int *n)
+{
+    *n = 0;
+    while (**f >= '0' && **f <= '9') {
+        *n = *n * 10 + (**f - '0');
+        if (*n > FMT_MAX_WIDTH) {
+            return false;
+        }
+        (*f)++;
+    }
+
+    return true;
+}
+
+int
+_scnformat(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int     n;
+
+    va_start(args, fmt);
+    n = _vscnformat(buf, size, fmt, args);
+    va_end(args);
+
+    return n;
+}
+
+int
+_vscnformat(char *buf, size_t size, const char *fmt, va_list args)
+{
+    char *             p = buf;
+    char *             end;
+    const char *       f = fmt;
+    const char *       spec;
+    const char *       s;
+    const char *       prefix;
+    char               num[24];
+    char *             n;
+    unsigned long long u;
+    long long          v;
+    size_t             len;
+    int                flags;
+    int                width;
+    int                prec;
+    int                lmod;
+    char               conv;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    end = buf + size - 1;
+
+    for (;;) {
+        for (s = f; *s != '%' && *s != '\0'; s++) {
+            /* find the next conversion */
+        }
+        _str_put(&p, end, f, (size_t)(s - f));
+        f = s;
+        if (*f != '%' || p == end) {
+            break;
+        }
+
+        /* parse the conversion specification, without consuming args */
+        spec = f++;
+
+        flags = 0;
+        for (;; f++) {
+            if (*f == '-') {
+                flags |= FMT_LEFT;
+            } else if (*f == '0') {
+                flags |= FMT_ZERO;
+            } else if (*f == '#') {
+                flags |= FMT_ALT;
+            } else {
+                break;
+            }
+        }
+
+        width = 0;
+        if (*f == '*') {
+            flags |= FMT_WSTAR;
+            f++;
+        } else if (!_str_parse_width(&f, &width)) {
+            goto fallback;
+        }
+
+        prec = -1;
+        if (*f == '.') {
+            f++;
+            if (*f == '*') {
+                flags |= FMT_PSTAR;
+                f++;
+            } else if (!_str_parse_width(&f, &prec)) {
+                goto fallback;
+            }
+        }
+
+        lmod = FMT_INT;
+        if (*f == 'l') {
+            f++;
+            lmod = FMT_LONG;
+            if (*f == 'l') {
+                f++;
+                lmod = FMT_LLONG;
+            }
+        } else if (*f == 'z') {
+            f++;
+            lmod = FMT_SIZE;
+        }
+
+        conv = *f++;
+        switch (conv) {
+        case '%':
+            if (f - spec != 2) {
+                goto fallback;
+            }
+            _str_put(&p, end, "%", 1);
+            continue;
+        case 's':
+        case 'c':
+        case 'p':
+            if (lmod != FMT_INT || (flags & (FMT_ZERO | FMT_ALT))
+                || (conv != 's' && (prec >= 0 || (flags & FMT_PSTAR)))) {
+                goto fallback;
+            }
+            break;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+            if (prec >= 0 || (flags & FMT_PSTAR)
+                || ((flags & FMT_ALT) && conv != 'x' && conv != 'X')) {
+                goto fallback;
+            }
+            break;
+        default:
+            goto fallback;
+        }
+
+        /* consume the arguments */
+        if (flags & FMT_WSTAR) {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FMT_LEFT;
+                width = width > -FMT_MAX_WIDTH ? -width : FMT_MAX_WIDTH;
+            }
+        }
+
+        if (flags & FMT_PSTAR) {
+            prec = va_arg(args, int);
+        }
+
+        if (flags & FMT_LEFT) {
+            flags &= ~FMT_ZERO;
+        }
+
+        prefix = "";
+        switch (conv) {
+        case 's':
+            s = va_arg(args, const char *);
+            if (s == NULL) {
+                s = prec < 0 || prec >= 6 ? "(null)" : "";
+            }
+            len = prec < 0 ? strlen(s) : strnlen(s, (size_t)prec);
+            _str_field(&p, end, prefix, s, len, width, flags);
+            continue;
+        case 'c':
+            num[0] = (char)va_arg(args, int);
+            _str_field(&p, end, prefix, num, 1, width, flags);
+            continue;
+        case 'p':
+            s = va_arg(args, const void *);
+            if (s == NULL) {
+                _str_field(&p, end, prefix, "(nil)", 5, width, flags);
+                continue;
+            }
+            n = _str_xtoa(num + sizeof(num), (uintptr_t)s, false);
+            prefix = "0x";
+            break;
+        case 'd':
+        case 'i':
+            if (lmod == FMT_LLONG) {
+                v = va_arg(args, long long);
+            } else if (lmod == FMT_LONG) {
+                v = va_arg(args, long);
+            } else if (lmod == FMT_SIZE) {
+                v = va_arg(args, ssize_t);
+            } else {
+                v = va_arg(args, int);
+            }
+            u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+            n = str_utoa(num + sizeof(num), u);
+            prefix = v < 0 ? "-" : "";
+            break;
+        default:
+            if (lmod == FMT_LLONG) {
+                u = va_arg(args, unsigned long long);
+            } else if (lmod == FMT_LONG) {
+                u = va_arg(args, unsigned long);
+            } else if (lmod == FMT_SIZE) {
+                u = va_arg(args, size_t);
+            } else {
+                u = va_arg(args, unsigned);
+            }
+            if (conv == 'u') {
+                n = str_utoa(num + sizeof(num), u);
+            } else {
+                n = _str_xtoa(num + sizeof(num), u, conv == 'X');
+                if ((flags & FMT_ALT) && u != 0) {
+                    prefix = conv == 'X' ? "0X" : "0x";
+                }
+            }
+            break;
+        }
+
+        _str_field(&p, end, prefix, n, (size_t)(num + sizeof(num) - n),
+                   width, flags);
+    }
+
+    *p = '\0';
+
+    return (int)(p - buf);
+
+fallback:
+    /* vsnprintf() formats the rest of fmt, with the remaining args */
+    *p = '\0';
+    p += _vscnprintf(p, (size_t)(end - p) + 1, spec, args);
+
+    return (int)(p - buf);
+}
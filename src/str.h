@@ -28,10 +28,35 @@ int _scnprintf(char *__restrict buf, size_t size, const char *__restrict fmt,
 int _vscnprintf(char *__restrict buf, size_t size, const char *__restrict fmt,
                 va_list args) __attribute__((format(printf, 3, 0)));
 
+/*
+ * Like _scnprintf(), but formats the conversions most log messages
+ * use without libc: %s, %c, %d, %i, %u, %x, %X and %p, with the l,
+ * ll and z length modifiers, the '-', '0' and '#' flags, a width, and
+ * a precision for %s. The rest of the format, from the first other
+ * conversion, is formatted by vsnprintf().
+ */
+int _scnformat(char *__restrict buf, size_t size, const char *__restrict fmt,
+               ...) __attribute__((format(printf, 3, 4)));
+int _vscnformat(char *__restrict buf, size_t size,
+                const char *__restrict fmt, va_list args)
+    __attribute__((format(printf, 3, 0)));
+
+/*
+ * Writes the decimal digits of u backwards from end, returning the
+ * first digit. At most 20 digits are written.
+ */
+char *str_utoa(char *end, unsigned long long u) __attribute__((nonnull));
+
 #define scnprintf(_s, _n, ...) \
     _scnprintf((char *)(_s), (size_t)(_n), __VA_ARGS__)
 
 #define vscnprintf(_s, _n, _f, _a) \
     _vscnprintf((char *)(_s), (size_t)(_n), _f, _a)
 
+#define scnformat(_s, _n, ...) \
+    _scnformat((char *)(_s), (size_t)(_n), __VA_ARGS__)
+
+#define vscnformat(_s, _n, _f, _a) \
+    _vscnformat((char *)(_s), (size_t)(_n), _f, _a)
+
 END_DECLS
@@ -26,4 +26,10 @@ BEGIN_DECLS
 
 #define UNUSED(x) ((void)(x))
 
+/* storage class for per-thread variables */
+#define THREAD_LOCAL __thread
+
+/* assumed size of a cache line, used to avoid false sharing */
+#define CACHE_LINE_SIZE 64
+
 END_DECLS
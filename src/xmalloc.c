@@ -47,6 +47,27 @@ _xmalloc(size_t size, const char *name, int line)
     return p;
 }
 
+void *
+_xmemalign(size_t alignment, size_t size, const char *name, int line)
+{
+    void *p;
+    int   err;
+
+    ASSERT(size != 0);
+
+    err = posix_memalign(&p, alignment, size);
+    if (err != 0) {
+        log_error("posix_memalign(%zu, %zu) failed @ %s:%d: %s", alignment,
+                  size, name, line, strerror(err));
+        return NULL;
+    }
+
+    log_debug(LOG_DEBUG, "posix_memalign(%zu, %zu) at %p @ %s:%d", alignment,
+              size, p, name, line);
+
+    return p;
+}
+
 void *
 _xrealloc(void *ptr, size_t size, const char *name, int line)
 {
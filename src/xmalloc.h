@@ -26,6 +26,8 @@ void *_xcalloc(size_t nmemb, size_t size, const char *name, int line)
     __attribute__((nonnull, warn_unused_result));
 void *_xmalloc(size_t size, const char *name, int line)
     __attribute__((nonnull, malloc, warn_unused_result));
+void *_xmemalign(size_t alignment, size_t size, const char *name, int line)
+    __attribute__((nonnull, malloc, warn_unused_result));
 void *_xrealloc(void *ptr, size_t size, const char *name, int line)
     __attribute__((nonnull, warn_unused_result));
 void *_xzalloc(size_t size, const char *name, int line)
@@ -36,6 +38,9 @@ void _xfree(void *ptr, const char *name, int line) __attribute__((nonnull));
 
 #define xmalloc(_s) _xmalloc((size_t)(_s), __FILE__, __LINE__)
 
+#define xmemalign(_a, _s) \
+    _xmemalign((size_t)(_a), (size_t)(_s), __FILE__, __LINE__)
+
 #define xrealloc(_p, _s) _xrealloc(_p, (size_t)(_s), __FILE__, __LINE__)
 
 #define xzalloc(_s) _xzalloc((size_t)(_s), __FILE__, __LINE__)
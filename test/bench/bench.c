@@ -0,0 +1,42 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <test/bench/bench.h>
+#include <time.h>
+
+uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+void
+bench_report(const char *name, uint64_t ops, const char *unit, uint64_t ns)
+{
+    double per = ops ? (double)ns / (double)ops : 0.0;
+    double rate = ns ? (double)ops * 1e9 / (double)ns : 0.0;
+
+    printf("%-32s %12.2f ns/%-6s %14.0f %s/s\n", name, per, unit, rate,
+           unit);
+}
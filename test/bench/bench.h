@@ -0,0 +1,38 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <portable/macros.h>
+#include <portable/system.h>
+
+BEGIN_DECLS
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t bench_now(void);
+
+/**
+ * Reports the result of a benchmark named name, which performed ops
+ * operations (of unit, e.g. "byte" or "line") in ns nanoseconds.
+ */
+void bench_report(const char *name, uint64_t ops, const char *unit,
+                  uint64_t ns) __attribute__((nonnull));
+
+END_DECLS
@@ -0,0 +1,277 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <sched.h>
+#include <test/bench/bench.h>
+#include <util/buffer.h>
+
+/* dbuf capacity in bytes */
+#define DBUF_SIZE 4096
+
+/* total bytes moved through a dbuf by each benchmark */
+#define TOTAL (64 * 1024 * 1024)
+
+/* span size for the bulk benchmarks */
+#define SPAN 512
+
+/*
+ * Per-byte dbuf_put()/dbuf_get().
+ */
+static void
+bench_byte(void)
+{
+    struct dbuf *dbuf = dbuf_init(DBUF_SIZE);
+    uint8_t      byte = 0;
+    uint64_t     start;
+    size_t       moved;
+    size_t       i;
+
+    start = bench_now();
+
+    for (moved = 0; moved < TOTAL; moved += DBUF_SIZE) {
+        for (i = 0; i < DBUF_SIZE; i++) {
+            dbuf_put(dbuf, (uint8_t)i);
+        }
+
+        while (dbuf_get(dbuf, &byte)) {
+            /* drain */
+        }
+    }
+
+    bench_report("dbuf_put/dbuf_get", TOTAL, "byte", bench_now() - start);
+
+    dbuf_deinit(dbuf);
+}
+
+/*
+ * Span-based dbuf_put_n()/dbuf_get_n(), moving span bytes per call.
+ */
+static void
+bench_bulk(const char *name, struct dbuf *dbuf, size_t span)
+{
+    uint8_t  src[DBUF_SIZE];
+    uint8_t  dst[DBUF_SIZE];
+    uint64_t start;
+    size_t   moved = 0;
+
+    memset(src, 'a', sizeof(src));
+
+    start = bench_now();
+
+    while (moved < TOTAL) {
+        dbuf_put_n(dbuf, src, span);
+        moved += dbuf_get_n(dbuf, dst, span);
+    }
+
+    bench_report(name, TOTAL, "byte", bench_now() - start);
+
+    dbuf_deinit(dbuf);
+}
+
+/*
+ * Zero-copy dbuf_reserve()/dbuf_peek(), with the writer and reader
+ * each moving at most span bytes per call, so that the buffer stays
+ * partially full and regions cross the end of the buffer.
+ */
+static void
+bench_zero_copy(const char *name, struct dbuf *dbuf, size_t span)
+{
+    uint8_t *      w;
+    const uint8_t *r;
+    uint64_t       start;
+    uint64_t       calls = 0;
+    size_t         moved = 0;
+    size_t         len;
+
+    /* start half full, so the reader trails the writer */
+    w = dbuf_reserve(dbuf, &len);
+    dbuf_commit(dbuf, DBUF_SIZE / 2);
+
+    start = bench_now();
+
+    while (moved < TOTAL) {
+        w = dbuf_reserve(dbuf, &len);
+        if (w != NULL) {
+            len = len < span ? len : span;
+            memset(w, 'a', len);
+            dbuf_commit(dbuf, len);
+        }
+
+        r = dbuf_peek(dbuf, &len);
+        if (r != NULL) {
+            len = len < span ? len : span;
+            dbuf_consume(dbuf, len);
+            moved += len;
+        }
+
+        calls++;
+    }
+
+    bench_report(name, TOTAL, "byte", bench_now() - start);
+    printf("%-32s %12.2f bytes/call\n", "", (double)moved / (double)calls);
+
+    dbuf_deinit(dbuf);
+}
+
+/* state shared between threads in the two-thread benchmarks */
+struct shared {
+    pthread_mutex_t   lock;
+    struct dbuf *     dbuf;
+    struct spsc_ring *ring;
+};
+
+static void *
+dbuf_producer(void *arg)
+{
+    struct shared *sh = arg;
+    uint8_t        src[SPAN];
+    size_t         sent = 0;
+    size_t         n;
+
+    memset(src, 'a', sizeof(src));
+
+    while (sent < TOTAL) {
+        pthread_mutex_lock(&sh->lock);
+        n = dbuf_put_n(sh->dbuf, src, SPAN);
+        pthread_mutex_unlock(&sh->lock);
+
+        if (n == 0) {
+            sched_yield();
+        }
+        sent += n;
+    }
+
+    return NULL;
+}
+
+/*
+ * Mutex-wrapped dbuf_put_n()/dbuf_get_n() across two threads.
+ */
+static void
+bench_dbuf_locked(void)
+{
+    struct shared sh;
+    pthread_t     thread;
+    uint8_t       dst[SPAN];
+    uint64_t      start;
+    size_t        received = 0;
+    size_t        n;
+
+    pthread_mutex_init(&sh.lock, NULL);
+    sh.dbuf = dbuf_init(DBUF_SIZE);
+
+    start = bench_now();
+    pthread_create(&thread, NULL, dbuf_producer, &sh);
+
+    while (received < TOTAL) {
+        pthread_mutex_lock(&sh.lock);
+        n = dbuf_get_n(sh.dbuf, dst, SPAN);
+        pthread_mutex_unlock(&sh.lock);
+
+        if (n == 0) {
+            sched_yield();
+        }
+        received += n;
+    }
+
+    pthread_join(thread, NULL);
+    bench_report("dbuf + mutex, 2 threads (512)", TOTAL, "byte",
+                 bench_now() - start);
+
+    dbuf_deinit(sh.dbuf);
+    pthread_mutex_destroy(&sh.lock);
+}
+
+static void *
+ring_producer(void *arg)
+{
+    struct shared *sh = arg;
+    uint8_t        src[SPAN];
+    size_t         sent = 0;
+    size_t         n;
+
+    memset(src, 'a', sizeof(src));
+
+    while (sent < TOTAL) {
+        n = spsc_ring_put_n(sh->ring, src, SPAN);
+        if (n == 0) {
+            sched_yield();
+        }
+        sent += n;
+    }
+
+    return NULL;
+}
+
+/*
+ * Lock-free spsc_ring_put_n()/spsc_ring_get_n() across two threads.
+ */
+static void
+bench_ring(void)
+{
+    struct shared sh;
+    pthread_t     thread;
+    uint8_t       dst[SPAN];
+    uint64_t      start;
+    size_t        received = 0;
+    size_t        n;
+
+    sh.ring = spsc_ring_init(DBUF_SIZE * 2);
+
+    start = bench_now();
+    pthread_create(&thread, NULL, ring_producer, &sh);
+
+    while (received < TOTAL) {
+        n = spsc_ring_get_n(sh.ring, dst, SPAN);
+        if (n == 0) {
+            sched_yield();
+        }
+        received += n;
+    }
+
+    pthread_join(thread, NULL);
+    bench_report("spsc_ring, 2 threads (512)", TOTAL, "byte",
+                 bench_now() - start);
+
+    spsc_ring_deinit(sh.ring);
+}
+
+int
+main(void)
+{
+    bench_byte();
+
+    /* a span that does not divide the capacity splits across swaps */
+    bench_bulk("dbuf_put_n/dbuf_get_n (512)", dbuf_init(DBUF_SIZE), SPAN);
+    bench_bulk("dbuf_put_n/dbuf_get_n (3000)", dbuf_init(DBUF_SIZE), 3000);
+    bench_bulk("mirrored put_n/get_n (512)", dbuf_init_mirrored(DBUF_SIZE),
+               SPAN);
+    bench_bulk("mirrored put_n/get_n (3000)", dbuf_init_mirrored(DBUF_SIZE),
+               3000);
+
+    bench_zero_copy("dbuf reserve/peek (3000)", dbuf_init(DBUF_SIZE), 3000);
+    bench_zero_copy("mirrored reserve/peek (3000)",
+                    dbuf_init_mirrored(DBUF_SIZE), 3000);
+    bench_dbuf_locked();
+    bench_ring();
+
+    return EXIT_SUCCESS;
+}
@@ -92,6 +92,163 @@ test_readable(void)
     dbuf_deinit(dbuf);
 }
 
+/*
+ * Test bulk transfer, including a swap in the middle of dbuf_get_n().
+ */
+static void
+test_bulk(void)
+{
+    struct dbuf *dbuf;
+    uint8_t      src[26];
+    uint8_t      dst[26];
+    size_t       i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = 'a' + i;
+    }
+
+    dbuf = dbuf_init(16);
+
+    is_int(0, dbuf_get_n(dbuf, dst, sizeof(dst)), "nothing to read");
+    is_int(16, dbuf_put_n(dbuf, src, sizeof(src)), "put to capacity");
+    is_int(0, dbuf_put_n(dbuf, src, 1), "at capacity");
+
+    is_int(4, dbuf_get_n(dbuf, dst, 4), "get 4 bytes");
+    ok(memcmp(dst, src, 4) == 0, "read the first 4 letters");
+
+    is_int(10, dbuf_put_n(dbuf, src + 16, 10), "put after swap");
+
+    is_int(22, dbuf_get_n(dbuf, dst + 4, sizeof(dst)), "get across swap");
+    ok(memcmp(dst, src, sizeof(src)) == 0, "read all letters in order");
+    is_int(0, dbuf_get_n(dbuf, dst, sizeof(dst)), "drained");
+
+    /* bulk and per-byte operations interleave */
+    ok(dbuf_put(dbuf, 'z'), "put one byte");
+    is_int(3, dbuf_put_n(dbuf, src, 3), "put 3 bytes");
+    ok(dbuf_get(dbuf, &dst[0]), "get one byte");
+    is_int(3, dbuf_get_n(dbuf, dst + 1, 3), "get 3 bytes");
+    ok(memcmp(dst, "zabc", 4) == 0, "read in order");
+
+    dbuf_deinit(dbuf);
+}
+
+/*
+ * Test zero-copy access to buffers a and b.
+ */
+static void
+test_zero_copy(void)
+{
+    struct dbuf *  dbuf;
+    uint8_t *      w;
+    const uint8_t *r;
+    size_t         len;
+
+    dbuf = dbuf_init(8);
+
+    ok(dbuf_peek(dbuf, &len) == NULL, "nothing to peek");
+    is_int(0, len, "peek length");
+
+    w = dbuf_reserve(dbuf, &len);
+    ok(w != NULL, "reserve");
+    is_int(8, len, "reserve length");
+
+    memcpy(w, "abcdefgh", 8);
+    dbuf_commit(dbuf, 5);
+
+    w = dbuf_reserve(dbuf, &len);
+    is_int(3, len, "reserve after commit");
+    ok(w[0] == 'f', "reserved region follows committed bytes");
+    dbuf_commit(dbuf, 3);
+
+    ok(dbuf_reserve(dbuf, &len) == NULL, "at capacity");
+    is_int(0, len, "no writable capacity");
+
+    r = dbuf_peek(dbuf, &len);
+    ok(r != NULL, "peek");
+    is_int(8, len, "peek length after swap");
+    ok(memcmp(r, "abcdefgh", 8) == 0, "peeked bytes");
+
+    dbuf_consume(dbuf, 3);
+    r = dbuf_peek(dbuf, &len);
+    is_int(5, len, "peek after consume");
+    ok(r[0] == 'd', "peeked region follows consumed bytes");
+
+    w = dbuf_reserve(dbuf, &len);
+    is_int(8, len, "other buffer writable");
+    w[0] = 'z';
+    dbuf_commit(dbuf, 1);
+
+    dbuf_consume(dbuf, 5);
+    r = dbuf_peek(dbuf, &len);
+    is_int(1, len, "peek swaps to the other buffer");
+    ok(r[0] == 'z', "peeked the other buffer");
+    dbuf_consume(dbuf, 1);
+
+    ok(dbuf_peek(dbuf, &len) == NULL, "drained");
+
+    dbuf_deinit(dbuf);
+}
+
+/*
+ * Test that a mirrored dbuf presents contiguous regions across the
+ * end of its storage.
+ */
+static void
+test_mirrored(void)
+{
+    struct dbuf *  dbuf;
+    uint8_t *      src;
+    uint8_t *      w;
+    const uint8_t *r;
+    size_t         size;
+    size_t         len;
+    size_t         i;
+
+    ok(dbuf_init_mirrored(SIZE_MAX) == NULL, "oversized mirrored dbuf");
+    ok(dbuf_init_mirrored(SIZE_MAX / 2) == NULL,
+       "mirrored dbuf whose mappings overflow");
+
+    dbuf = dbuf_init_mirrored(1);
+    if (dbuf == NULL) {
+        skip_block(10, "mirrored dbuf unavailable");
+        return;
+    }
+
+    size = (size_t)sysconf(_SC_PAGESIZE);
+    src = bmalloc(size);
+    for (i = 0; i < size; i++) {
+        src[i] = (uint8_t)(i % 251);
+    }
+
+    w = dbuf_reserve(dbuf, &len);
+    is_int(size, len, "capacity rounded to a page");
+
+    is_int(size, dbuf_put_n(dbuf, src, size), "put to capacity");
+    ok(!dbuf_put(dbuf, 'a'), "at capacity");
+
+    dbuf_consume(dbuf, size - 10); /* leave 10 bytes before the end */
+
+    w = dbuf_reserve(dbuf, &len);
+    is_int(size - 10, len, "writable region wraps");
+    memcpy(w, src, len);
+    dbuf_commit(dbuf, len);
+
+    r = dbuf_peek(dbuf, &len);
+    is_int(size, len, "readable region wraps");
+    ok(memcmp(r, src + size - 10, 10) == 0, "head of the wrapped region");
+    ok(memcmp(r + 10, src, size - 10) == 0, "tail of the wrapped region");
+
+    dbuf_consume(dbuf, 10);
+    r = dbuf_peek(dbuf, &len);
+    is_int(size - 10, len, "read marker wrapped");
+    ok(r[0] == src[0], "read marker at the start of storage");
+
+    is_int(size - 10, dbuf_get_n(dbuf, src, size), "drained");
+
+    free(src);
+    dbuf_deinit(dbuf);
+}
+
 int
 main(void)
 {
@@ -100,6 +257,9 @@ main(void)
     test_basic();
     test_capacity();
     test_readable();
+    test_bulk();
+    test_zero_copy();
+    test_mirrored();
 
     return EXIT_SUCCESS;
 }
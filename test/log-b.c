@@ -0,0 +1,312 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <fcntl.h>
+#include <portable/system.h>
+#include <sys/time.h>
+#include <test/bench/bench.h>
+#include <time.h>
+#include <util/log.h>
+
+/* messages logged by each benchmark */
+#define LINES 200000
+
+/* log file written by the benchmarks */
+#define BENCH_LOG "log-b.log"
+
+/*
+ * Reports the cost of a message suppressed by the runtime level.
+ */
+static void
+bench_suppressed(void)
+{
+    uint64_t start;
+    int      i;
+
+    if (!log_init(LOG_WARN, "/dev/null")) {
+        printf("suppressed: log_init failed\n");
+        return;
+    }
+
+    start = bench_now();
+
+    for (i = 0; i < LINES * 10; i++) {
+        log_info("request %d served in %d us from %s", i, i % 977, "cache");
+    }
+
+    bench_report("log_info, suppressed", LINES * 10, "call",
+                 bench_now() - start);
+
+    log_deinit();
+}
+
+/*
+ * Reports the cost of a message suppressed by log_ratelimited().
+ */
+static void
+bench_ratelimited(void)
+{
+    uint64_t start;
+    int      i;
+
+    if (!log_init(LOG_INFO, "/dev/null")) {
+        printf("ratelimited: log_init failed\n");
+        return;
+    }
+
+    start = bench_now();
+
+    for (i = 0; i < LINES * 10; i++) {
+        log_ratelimited(LOG_INFO, 10, "request %d served in %d us from %s",
+                        i, i % 977, "cache");
+    }
+
+    bench_report("log_ratelimited, suppressed", LINES * 10, "call",
+                 bench_now() - start);
+
+    log_deinit();
+}
+
+/*
+ * Reports the cost of a message below the runtime level, recorded by
+ * the flight recorder.
+ */
+static void
+bench_recorded(void)
+{
+    struct log_options opts;
+    uint64_t           start;
+    int                i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_WARN;
+    opts.filename = "/dev/null";
+    opts.recorder = 1024 * 1024;
+
+    if (!log_init_opts(&opts)) {
+        printf("recorded: log_init_opts failed\n");
+        return;
+    }
+
+    start = bench_now();
+
+    for (i = 0; i < LINES * 10; i++) {
+        log_info("request %d served in %d us from %s", i, i % 977, "cache");
+    }
+
+    bench_report("log_info, recorded", LINES * 10, "call",
+                 bench_now() - start);
+
+    log_deinit();
+}
+
+/*
+ * Logs LINES messages with the provided options to file, reporting
+ * the cost per line as seen by the caller, including log_deinit().
+ */
+static void
+bench_lines(const char *name, struct log_options *opts, char *file)
+{
+    uint64_t start;
+    int      i;
+
+    unlink(BENCH_LOG);
+    opts->level = LOG_INFO;
+    opts->filename = file;
+
+    if (!log_init_opts(opts)) {
+        printf("%s: log_init_opts failed\n", name);
+        return;
+    }
+
+    start = bench_now();
+
+    for (i = 0; i < LINES; i++) {
+        log_info("request %d served in %d us from %s", i, i % 977, "cache");
+    }
+
+    log_deinit();
+
+    bench_report(name, LINES, "line", bench_now() - start);
+
+    unlink(BENCH_LOG);
+}
+
+/*
+ * Logs LINES structured messages in format to BENCH_LOG, buffered,
+ * reporting the cost per line as bench_lines() does.
+ */
+static void
+bench_kv(const char *name, log_format_t format)
+{
+    struct log_options opts;
+    uint64_t           start;
+    int                i;
+
+    unlink(BENCH_LOG);
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = BENCH_LOG;
+    opts.format = format;
+    opts.buffer = 64 * 1024;
+
+    if (!log_init_opts(&opts)) {
+        printf("%s: log_init_opts failed\n", name);
+        return;
+    }
+
+    start = bench_now();
+
+    for (i = 0; i < LINES; i++) {
+        log_kv(LOG_INFO, "request", LOG_INT("id", i),
+               LOG_DUR_US("lat", i % 977), LOG_STR("from", "cache"));
+    }
+
+    log_deinit();
+
+    bench_report(name, LINES, "line", bench_now() - start);
+
+    unlink(BENCH_LOG);
+}
+
+/*
+ * The original log_write(), which formats the timestamp with
+ * gettimeofday(), localtime() and strftime() on every call.
+ */
+static void __attribute__((format(printf, 4, 5)))
+baseline_write(int fd, const char *file, int line, const char *msg, ...)
+{
+    char           buf[LOG_MAX_LEN];
+    int            len = 0;
+    int            size = LOG_MAX_LEN;
+    va_list        args;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    buf[len++] = '[';
+    len += strftime(buf + len, size - len, "%Y-%m-%d %H:%M:%S.",
+                    localtime(&tv.tv_sec));
+    len += snprintf(buf + len, size - len, "%03ld", tv.tv_usec / 1000);
+    len += snprintf(buf + len, size - len, "] %s:%d ", file, line);
+
+    va_start(args, msg);
+    len += vsnprintf(buf + len, size - len, msg, args);
+    va_end(args);
+
+    buf[len++] = '\n';
+
+    if (write(fd, buf, len) < 0) {
+        abort();
+    }
+}
+
+/*
+ * Formats LINES messages with baseline_write() to /dev/null.
+ */
+static void
+bench_baseline(void)
+{
+    uint64_t start;
+    int      fd = open("/dev/null", O_WRONLY | O_APPEND);
+    int      i;
+
+    start = bench_now();
+
+    for (i = 0; i < LINES; i++) {
+        baseline_write(fd, __FILE__, __LINE__,
+                       "request %d served in %d us from %s", i, i % 977,
+                       "cache");
+    }
+
+    bench_report("baseline (strftime per line)", LINES, "line",
+                 bench_now() - start);
+
+    close(fd);
+}
+
+int
+main(void)
+{
+    struct log_options opts;
+
+    /* timestamp formatting cost, without disk I/O */
+    bench_baseline();
+
+    /* cost of the inline level check */
+    bench_suppressed();
+    bench_ratelimited();
+    bench_recorded();
+
+    memset(&opts, 0, sizeof(opts));
+    bench_lines("cached prefix, msec", &opts, "/dev/null");
+
+    memset(&opts, 0, sizeof(opts));
+    opts.precision = LOG_PRECISION_USEC;
+    bench_lines("cached prefix, usec", &opts, "/dev/null");
+
+    memset(&opts, 0, sizeof(opts));
+    opts.precision = LOG_PRECISION_NSEC;
+    bench_lines("cached prefix, nsec", &opts, "/dev/null");
+
+    memset(&opts, 0, sizeof(opts));
+    opts.precision = LOG_PRECISION_NSEC;
+    opts.clock = LOG_CLOCK_MONOTONIC;
+    bench_lines("cached prefix, nsec monotonic", &opts, "/dev/null");
+
+    memset(&opts, 0, sizeof(opts));
+    opts.precision = LOG_PRECISION_NSEC;
+    opts.clock = LOG_CLOCK_TSC;
+    bench_lines("cached prefix, nsec tsc", &opts, "/dev/null");
+
+    memset(&opts, 0, sizeof(opts));
+    bench_lines("log_info, sync", &opts, BENCH_LOG);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.buffer = 64 * 1024;
+    bench_lines("log_info, buffered", &opts, BENCH_LOG);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.buffer = 64 * 1024;
+    opts.latency = true;
+    bench_lines("log_info, buffered, latency", &opts, BENCH_LOG);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.buffer = 64 * 1024;
+    opts.thread = true;
+    bench_lines("log_info, buffered, thread", &opts, BENCH_LOG);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.async = 4096;
+    bench_lines("log_info, async", &opts, BENCH_LOG);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.mmap = 16 * 1024 * 1024;
+    bench_lines("log_info, mmap", &opts, BENCH_LOG);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.format = LOG_FORMAT_BINARY;
+    opts.buffer = 64 * 1024;
+    bench_lines("log_info, binary buffered", &opts, BENCH_LOG);
+
+    bench_kv("log_kv, buffered", LOG_FORMAT_TEXT);
+    bench_kv("log_kv, logfmt buffered", LOG_FORMAT_LOGFMT);
+    bench_kv("log_kv, json buffered", LOG_FORMAT_JSON);
+
+    return EXIT_SUCCESS;
+}
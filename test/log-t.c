@@ -17,8 +17,16 @@
  */
 
 #include <config.h>
+#include <fcntl.h>
 #include <portable/macros.h>
 #include <portable/system.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <test/tap/basic.h>
 #include <test/tap/process.h>
 #include <util/log.h>
@@ -35,6 +43,7 @@ test_loggable(void)
     ok(log_init(LOG_EMERG, NULL), "level = EMERG");
 
     ok(log_loggable(LOG_EMERG), "msg @ EMERG");
+    is_int(LOG_EMERG, log_threshold, "threshold = EMERG");
 
     for (i = 1; i < ARRAY_SIZE(levels) - 1; i++) {
         ok(!log_loggable(i), "msg @ %li", i);
@@ -43,6 +52,7 @@ test_loggable(void)
     log_deinit();
 
     ok(log_init(LOG_DEBUG, NULL), "level = DEBUG");
+    is_int(LOG_DEBUG, log_threshold, "threshold = DEBUG");
 
     for (i = 0; i < ARRAY_SIZE(levels); i++) {
         ok(log_loggable(i), "msg @ %li", i);
@@ -92,6 +102,2111 @@ test_output(void)
     test_tmpdir_free(dir);
 }
 
+/* threads and messages per thread in the asynchronous test */
+#define ASYNC_THREADS  4
+#define ASYNC_MESSAGES 1000
+
+/*
+ * Returns the number of lines in file.
+ */
+static size_t
+count_lines(const char *file)
+{
+    FILE * fp = fopen(file, "r");
+    size_t lines = 0;
+    int    c;
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while ((c = fgetc(fp)) != EOF) {
+        if (c == '\n') {
+            lines++;
+        }
+    }
+
+    fclose(fp);
+
+    return lines;
+}
+
+static void *
+async_writer(void *data)
+{
+    int i;
+
+    for (i = 0; i < ASYNC_MESSAGES; i++) {
+        log_info("thread %d message %d", (int)(intptr_t)data, i);
+    }
+
+    return NULL;
+}
+
+/*
+ * Log concurrently through the asynchronous writer thread, and check
+ * every message is written (or counted as dropped) by log_deinit().
+ */
+static void
+test_async(log_overflow_t overflow, size_t capacity, const char *name)
+{
+    struct log_options opts;
+    pthread_t          threads[ASYNC_THREADS];
+    char *             dir = test_tmpdir();
+    char *             file = malloc(strlen(dir) + 11);
+    size_t             lines;
+    int                i;
+
+    strcpy(file, dir);
+    strcat(file, "/log-async");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.async = capacity;
+    opts.overflow = overflow;
+
+    opts.async = SIZE_MAX;
+    ok(!log_init_opts(&opts), "%s: oversized queue", name);
+    opts.async = capacity;
+
+    ok(log_init_opts(&opts), "%s: async init", name);
+
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        pthread_create(&threads[i], NULL, async_writer, (void *)(intptr_t)i);
+    }
+
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    log_deinit();
+
+    lines = count_lines(file);
+    if (overflow == LOG_OVERFLOW_BLOCK) {
+        is_int(ASYNC_THREADS * ASYNC_MESSAGES, lines, "%s: all written",
+               name);
+        is_int(0, log_dropped(), "%s: none dropped", name);
+    } else {
+        ok(lines > 0, "%s: some written", name);
+        is_int(ASYNC_THREADS * ASYNC_MESSAGES, lines + log_dropped(),
+               "%s: written + dropped", name);
+    }
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Returns the malloc()ed path of name in dir.
+ */
+static char *
+tmp_path(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+    sprintf(path, "%s/%s", dir, name);
+    unlink(path); /* just in case; result doesn't matter */
+
+    return path;
+}
+
+/*
+ * Check the timestamp prefix at each precision.
+ */
+static void
+test_precision(log_precision_t precision, size_t digits, const char *name)
+{
+    struct log_options opts;
+    char *             dir = test_tmpdir();
+    char *             file = malloc(strlen(dir) + 10);
+    char               line[LOG_MAX_LEN];
+    FILE *             fp;
+    size_t             i;
+
+    strcpy(file, dir);
+    strcat(file, "/log-prec");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.precision = precision;
+
+    ok(log_init_opts(&opts), "%s: init", name);
+    log_info("first");
+    log_info("second");
+    log_deinit();
+
+    fp = fopen(file, "r");
+    ok(fp != NULL, "%s: open", name);
+
+    for (i = 0; i < 2 && fp != NULL; i++) {
+        ok(fgets(line, sizeof(line), fp) != NULL, "%s: read line", name);
+
+        /* [YYYY-mm-dd HH:MM:SS.<digits>] */
+        ok(line[0] == '[' && line[20] == '.', "%s: seconds prefix", name);
+        is_int(digits, strspn(line + 21, "0123456789"), "%s: digits", name);
+        ok(line[21 + digits] == ']', "%s: closing bracket", name);
+    }
+
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Check that timestamps from clock are current wall times, in order.
+ */
+static void
+test_clock(log_clock_t clock, const char *name)
+{
+    struct log_options opts;
+    struct tm          tm;
+    char *             dir = test_tmpdir();
+    char *             file = tmp_path(dir, "log-clock");
+    char               line[LOG_MAX_LEN];
+    FILE *             fp;
+    time_t             start = time(NULL);
+    time_t             sec;
+    long               nsec;
+    long long          prev = 0;
+    long long          ns;
+    bool               current = true;
+    bool               ordered = true;
+    int                n = 0;
+    int                i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.precision = LOG_PRECISION_NSEC;
+    opts.clock = clock;
+
+    ok(log_init_opts(&opts), "%s: init", name);
+    for (i = 0; i < 100; i++) {
+        log_info("tick %d", i);
+    }
+    log_deinit();
+
+    fp = fopen(file, "r");
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_isdst = -1;
+        if (sscanf(line, "[%d-%d-%d %d:%d:%d.%ld]", &tm.tm_year, &tm.tm_mon,
+                   &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &nsec)
+            != 7) {
+            break;
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        sec = mktime(&tm);
+
+        /* within the test, allowing for the calibration of LOG_CLOCK_TSC */
+        if (sec < start - 1 || sec > time(NULL) + 1) {
+            current = false;
+        }
+
+        ns = (long long)sec * 1000000000LL + nsec;
+        if (ns < prev) {
+            ordered = false;
+        }
+        prev = ns;
+        n++;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    is_int(100, n, "%s: timestamps", name);
+    ok(current, "%s: wall time", name);
+    ok(ordered, "%s: ordered", name);
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Initializes buffered output to file, with a flush period long
+ * enough that the flusher thread does not run during the test.
+ */
+static bool
+init_buffered(char *file)
+{
+    struct log_options opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.buffer = 4096;
+    opts.flush_ms = 60000;
+
+    return log_init_opts(&opts);
+}
+
+static void
+exit_buffered(void *data)
+{
+    init_buffered(data);
+    log_info("written at exit");
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Check buffered output is written only when flushed.
+ */
+static void
+test_buffered(void)
+{
+    char *dir = test_tmpdir();
+    char *file = malloc(strlen(dir) + 9);
+
+    strcpy(file, dir);
+    strcat(file, "/log-buf");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    ok(init_buffered(file), "buffered init");
+
+    log_info("one");
+    log_info("two");
+    is_int(0, count_lines(file), "buffered");
+
+    log_flush();
+    is_int(2, count_lines(file), "log_flush");
+
+    log_info("three");
+    log_crit("four");
+    is_int(4, count_lines(file), "LOG_CRIT flushes");
+
+    log_info("five");
+    log_deinit();
+    is_int(5, count_lines(file), "log_deinit flushes");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    is_function_output(exit_buffered, file, EXIT_SUCCESS, "",
+                       "exit without log_deinit");
+    is_int(1, count_lines(file), "exit flushes");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Logs one message at each of LOG_NOTICE and LOG_INFO from this file,
+ * and one at LOG_INFO from module "custom".
+ */
+static void
+log_modules(void)
+{
+    log_notice("notice");
+    log_info("info");
+
+#undef LOG_MODULE
+#define LOG_MODULE "custom"
+    log_info("custom info");
+#undef LOG_MODULE
+#define LOG_MODULE NULL
+}
+
+/*
+ * Check per-module levels override the level set by log_init().
+ */
+static void
+test_module_levels(void)
+{
+    char *dir = test_tmpdir();
+    char *file = malloc(strlen(dir) + 9);
+
+    strcpy(file, dir);
+    strcat(file, "/log-mod");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    ok(log_init(LOG_NOTICE, file), "modules: init");
+
+    log_modules();
+    is_int(1, count_lines(file), "modules: global level");
+
+    ok(log_set_module_level("log-t", LOG_INFO), "modules: set log-t");
+    log_modules();
+    is_int(3, count_lines(file), "modules: file module raised");
+
+    ok(log_set_module_level("custom", LOG_INFO), "modules: set custom");
+    ok(log_set_module_level("log-t", LOG_WARN), "modules: reset log-t");
+    log_modules();
+    is_int(4, count_lines(file), "modules: LOG_MODULE raised");
+
+    log_clear_module_level("log-t");
+    log_clear_module_level("custom");
+    log_modules();
+    is_int(5, count_lines(file), "modules: cleared");
+
+    log_deinit();
+
+    /* overrides outlive log_init() */
+    ok(log_set_module_level("log-t", LOG_ERR), "modules: set before init");
+    ok(log_init(LOG_INFO, file), "modules: reinit");
+    log_modules();
+    is_int(6, count_lines(file), "modules: override kept");
+    log_clear_module_level("log-t");
+    log_deinit();
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Returns the number of lines of file containing str.
+ */
+static size_t
+count_matches(const char *file, const char *str)
+{
+    FILE * fp = fopen(file, "r");
+    char   line[LOG_MAX_LEN];
+    size_t n = 0;
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, str) != NULL) {
+            n++;
+        }
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+/* call sites shared by the phases of test_limited() */
+static void
+limited_first(int i)
+{
+    log_first_n(LOG_INFO, 2, "first %d", i);
+}
+
+static void
+limited_rate(int i)
+{
+    log_ratelimited(LOG_INFO, 5, "rate %d", i);
+}
+
+/*
+ * Check the rate-limited macros, and their reports of suppressed
+ * messages.
+ */
+static void
+test_limited(void)
+{
+    char *          dir = test_tmpdir();
+    char *          file = malloc(strlen(dir) + 11);
+    struct timespec pause = {1, 100000000}; /* > LOG_SUPPRESSED_MS */
+    int             i;
+
+    strcpy(file, dir);
+    strcat(file, "/log-limit");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    ok(log_init(LOG_INFO, file), "limited: init");
+
+    for (i = 0; i < 10; i++) {
+        log_every_n(LOG_INFO, 3, "every %d", i);
+        limited_first(i);
+        limited_rate(i);
+        log_ratelimited(LOG_DEBUG, 5, "debug %d", i);
+    }
+
+    is_int(4, count_matches(file, " every "), "limited: every 3rd");
+    is_int(1, count_matches(file, " every 9"), "limited: every 10th call");
+    is_int(2, count_matches(file, " first "), "limited: first 2");
+    is_int(5, count_matches(file, " rate "), "limited: burst of 5");
+    is_int(0, count_matches(file, " debug "), "limited: level applies");
+    is_int(0, count_matches(file, "suppressed"), "limited: no report yet");
+
+    nanosleep(&pause, NULL);
+
+    limited_first(i);
+    is_int(1, count_matches(file, "suppressed 9 messages"),
+           "limited: report of suppressed messages");
+    is_int(2, count_matches(file, " first "), "limited: still suppressed");
+
+    for (i = 0; i < 10; i++) {
+        limited_rate(i);
+    }
+    is_int(10, count_matches(file, " rate "), "limited: bucket refilled");
+    is_int(1, count_matches(file, "suppressed 5 messages"),
+           "limited: report of rate-limited messages");
+
+    /* counts of sites no longer called are reported by log_flush() */
+    log_flush();
+    is_int(1, count_matches(file, "suppressed 6 messages"),
+           "limited: flushed report");
+
+    log_deinit();
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Waits up to 3 seconds for path to exist.
+ */
+static bool
+wait_for(const char *path)
+{
+    struct timespec pause = {0, 10000000};
+    int             i;
+
+    for (i = 0; i < 300; i++) {
+        if (access(path, F_OK) == 0) {
+            return true;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    return false;
+}
+
+static void
+reopen_handler(int sig)
+{
+    (void)sig; /* prevent -Wunused */
+    log_reopen();
+}
+
+/*
+ * Check size- and time-based rotation, and log_reopen() from a signal
+ * handler with and without the rotator thread.
+ */
+static void
+test_rotate(void)
+{
+    struct log_options opts;
+    char *             dir = test_tmpdir();
+    char               file[256];
+    char               file1[256];
+    char               file2[256];
+    char               file3[256];
+    int                i;
+
+    snprintf(file, sizeof(file), "%s/log-rot", dir);
+    snprintf(file1, sizeof(file1), "%s/log-rot.1", dir);
+    snprintf(file2, sizeof(file2), "%s/log-rot.2", dir);
+    snprintf(file3, sizeof(file3), "%s/log-rot.3", dir);
+
+    unlink(file); /* just in case; result doesn't matter */
+    unlink(file1);
+    unlink(file2);
+    unlink(file3);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.rotate_size = 512;
+    opts.rotate_keep = 2;
+    ok(log_init_opts(&opts), "rotate: size init");
+
+    /* each batch passes rotate_size */
+    for (i = 0; i < 10; i++) {
+        log_info("first batch, message %d", i);
+    }
+    ok(wait_for(file1) && wait_for(file), "rotate: rotated to .1");
+
+    for (i = 0; i < 10; i++) {
+        log_info("second batch, message %d", i);
+    }
+    ok(wait_for(file2) && wait_for(file), "rotate: rotated to .2");
+
+    log_deinit();
+
+    /* rotation may happen at any message after the size is passed */
+    ok(count_lines(file2) > 0, "rotate: oldest file");
+    ok(count_lines(file1) > 0, "rotate: newer file");
+    is_int(20, count_lines(file2) + count_lines(file1) + count_lines(file),
+           "rotate: no message lost");
+    ok(access(file3, F_OK) < 0, "rotate: rotate_keep");
+
+    unlink(file);
+    unlink(file1);
+    unlink(file2);
+
+    opts.rotate_size = 0;
+    opts.rotate_secs = 1;
+    ok(log_init_opts(&opts), "rotate: time init");
+    log_info("before");
+    ok(wait_for(file1) && wait_for(file), "rotate: rotated by time");
+    log_info("after");
+    log_deinit();
+
+    is_int(1, count_lines(file1), "rotate: before time rotation");
+    is_int(1, count_lines(file), "rotate: after time rotation");
+
+    unlink(file);
+    unlink(file1);
+
+    signal(SIGHUP, reopen_handler);
+
+    /* without the rotator thread, log_reopen() reopens inline */
+    ok(log_init(LOG_INFO, file), "reopen: init");
+    log_info("before");
+    is_int(0, rename(file, file1), "reopen: rename");
+    raise(SIGHUP);
+    ok(access(file, F_OK) == 0, "reopen: reopened inline");
+    log_info("after");
+    log_deinit();
+
+    is_int(1, count_lines(file1), "reopen: before reopen");
+    is_int(1, count_lines(file), "reopen: after reopen");
+
+    unlink(file);
+    unlink(file1);
+
+    /* with the rotator thread, it reopens the file */
+    opts.rotate_secs = 3600;
+    ok(log_init_opts(&opts), "reopen: rotator init");
+    log_info("before");
+    is_int(0, rename(file, file1), "reopen: rename with rotator");
+    raise(SIGHUP);
+    ok(wait_for(file), "reopen: reopened by rotator");
+    log_info("after");
+    log_deinit();
+
+    is_int(1, count_lines(file1), "reopen: before rotator reopen");
+    is_int(1, count_lines(file), "reopen: after rotator reopen");
+
+    signal(SIGHUP, SIG_DFL);
+
+    is_int(0, unlink(file), "unlink %s", file);
+    is_int(0, unlink(file1), "unlink %s", file1);
+
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Returns true if file has exactly its contents, with no trailing
+ * preallocated zeros.
+ */
+static bool
+is_truncated(const char *file)
+{
+    FILE * fp = fopen(file, "r");
+    int    c;
+    int    last = EOF;
+    bool   zero = false;
+
+    if (fp == NULL) {
+        return false;
+    }
+
+    while ((c = fgetc(fp)) != EOF) {
+        zero = zero || c == '\0';
+        last = c;
+    }
+
+    fclose(fp);
+
+    return !zero && last == '\n';
+}
+
+/*
+ * Check memory-mapped output across extents, from concurrent writers,
+ * and appended to an existing file.
+ */
+static void
+test_mmap(void)
+{
+    struct log_options opts;
+    pthread_t          threads[ASYNC_THREADS];
+    char *             dir = test_tmpdir();
+    char *             file = malloc(strlen(dir) + 10);
+    int                i;
+
+    strcpy(file, dir);
+    strcat(file, "/log-mmap");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.mmap = 1; /* one page */
+
+    ok(log_init_opts(&opts), "mmap: init");
+    for (i = 0; i < 1000; i++) {
+        log_info("mapped message %d", i);
+    }
+    log_deinit();
+
+    is_int(1000, count_lines(file), "mmap: all written");
+    ok(is_truncated(file), "mmap: truncated");
+
+    ok(log_init_opts(&opts), "mmap: append init");
+
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        pthread_create(&threads[i], NULL, async_writer, (void *)(intptr_t)i);
+    }
+
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    log_deinit();
+
+    is_int(1000 + ASYNC_THREADS * ASYNC_MESSAGES, count_lines(file),
+           "mmap: all appended");
+    ok(is_truncated(file), "mmap: appended file truncated");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Check memory-mapped output past the end of the disk, simulated by a
+ * file size limit, drops messages, and that once there is room again
+ * writers are not left waiting for the window of an extent that
+ * failed part way.
+ */
+static void
+test_mmap_full(void)
+{
+    struct log_options opts;
+    struct rlimit      limit;
+    char *             dir = test_tmpdir();
+    char *             file = malloc(strlen(dir) + 15);
+    pid_t              pid;
+    int                status = -1;
+    int                i;
+
+    strcpy(file, dir);
+    strcat(file, "/log-mmap-full");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.mmap = 1; /* one page */
+
+    /* the limit applies to the whole process, so log in a child */
+    pid = fork();
+    if (pid == 0) {
+        alarm(10); /* a hang fails the test */
+        signal(SIGXFSZ, SIG_IGN);
+        limit.rlim_cur = 2 * 4096;
+        limit.rlim_max = RLIM_INFINITY;
+        if (setrlimit(RLIMIT_FSIZE, &limit) < 0 || !log_init_opts(&opts)) {
+            _exit(2);
+        }
+        for (i = 0; i < 1000; i++) {
+            log_info("message past the limit %d", i);
+        }
+        limit.rlim_cur = RLIM_INFINITY;
+        setrlimit(RLIMIT_FSIZE, &limit);
+        for (i = 0; i < 1000; i++) {
+            log_info("message after the limit %d", i);
+        }
+        log_deinit();
+        _exit(0);
+    }
+
+    ok(pid > 0, "mmap full: fork");
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    ok(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+       "mmap full: writers not stranded");
+    ok(count_lines(file) > 0, "mmap full: written up to the limit");
+    ok(count_matches(file, " after the limit 999\n") == 1,
+       "mmap full: written after the limit");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Logs messages exercising each binary argument encoding.
+ */
+static void
+log_samples(void)
+{
+    int    i = -42;
+    void * p = &i;
+    double d = 2.5;
+
+    log_info("plain message");
+    log_info("int %d unsigned %u hex %#x char %c", i, 42u, 255u, 'z');
+    log_info("long %ld llong %lld size %zu", -1L, 1LL << 40, (size_t)7);
+    log_info("double %.2f %g long double %.1Lf", d, d, (long double)d);
+    log_info("str '%s' prec '%.3s' star '%.*s' null", "abc", "abcdef", 2,
+             "xyz");
+    log_info("width '%*d' '%-*.*s' 100%%", 5, 7, 6, 2, "abcdef");
+    log_info("pointer %p", p);
+    log_info("wide %ls", L"string"); /* not encodable; logged as text */
+}
+
+/*
+ * Reads the lines of fp after their timestamp, into lines.
+ */
+static size_t
+read_messages(FILE *fp, char lines[][LOG_MAX_LEN], size_t max)
+{
+    char   line[LOG_MAX_LEN];
+    char * p;
+    size_t n = 0;
+
+    while (n < max && fgets(line, sizeof(line), fp) != NULL) {
+        p = strstr(line, "] ");
+        strcpy(lines[n++], p != NULL ? p + 2 : line);
+    }
+
+    return n;
+}
+
+/*
+ * Check binary output decodes to the same messages as text output.
+ */
+static void
+test_binary(void)
+{
+    struct log_options opts;
+    char *             dir = test_tmpdir();
+    char *             text = malloc(strlen(dir) + 10);
+    char *             bin = malloc(strlen(dir) + 9);
+    char *             decode = test_file_path("../tools/log-decode");
+    char *             cmd;
+    char               expected[16][LOG_MAX_LEN];
+    char               actual[16][LOG_MAX_LEN];
+    size_t             nexpected = 0;
+    size_t             nactual = 0;
+    size_t             i;
+    FILE *             fp;
+
+    strcpy(text, dir);
+    strcat(text, "/log-text");
+    strcpy(bin, dir);
+    strcat(bin, "/log-bin");
+
+    unlink(text); /* just in case; result doesn't matter */
+    unlink(bin);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = text;
+    ok(log_init_opts(&opts), "binary: text init");
+    log_samples();
+    log_deinit();
+
+    opts.filename = bin;
+    opts.format = LOG_FORMAT_BINARY;
+    ok(log_init_opts(&opts), "binary: binary init");
+    log_samples();
+    log_write_level(LOG_INFO, "file.c", 1, "without site %d", 1);
+    log_write("file.c", 2, "at threshold %d", 2);
+    log_deinit();
+
+    /* a second session redefines its sites */
+    ok(log_init_opts(&opts), "binary: append init");
+    log_info("second session %s", "ok");
+    log_deinit();
+
+    fp = fopen(text, "r");
+    ok(fp != NULL, "binary: open text");
+    if (fp != NULL) {
+        nexpected = read_messages(fp, expected, 16);
+        fclose(fp);
+    }
+
+    ok(decode != NULL, "binary: found log-decode");
+    if (decode != NULL) {
+        cmd = malloc(strlen(decode) + strlen(bin) + 2);
+        sprintf(cmd, "%s %s", decode, bin);
+        fp = popen(cmd, "r");
+        ok(fp != NULL, "binary: run log-decode");
+        if (fp != NULL) {
+            nactual = read_messages(fp, actual, 16);
+            is_int(0, pclose(fp), "binary: log-decode status");
+        }
+        free(cmd);
+    }
+
+    is_int(8, nexpected, "binary: text messages");
+    is_int(nexpected + 3, nactual, "binary: decoded messages");
+    for (i = 0; i < nexpected && i < nactual; i++) {
+        is_string(expected[i], actual[i], "binary: message %zu", i);
+    }
+    if (nactual == nexpected + 3) {
+        is_string("file.c:1 without site 1\n", actual[i],
+                  "binary: message without site");
+        is_string("file.c:2 at threshold 2\n", actual[i + 1],
+                  "binary: message at threshold");
+        ok(strstr(actual[i + 2], " second session ok\n") != NULL,
+           "binary: second session");
+    }
+
+    /*
+     * A LOG_REC_SITE record (type 1) of site id 0xffffffff, line 1,
+     * file "f" and format "x", beyond any site the decoder tracks.
+     */
+    fp = fopen(bin, "a");
+    ok(fp != NULL, "binary: append bad site");
+    if (fp != NULL) {
+        unsigned char rec[16] = {0, 0, 1, LOG_INFO, 0xff, 0xff, 0xff, 0xff,
+                                 1, 0, 0, 0, 'f', '\0', 'x', '\0'};
+        uint16_t      len = sizeof(rec);
+        uint32_t      line = 1;
+
+        memcpy(rec, &len, 2);      /* NOLINT */
+        memcpy(rec + 8, &line, 4); /* NOLINT */
+        fwrite(rec, sizeof(rec), 1, fp);
+        fclose(fp);
+    }
+
+    if (decode != NULL) {
+        cmd = malloc(strlen(decode) + strlen(bin) + 20);
+        sprintf(cmd, "%s %s 2>/dev/null", decode, bin);
+        fp = popen(cmd, "r");
+        ok(fp != NULL, "binary: run log-decode on bad site");
+        if (fp != NULL) {
+            nactual = read_messages(fp, actual, 16);
+            ok(pclose(fp) != 0, "binary: bad site id rejected");
+            is_int(nexpected + 3, nactual, "binary: messages before it");
+        }
+        free(cmd);
+    }
+
+    is_int(0, unlink(text), "unlink %s", text);
+    is_int(0, unlink(bin), "unlink %s", bin);
+
+    test_file_path_free(decode);
+    free(text);
+    free(bin);
+    test_tmpdir_free(dir);
+}
+
+/* messages per thread in the binary rotation test */
+#define ROTATE_MESSAGES 5000
+
+static void *
+rotate_writer(void *data)
+{
+    int i;
+
+    for (i = 0; i < ROTATE_MESSAGES; i++) {
+        log_info("rotating %s %d", (const char *)data, i);
+    }
+
+    return NULL;
+}
+
+/*
+ * Check binary logs rotated while another thread logs each decode in
+ * full: every file begins its session before any event.
+ */
+static void
+test_binary_rotate(void)
+{
+    struct log_options opts;
+    pthread_t          thread;
+    char *             dir = test_tmpdir();
+    char *             decode = test_file_path("../tools/log-decode");
+    char               file[256];
+    char               name[264];
+    char               cmd[1024];
+    char               line[LOG_MAX_LEN];
+    size_t             events = 0;
+    size_t             undefined = 0;
+    int                files = 0;
+    int                i;
+    FILE *             fp;
+
+    snprintf(file, sizeof(file), "%s/log-brot", dir);
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.format = LOG_FORMAT_BINARY;
+    opts.rotate_size = 2048;
+    opts.rotate_keep = 512;
+    ok(log_init_opts(&opts), "binary rotate: init");
+
+    pthread_create(&thread, NULL, rotate_writer, "thread");
+    rotate_writer("main");
+    pthread_join(thread, NULL);
+
+    log_deinit();
+
+    ok(decode != NULL, "binary rotate: found log-decode");
+    for (i = 0; decode != NULL && i <= 512; i++) {
+        if (i == 0) {
+            snprintf(name, sizeof(name), "%s", file);
+        } else {
+            snprintf(name, sizeof(name), "%s.%d", file, i);
+        }
+        if (access(name, F_OK) < 0) {
+            continue;
+        }
+        files++;
+
+        snprintf(cmd, sizeof(cmd), "%s %s 2>&1", decode, name);
+        fp = popen(cmd, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            events += strstr(line, " rotating ") != NULL;
+            undefined += strstr(line, "undefined site") != NULL;
+        }
+        pclose(fp);
+        unlink(name);
+    }
+
+    ok(files > 1, "binary rotate: rotated");
+    is_int(0, undefined, "binary rotate: no event before its site");
+    is_int(2 * ROTATE_MESSAGES, events, "binary rotate: no event lost");
+
+    test_file_path_free(decode);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Check recorded messages are output only when dumped.
+ */
+static void
+test_recorder(void)
+{
+    struct log_options opts;
+    char *             dir = test_tmpdir();
+    char *             file = malloc(strlen(dir) + 14);
+    pid_t              pid;
+    int                status;
+    int                i;
+
+    strcpy(file, dir);
+    strcat(file, "/log-recorder");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_NOTICE;
+    opts.filename = file;
+    opts.recorder = 64 * 1024;
+
+    ok(log_init_opts(&opts), "recorder: init");
+    ok(log_loggable(LOG_NOTICE), "recorder: notice loggable");
+    ok(!log_loggable(LOG_INFO), "recorder: info not loggable");
+    log_info("recorded info %d", 1);
+    log_info("recorded ratio %.2f", 0.5);
+    log_notice("recorded notice %s", "two");
+    log_flush();
+
+    is_int(1, count_lines(file), "recorder: only notice output");
+
+    log_recorder_dump();
+    log_deinit();
+
+    is_int(6, count_lines(file), "recorder: dumped");
+    is_int(1, count_matches(file, "flight recorder: thread"),
+           "recorder: dump header");
+    is_int(1, count_matches(file, " recorded info 1\n"),
+           "recorder: info dumped");
+    is_int(1, count_matches(file, " recorded ratio %.2f\n"),
+           "recorder: unsupported conversion dumped as is");
+    is_int(2, count_matches(file, " recorded notice two\n"),
+           "recorder: notice output and dumped");
+    is_int(1, count_matches(file, ", 3 messages\n"),
+           "recorder: dump trailer");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    /* the smallest ring keeps only the most recent messages */
+    opts.recorder = 1;
+    ok(log_init_opts(&opts), "recorder: small init");
+    for (i = 0; i < 1000; i++) {
+        log_info("overwritten message %d.", i);
+    }
+    log_recorder_dump();
+    log_deinit();
+
+    is_int(0, count_matches(file, " overwritten message 0."),
+           "recorder: oldest dropped");
+    is_int(1, count_matches(file, " overwritten message 999."),
+           "recorder: newest kept");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    /* a fatal signal dumps the rings */
+    pid = fork();
+    if (pid == 0) {
+        opts.recorder = 64 * 1024;
+        if (log_init_opts(&opts)) {
+            log_info("before crash %d", 42);
+            raise(SIGSEGV);
+        }
+        _exit(1);
+    }
+
+    ok(pid > 0, "recorder: fork");
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+        ok(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV,
+           "recorder: crashed");
+        is_int(1, count_matches(file, " before crash 42\n"),
+               "recorder: dumped on crash");
+    }
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    /* and so does it to a memory map, without blocking in the handler */
+    pid = fork();
+    if (pid == 0) {
+        alarm(10); /* a hang fails the test */
+        opts.recorder = 64 * 1024;
+        opts.mmap = 64 * 1024;
+        if (log_init_opts(&opts)) {
+            log_notice("mapped");
+            log_info("before mapped crash %d", 42);
+            raise(SIGSEGV);
+        }
+        _exit(1);
+    }
+
+    ok(pid > 0, "recorder: mmap fork");
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+        ok(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV,
+           "recorder: mmap crashed");
+        is_int(1, count_matches(file, " before mapped crash 42\n"),
+               "recorder: mmap dumped on crash");
+    }
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Reads up to size - 1 bytes of file into buf, returning its length.
+ */
+static size_t
+read_file(const char *file, char *buf, size_t size)
+{
+    FILE * fp = fopen(file, "r");
+    size_t n = 0;
+
+    if (fp != NULL) {
+        n = fread(buf, 1, size - 1, fp);
+        fclose(fp);
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+
+/*
+ * Logs the structured messages of test_kv().
+ */
+static void
+log_fields(void)
+{
+    char path[300];
+
+    log_kv(LOG_INFO, "request", LOG_STR("path", "/a b"),
+           LOG_INT("status", -200), LOG_DUR_US("lat", 1500),
+           LOG_BOOL("ok", 1), LOG_UINT("bytes", 18446744073709551615ULL));
+    log_kv(LOG_INFO, "escapes", LOG_STR("q", "say \"hi\"\n\\"),
+           LOG_STR("ctl", "\001"), LOG_STR("empty", ""),
+           LOG_STR("null", NULL));
+    log_kv(LOG_DEBUG, "suppressed", LOG_INT("n", 1));
+    log_info("plain %d", 1);
+
+    /* a truncated message keeps whole fields */
+    memset(path, 'p', sizeof(path)); /* NOLINT */
+    path[sizeof(path) - 1] = '\0';
+    log_kv(LOG_INFO, "long", LOG_INT("before", 1), LOG_STR("path", path));
+}
+
+/*
+ * Check structured messages in each format.
+ */
+static void
+test_kv(void)
+{
+    struct log_options opts;
+    char *             dir = test_tmpdir();
+    char *             file = malloc(strlen(dir) + 8);
+    char               buf[4096];
+    char *             line;
+
+    strcpy(file, dir);
+    strcat(file, "/log-kv");
+
+    unlink(file); /* just in case; result doesn't matter */
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+
+    ok(log_init_opts(&opts), "kv: text init");
+    log_fields();
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    ok(strstr(buf, " request path=\"/a b\" status=-200 lat=1500us ok=true"
+                   " bytes=18446744073709551615\n")
+           != NULL,
+       "kv: text fields");
+    ok(strstr(buf, " escapes q=\"say \\\"hi\\\"\\n\\\\\" ctl=\"\\u0001\""
+                   " empty=\"\" null=null\n")
+           != NULL,
+       "kv: text escapes");
+    ok(strstr(buf, "suppressed") == NULL, "kv: text level");
+    ok(strstr(buf, " long before=1\n") != NULL, "kv: text truncated");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    opts.format = LOG_FORMAT_LOGFMT;
+    ok(log_init_opts(&opts), "kv: logfmt init");
+    log_fields();
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    is_int(0, strncmp(buf, "ts=", 3), "kv: logfmt timestamp");
+    ok(strstr(buf, " level=info file=") != NULL, "kv: logfmt level, file");
+    ok(strstr(buf, " msg=request path=\"/a b\" status=-200 lat=1500us")
+           != NULL,
+       "kv: logfmt fields");
+    ok(strstr(buf, " msg=\"plain 1\"\n") != NULL, "kv: logfmt log_info");
+    ok(strstr(buf, " msg=long before=1\n") != NULL, "kv: logfmt truncated");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    opts.format = LOG_FORMAT_JSON;
+    ok(log_init_opts(&opts), "kv: json init");
+    log_fields();
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    is_int(4, count_lines(file), "kv: json lines");
+    for (line = strtok(buf, "\n"); line != NULL;
+         line = strtok(NULL, "\n")) {
+        ok(strncmp(line, "{\"ts\":\"", 7) == 0
+               && line[strlen(line) - 1] == '}',
+           "kv: json object %.20s", line);
+        if (strstr(line, "\"msg\":\"request\"") != NULL) {
+            ok(strstr(line, "\",\"level\":\"info\",\"file\":\"") != NULL,
+               "kv: json level, file");
+            ok(strstr(line, ",\"path\":\"/a b\",\"status\":-200,\"lat\":1500,"
+                            "\"ok\":true,\"bytes\":18446744073709551615}")
+                   != NULL,
+               "kv: json fields");
+        }
+        if (strstr(line, "\"msg\":\"escapes\"") != NULL) {
+            ok(strstr(line, ",\"q\":\"say \\\"hi\\\"\\n\\\\\","
+                            "\"ctl\":\"\\u0001\","
+                            "\"empty\":\"\",\"null\":null}")
+                   != NULL,
+               "kv: json escapes");
+        }
+    }
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Check that messages reach each sink at its level.
+ */
+static void
+test_sinks(void)
+{
+    struct log_options      opts;
+    struct log_sink_options sink;
+    struct sockaddr_un      addr;
+    char *                  dir = test_tmpdir();
+    char *                  file = tmp_path(dir, "log-sinks");
+    char *                  plain = tmp_path(dir, "log-sink-file");
+    char *                  buffered = tmp_path(dir, "log-sink-buffer");
+    char *                  mapped = tmp_path(dir, "log-sink-mmap");
+    char *                  fdfile = tmp_path(dir, "log-sink-fd");
+    char *                  sock = tmp_path(dir, "log-sink-syslog");
+    char                    buf[4096];
+    ssize_t                 n;
+    int                     fd;
+    int                     server;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_WARN;
+    opts.filename = file;
+
+    ok(log_init_opts(&opts), "sinks: init");
+    ok(!log_loggable(LOG_INFO), "sinks: info not loggable");
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = LOG_SINK_FILE;
+    sink.level = LOG_INFO;
+    sink.filename = plain;
+    ok(log_add_sink(&sink), "sinks: add file");
+    ok(log_loggable(LOG_INFO), "sinks: info loggable");
+
+    sink.filename = buffered;
+    sink.buffer = 4096;
+    ok(log_add_sink(&sink), "sinks: add buffered file");
+
+    sink.type = LOG_SINK_MMAP;
+    sink.level = LOG_ERR;
+    sink.filename = mapped;
+    sink.buffer = 0;
+    sink.mmap = 1; /* one page */
+    ok(log_add_sink(&sink), "sinks: add mmap");
+
+    fd = open(fdfile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    sink.type = LOG_SINK_FD;
+    sink.level = LOG_WARN;
+    sink.fd = fd;
+    sink.filename = NULL;
+    ok(log_add_sink(&sink), "sinks: add fd");
+
+    server = socket(AF_UNIX, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr)); /* NOLINT */
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock); /* NOLINT */
+    is_int(0, bind(server, (struct sockaddr *)&addr, sizeof(addr)),
+           "sinks: bind syslog socket");
+
+    sink.type = LOG_SINK_SYSLOG;
+    sink.level = LOG_ERR;
+    sink.filename = sock;
+    ok(log_add_sink(&sink), "sinks: add syslog");
+
+    sink.filename = "/nonexistent/socket";
+    ok(!log_add_sink(&sink), "sinks: add missing syslog fails");
+
+    log_info("sink info");
+    log_warn("sink warn");
+    log_error("sink error");
+    log_kv(LOG_INFO, "sink kv", LOG_INT("n", 1));
+    for (n = 0; n < 3; n++) {
+        log_first_n(LOG_INFO, 1, "sink limited %d", (int)n);
+    }
+    log_deinit();
+
+    ok(!log_loggable(LOG_INFO), "sinks: removed by deinit");
+
+    read_file(file, buf, sizeof(buf));
+    ok(strstr(buf, "sink warn") != NULL && strstr(buf, "sink error") != NULL,
+       "sinks: log written");
+    ok(strstr(buf, "sink info") == NULL && strstr(buf, "sink kv") == NULL,
+       "sinks: log level");
+    ok(strstr(buf, "suppressed") == NULL, "sinks: limit report level");
+
+    is_int(6, count_lines(plain), "sinks: file written");
+    read_file(plain, buf, sizeof(buf));
+    ok(strstr(buf, " sink kv n=1\n") != NULL, "sinks: file fields");
+    ok(strstr(buf, " suppressed 2 messages\n") != NULL,
+       "sinks: limit report");
+
+    is_int(6, count_lines(buffered), "sinks: buffered file flushed");
+
+    is_int(1, count_lines(mapped), "sinks: mmap written");
+    ok(is_truncated(mapped), "sinks: mmap truncated");
+
+    is_int(2, count_lines(fdfile), "sinks: fd written");
+    is_int(1, write(fd, "\n", 1), "sinks: fd left open");
+    close(fd);
+
+    n = recv(server, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+    ok(n > 0, "sinks: syslog received");
+    buf[n > 0 ? n : 0] = '\0';
+    is_int(0, strncmp(buf, "<11>1 ", 6), "sinks: syslog priority");
+    ok(strstr(buf, "sink error") != NULL, "sinks: syslog message");
+    ok(n > 0 && buf[n - 1] != '\n', "sinks: syslog without newline");
+    ok(recv(server, buf, sizeof(buf), MSG_DONTWAIT) < 0,
+       "sinks: syslog level");
+    close(server);
+
+    opts.format = LOG_FORMAT_BINARY;
+    ok(log_init_opts(&opts), "sinks: binary init");
+    sink.type = LOG_SINK_FILE;
+    sink.filename = plain;
+    ok(!log_add_sink(&sink), "sinks: binary unsupported");
+    log_deinit();
+
+    is_int(0, unlink(file), "unlink %s", file);
+    is_int(0, unlink(plain), "unlink %s", plain);
+    is_int(0, unlink(buffered), "unlink %s", buffered);
+    is_int(0, unlink(mapped), "unlink %s", mapped);
+    is_int(0, unlink(fdfile), "unlink %s", fdfile);
+    is_int(0, unlink(sock), "unlink %s", sock);
+
+    free(file);
+    free(plain);
+    free(buffered);
+    free(mapped);
+    free(fdfile);
+    free(sock);
+    test_tmpdir_free(dir);
+}
+
+static void *
+stats_writer(void *arg)
+{
+    (void)arg;
+
+    log_warn("stats from a thread");
+
+    return NULL;
+}
+
+/*
+ * Check that log_stats() counts messages of every thread.
+ */
+static void
+test_stats(void)
+{
+    struct log_options opts;
+    struct log_stats   before;
+    struct log_stats   after;
+    pthread_t          thread;
+    char *             dir = test_tmpdir();
+    char *             file = tmp_path(dir, "log-stats");
+    char               buf[4096];
+    char               big[LOG_MAX_LEN + 50];
+    uint64_t           total = 0;
+    size_t             i;
+
+    memset(big, 'b', sizeof(big)); /* NOLINT */
+    big[sizeof(big) - 1] = '\0';
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.latency = true;
+
+    log_stats(&before);
+
+    ok(log_init_opts(&opts), "stats: init");
+    for (i = 0; i < 3; i++) {
+        log_info("stats %zu", i);
+    }
+    log_info("stats %s", big);
+    log_debug(LOG_DEBUG, "stats not logged");
+    for (i = 0; i < 10; i++) {
+        log_ratelimited(LOG_INFO, 1, "stats limited %zu", i);
+    }
+    pthread_create(&thread, NULL, stats_writer, NULL);
+    pthread_join(thread, NULL);
+    log_deinit();
+
+    log_stats(&after);
+
+    /* with the report of suppressed messages, by log_deinit() */
+    is_int(6, after.messages[LOG_INFO] - before.messages[LOG_INFO],
+           "stats: info messages");
+    is_int(1, after.messages[LOG_WARN] - before.messages[LOG_WARN],
+           "stats: messages of an exited thread");
+    is_int(0, after.messages[LOG_DEBUG] - before.messages[LOG_DEBUG],
+           "stats: debug messages");
+    is_int(0, after.truncated - before.truncated, "stats: not truncated");
+    is_int(9, after.suppressed - before.suppressed, "stats: suppressed");
+    is_int(read_file(file, buf, sizeof(buf)), after.bytes - before.bytes,
+           "stats: bytes");
+
+    for (i = 0; i < LOG_LATENCY_BUCKETS; i++) {
+        total += after.latency[i] - before.latency[i];
+    }
+    is_int(7, total, "stats: latency histogram");
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Check that messages longer than LOG_MAX_LEN are output whole, up to
+ * LOG_MAX_LONG_LEN, and in order with shorter messages.
+ */
+static void
+test_long(size_t buffer, size_t async, const char *name)
+{
+    struct log_options opts;
+    struct log_stats   before;
+    struct log_stats   after;
+    char *             dir = test_tmpdir();
+    char *             file = tmp_path(dir, "log-long");
+    char *             msg = malloc(LOG_MAX_LONG_LEN + 50);
+    char *             buf = malloc(2 * LOG_MAX_LONG_LEN);
+    char *             line;
+    char *             nl;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.buffer = buffer;
+    opts.async = async;
+
+    log_stats(&before);
+
+    ok(log_init_opts(&opts), "long %s: init", name);
+
+    log_info("before");
+    memset(msg, 'x', 2000); /* NOLINT */
+    msg[2000] = '\0';
+    log_info("long %s end", msg);
+    log_info("short");
+
+    memset(msg, 'y', LOG_MAX_LONG_LEN + 49); /* NOLINT */
+    msg[LOG_MAX_LONG_LEN + 49] = '\0';
+    log_info("%s", msg);
+
+    log_deinit();
+
+    log_stats(&after);
+
+    read_file(file, buf, 2 * LOG_MAX_LONG_LEN);
+    is_int(4, count_lines(file), "long %s: lines", name);
+
+    line = buf;
+    nl = strchr(line, '\n');
+    ok(nl != NULL && strncmp(nl - 7, " before", 7) == 0,
+       "long %s: earlier message", name);
+
+    line = nl != NULL ? nl + 1 : line;
+    nl = strchr(line, '\n');
+    ok(nl != NULL && strstr(line, " long xxx") != NULL
+           && nl - line > 2000 && strncmp(nl - 6, "xx end", 6) == 0,
+       "long %s: whole message", name);
+
+    line = nl != NULL ? nl + 1 : line;
+    nl = strchr(line, '\n');
+    ok(nl != NULL && strncmp(nl - 6, " short", 6) == 0,
+       "long %s: short message", name);
+
+    line = nl != NULL ? nl + 1 : line;
+    nl = strchr(line, '\n');
+    is_int(LOG_MAX_LONG_LEN - 1, nl != NULL ? nl - line : 0,
+           "long %s: truncated length", name);
+    is_int(1, after.truncated - before.truncated, "long %s: truncated",
+           name);
+
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(buf);
+    free(msg);
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+static void
+signal_logger(int sig)
+{
+    (void)sig;
+
+    log_signal_safe(LOG_WARN,
+                    "sig %d %i %u %x %X %p %ld %lld %zu %c %.3s %s %%", -42, 7,
+                    42U, 0xbeefU, 0xbeefU, (void *)0x1234, -1L,
+                    -9223372036854775807LL - 1, (size_t)123, 'c', "abcdef",
+                    (char *)NULL);
+    log_signal_safe(LOG_INFO, "unsupported %d %f %d", 1, 2.0, 3);
+    log_signal_safe(LOG_DEBUG, "not logged");
+    log_backtrace(LOG_ERR);
+}
+
+/*
+ * Check messages logged from a signal handler.
+ */
+static void
+test_signal_safe(void)
+{
+    struct log_options opts;
+    struct sigaction   sa;
+    struct sigaction   old;
+    char *             dir = test_tmpdir();
+    char *             file = tmp_path(dir, "log-signal");
+    char               buf[16384];
+    char               expected[LOG_MAX_LEN];
+    char *             line;
+    char *             first = NULL;
+    bool               found = false;
+
+    memset(&sa, 0, sizeof(sa)); /* NOLINT */
+    sa.sa_handler = signal_logger;
+    sigaction(SIGUSR1, &sa, &old);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+
+    ok(log_init_opts(&opts), "signal safe: init");
+    log_info("before");
+    raise(SIGUSR1);
+    log_deinit();
+
+    snprintf(expected, sizeof(expected),
+             "sig %d %i %u %x %X %p %ld %lld %zu %c %.3s %s %%\n", -42, 7,
+             42U, 0xbeefU, 0xbeefU, (void *)0x1234, -1L,
+             -9223372036854775807LL - 1, (size_t)123, 'c', "abcdef",
+             "(null)");
+
+    read_file(file, buf, sizeof(buf));
+    for (line = strtok(buf, "\n"); line != NULL;
+         line = strtok(NULL, "\n")) {
+        if (first == NULL) {
+            first = line;
+        } else if (strstr(line, " sig ") != NULL) {
+            /* the same timestamp format, to the minute */
+            ok(strncmp(line, first, 17) == 0 && line[20] == '.'
+                   && line[24] == ']',
+               "signal safe: timestamp");
+            ok(strncmp(strstr(line, " sig ") + 1, expected,
+                       strlen(expected) - 1)
+                   == 0,
+               "signal safe: conversions");
+            found = true;
+        }
+    }
+    ok(found, "signal safe: logged");
+
+    read_file(file, buf, sizeof(buf));
+    ok(strstr(buf, " unsupported 1 %f %d\n") != NULL,
+       "signal safe: unsupported conversion");
+    ok(strstr(buf, "not logged") == NULL, "signal safe: level");
+    ok(strstr(buf, "backtrace:\n") != NULL, "signal safe: backtrace");
+    ok(count_lines(file) > 5, "signal safe: backtrace frames");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    opts.format = LOG_FORMAT_JSON;
+    ok(log_init_opts(&opts), "signal safe: json init");
+    raise(SIGUSR1);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    ok(strncmp(buf, "{\"ts\":\"", 7) == 0
+           && strstr(buf, ",\"level\":\"warn\",\"file\":\"") != NULL
+           && strstr(buf, ",\"msg\":\"sig -42 ") != NULL
+           && strstr(buf, "backtrace:") != NULL
+           && strstr(buf, "\"msg\":\"[0] 0x") != NULL,
+       "signal safe: json");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    /* a memory map is written only where it is already mapped */
+    opts.format = LOG_FORMAT_TEXT;
+    opts.mmap = 64 * 1024;
+    ok(log_init_opts(&opts), "signal safe: mmap init");
+    raise(SIGUSR1);
+    log_info("before");
+    raise(SIGUSR1);
+    log_info("after");
+    log_deinit();
+
+    is_int(1, count_matches(file, " sig -42 "), "signal safe: mmap");
+    is_int(1, count_matches(file, " after\n"), "signal safe: mmap after");
+    ok(is_truncated(file), "signal safe: mmap truncated");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    sigaction(SIGUSR1, &old, NULL);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Logs a message from a thread named "worker 1" by log_set_thread_name().
+ */
+static void *
+named_writer(void *arg)
+{
+    (void)arg;
+
+    log_set_thread_name("worker 1");
+    log_info("named %ld", (long)syscall(SYS_gettid));
+
+    return NULL;
+}
+
+/*
+ * Check the thread tags of messages.
+ */
+static void
+test_thread(void)
+{
+    struct log_options opts;
+    pthread_t          thread;
+    pid_t              pid;
+    int                status;
+    char *             dir = test_tmpdir();
+    char *             file = tmp_path(dir, "log-thread");
+    char               buf[4096];
+    char               expected[64];
+    char *             p;
+    long               tid;
+    int                cpu;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.thread = true;
+
+    ok(log_init_opts(&opts), "thread: init");
+    log_info("main");
+    pthread_create(&thread, NULL, named_writer, NULL);
+    pthread_join(thread, NULL);
+
+    pid = fork();
+    if (pid == 0) {
+        log_info("child");
+        log_deinit();
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+
+    snprintf(expected, sizeof(expected), "] [%ld ", (long)getpid());
+    p = strstr(buf, expected);
+    ok(p != NULL, "thread: main thread id");
+    cpu = -1;
+    ok(p != NULL && sscanf(p + strlen(expected), "%d] ", &cpu) == 1
+           && cpu >= 0,
+       "thread: cpu");
+    ok(p != NULL && strstr(p, " main\n") != NULL, "thread: main message");
+
+    p = strstr(buf, " worker_1 ");
+    tid = 0;
+    ok(p != NULL, "thread: name");
+    ok(p != NULL && sscanf(strstr(p, " named ") + 7, "%ld", &tid) == 1
+           && tid != getpid(),
+       "thread: worker message");
+    snprintf(expected, sizeof(expected), "] [%ld worker_1 ", tid);
+    ok(strstr(buf, expected) != NULL, "thread: worker thread id");
+
+    snprintf(expected, sizeof(expected), "] [%ld ", (long)pid);
+    p = strstr(buf, expected);
+    ok(p != NULL && strstr(p, " child\n") != NULL,
+       "thread: child thread id after fork()");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    opts.format = LOG_FORMAT_JSON;
+    ok(log_init_opts(&opts), "thread: json init");
+    log_info("json");
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    snprintf(expected, sizeof(expected), "\",\"tid\":%ld,\"cpu\":",
+             (long)getpid());
+    ok(strstr(buf, expected) != NULL && strstr(buf, ",\"level\":") != NULL,
+       "thread: json");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    opts.format = LOG_FORMAT_LOGFMT;
+    ok(log_init_opts(&opts), "thread: logfmt init");
+    log_set_thread_name("main");
+    log_info("logfmt");
+    log_set_thread_name(NULL);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    snprintf(expected, sizeof(expected), " tid=%ld thread=main cpu=",
+             (long)getpid());
+    ok(strstr(buf, expected) != NULL, "thread: logfmt");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Logs a message at LOG_INFO, always from the same call site.
+ */
+static void
+log_info_site(int i)
+{
+    log_info("level %d", i);
+}
+
+/*
+ * Waits up to a second for log_threshold to become level.
+ */
+static bool
+wait_level(log_level_t level)
+{
+    struct timespec pause = {0, 1000000L};
+    int             i;
+
+    for (i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&log_threshold, __ATOMIC_RELAXED) == level) {
+            return true;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    return false;
+}
+
+/*
+ * Check changes of the level at run time.
+ */
+static void
+test_set_level(void)
+{
+    struct log_options opts;
+    struct sigaction   up;
+    struct sigaction   down;
+    char *             dir = test_tmpdir();
+    char *             file = tmp_path(dir, "log-set-level");
+    char               buf[4096];
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_NOTICE;
+    opts.filename = file;
+
+    ok(log_init_opts(&opts), "set level: init");
+    log_info_site(1);
+    ok(!log_loggable(LOG_INFO), "set level: info not loggable");
+
+    log_set_level(LOG_INFO);
+    is_int(LOG_INFO, log_threshold, "set level: threshold");
+    ok(log_loggable(LOG_INFO), "set level: info loggable");
+    log_info_site(2);
+
+    log_set_level(LOG_WARN);
+    log_info_site(3);
+    ok(!log_loggable(LOG_NOTICE), "set level: notice not loggable");
+
+    sigaction(SIGUSR1, NULL, &up);
+    sigaction(SIGUSR2, NULL, &down);
+    ok(log_level_signals(SIGUSR1, SIGUSR2), "set level: signals");
+
+    raise(SIGUSR1);
+    raise(SIGUSR1);
+    ok(wait_level(LOG_INFO), "set level: raised by signal");
+    log_info_site(4);
+
+    raise(SIGUSR2);
+    ok(wait_level(LOG_NOTICE), "set level: lowered by signal");
+    log_info_site(5);
+
+    raise(SIGUSR1);
+    raise(SIGUSR1);
+    raise(SIGUSR1);
+    ok(wait_level(LOG_DEBUG), "set level: raised to debug");
+    raise(SIGUSR1);
+    raise(SIGUSR2);
+    ok(wait_level(LOG_INFO), "set level: not raised past debug");
+
+    sigaction(SIGUSR1, &up, NULL);
+    sigaction(SIGUSR2, &down, NULL);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    ok(strstr(buf, " level 1\n") == NULL, "set level: below level");
+    ok(strstr(buf, " level 2\n") != NULL, "set level: raised");
+    ok(strstr(buf, " level 3\n") == NULL, "set level: lowered");
+    ok(strstr(buf, " level 4\n") != NULL, "set level: signal raised");
+    ok(strstr(buf, " level 5\n") == NULL, "set level: signal lowered");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    free(file);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Binds a datagram socket at path, as a stand-in syslog or journald.
+ */
+static int
+bind_dgram(const char *path)
+{
+    struct sockaddr_un addr;
+    int                fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    memset(&addr, 0, sizeof(addr)); /* NOLINT */
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path); /* NOLINT */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Returns the number of datagrams waiting on fd, receiving them.
+ */
+static int
+count_dgrams(int fd)
+{
+    char buf[LOG_MAX_LEN * 2];
+    int  n = 0;
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Check the syslog and journald datagram sinks, and their batching.
+ */
+static void
+test_datagram(void)
+{
+    struct log_options      opts;
+    struct log_sink_options sink;
+    char *                  dir = test_tmpdir();
+    char *                  file = tmp_path(dir, "log-dgram");
+    char *                  sock = tmp_path(dir, "log-dgram-sock");
+    char                    buf[LOG_MAX_LEN * 2];
+    char *                  p;
+    ssize_t                 n;
+    uint64_t                mlen;
+    int                     server = bind_dgram(sock);
+    int                     i;
+
+    ok(server >= 0, "datagram: bind socket");
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = LOG_SINK_SYSLOG;
+    sink.level = LOG_INFO;
+    sink.filename = sock;
+    sink.ident = "test app";
+
+    ok(log_init_opts(&opts), "datagram: syslog init");
+    ok(log_add_sink(&sink), "datagram: add syslog");
+    log_notice("syslog %d", 1);
+
+    n = recv(server, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+    buf[n > 0 ? n : 0] = '\0';
+    is_int(0, strncmp(buf, "<13>1 ", 6), "datagram: syslog priority");
+    /* "<13>1 YYYY-mm-ddTHH:MM:SS.uuuuuuZ " */
+    ok(n > 34 && buf[10] == '-' && buf[16] == 'T' && buf[25] == '.'
+           && buf[32] == 'Z' && buf[33] == ' ',
+       "datagram: syslog timestamp");
+    p = strstr(buf, " test_app ");
+    ok(p != NULL, "datagram: syslog app name");
+    snprintf(buf + sizeof(buf) / 2, sizeof(buf) / 2, " test_app %ld - - ",
+             (long)getpid());
+    ok(p != NULL && strncmp(p, buf + sizeof(buf) / 2,
+                            strlen(buf + sizeof(buf) / 2))
+                        == 0,
+       "datagram: syslog header");
+    ok(strstr(buf, "log-t.c:") != NULL && strstr(buf, " syslog 1") != NULL
+           && strchr(buf, '[') == NULL,
+       "datagram: syslog message without timestamp");
+    log_deinit();
+
+    /* journald's native protocol, in batches of 4 */
+    sink.type = LOG_SINK_JOURNAL;
+    sink.ident = NULL;
+    sink.buffer = 4;
+
+    ok(log_init_opts(&opts), "datagram: journal init");
+    ok(log_add_sink(&sink), "datagram: add journal");
+    for (i = 0; i < 3; i++) {
+        log_error("journal %d", i);
+    }
+    is_int(0, count_dgrams(server), "datagram: batched");
+    log_flush();
+
+    n = recv(server, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+    buf[n > 0 ? n : 0] = '\0';
+    is_int(0, strncmp(buf, "PRIORITY=3\nSYSLOG_FACILITY=1\n", 29),
+           "datagram: journal priority");
+    /* the program may be run by a libtool wrapper, as lt-log-t */
+    ok(strstr(buf, "\nSYSLOG_IDENTIFIER=") != NULL
+           && strstr(buf, "log-t\nSYSLOG_PID=") != NULL,
+       "datagram: journal identifier");
+    p = strstr(buf, "\nMESSAGE\n");
+    ok(p != NULL, "datagram: journal message");
+    if (p != NULL) {
+        p += 9;
+        for (i = 7, mlen = 0; i >= 0; i--) {
+            mlen = mlen << 8 | (unsigned char)p[i];
+        }
+        p += 8;
+        ok(mlen + 1 == (uint64_t)(buf + n - p) && p[mlen] == '\n',
+           "datagram: journal message length");
+        ok(strncmp(p + mlen - 10, " journal 0", 10) == 0,
+           "datagram: journal message text");
+    }
+    is_int(2, count_dgrams(server), "datagram: batch flushed");
+
+    for (i = 0; i < 5; i++) {
+        log_info("journal %d", i);
+    }
+    is_int(4, count_dgrams(server), "datagram: full batch sent");
+    log_crit("journal crit");
+    is_int(2, count_dgrams(server), "datagram: batch sent at LOG_CRIT");
+    log_info("journal last");
+    log_deinit();
+    is_int(1, count_dgrams(server), "datagram: batch sent by log_deinit()");
+
+    ok(log_init_opts(&opts), "datagram: long init");
+    ok(log_add_sink(&sink), "datagram: add long");
+    log_info("journal %d", 0);
+    memset(buf, 'x', LOG_MAX_LEN + 100); /* NOLINT */
+    buf[LOG_MAX_LEN + 100] = '\0';
+    log_info("%s", buf);
+    log_deinit();
+
+    n = recv(server, buf, sizeof(buf), MSG_DONTWAIT);
+    ok(n > 0 && memmem(buf, (size_t)n, " journal 0", 10) != NULL,
+       "datagram: batch sent before a long message");
+    n = recv(server, buf, sizeof(buf), MSG_DONTWAIT);
+    ok(n > LOG_MAX_LEN + 100, "datagram: long message sent whole");
+    is_int(0, count_dgrams(server), "datagram: long messages");
+
+    close(server);
+    is_int(0, unlink(file), "unlink %s", file);
+    is_int(0, unlink(sock), "unlink %s", sock);
+
+    free(file);
+    free(sock);
+    test_tmpdir_free(dir);
+}
+
+/*
+ * Logs the same message n times from one call site.
+ */
+static void
+log_same(int n, unsigned pause_ms)
+{
+    struct timespec pause = {0, (long)pause_ms * 1000000L};
+    int             i;
+
+    for (i = 0; i < n; i++) {
+        if (i > 0 && pause_ms > 0) {
+            nanosleep(&pause, NULL);
+        }
+        log_info("same %d", 42);
+    }
+}
+
+/*
+ * Check the suppression of repeated messages.
+ */
+static void
+test_dedup(void)
+{
+    struct log_options      opts;
+    struct log_sink_options sink;
+    char *                  dir = test_tmpdir();
+    char *                  file = tmp_path(dir, "log-dedup");
+    char *                  sfile = tmp_path(dir, "log-dedup-sink");
+    char                    buf[4096];
+    char *                  p;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.level = LOG_INFO;
+    opts.filename = file;
+    opts.dedup_ms = 60000;
+
+    ok(log_init_opts(&opts), "dedup: init");
+    log_same(5, 0);
+    log_info("different");
+    log_same(3, 0);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    is_int(5, count_lines(file), "dedup: lines");
+    p = strstr(buf, " same 42\n");
+    ok(p != NULL, "dedup: first message");
+    p = p != NULL ? strstr(p, "] last message repeated 4 times\n") : NULL;
+    ok(p != NULL, "dedup: repeats reported");
+    p = p != NULL ? strstr(p, " different\n") : NULL;
+    ok(p != NULL, "dedup: different message");
+    p = p != NULL ? strstr(p, " same 42\n") : NULL;
+    p = p != NULL ? strstr(p, "] last message repeated 2 times\n") : NULL;
+    ok(p != NULL, "dedup: repeats reported by log_deinit()");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    /* the second repeat is reported once the first is 1ms old */
+    opts.dedup_ms = 1;
+    ok(log_init_opts(&opts), "dedup: timeout init");
+    log_same(3, 2);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    is_int(2, count_lines(file), "dedup: timeout lines");
+    ok(strstr(buf, "] last message repeated 2 times\n") != NULL,
+       "dedup: timeout");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    opts.format = LOG_FORMAT_JSON;
+    ok(log_init_opts(&opts), "dedup: json init");
+    log_same(2, 0);
+    log_deinit();
+
+    read_file(file, buf, sizeof(buf));
+    ok(strstr(buf, ",\"level\":\"info\",\"msg\":\"last message repeated 1 "
+                   "times\"}\n")
+           != NULL,
+       "dedup: json");
+    is_int(0, unlink(file), "unlink %s", file);
+
+    /* a sink suppresses repeats, and the log does not */
+    opts.format = LOG_FORMAT_TEXT;
+    opts.dedup_ms = 0;
+    memset(&sink, 0, sizeof(sink));
+    sink.type = LOG_SINK_FILE;
+    sink.level = LOG_INFO;
+    sink.filename = sfile;
+    sink.dedup_ms = 60000;
+
+    ok(log_init_opts(&opts), "dedup: sink init");
+    ok(log_add_sink(&sink), "dedup: add sink");
+    log_same(3, 0);
+    log_flush();
+    is_int(2, count_lines(sfile), "dedup: repeats reported by log_flush()");
+    log_deinit();
+
+    is_int(3, count_lines(file), "dedup: log lines");
+    is_int(2, count_lines(sfile), "dedup: sink lines");
+    read_file(sfile, buf, sizeof(buf));
+    ok(strstr(buf, "] last message repeated 2 times\n") != NULL,
+       "dedup: sink repeats");
+    is_int(0, unlink(file), "unlink %s", file);
+    is_int(0, unlink(sfile), "unlink %s", sfile);
+
+    free(file);
+    free(sfile);
+    test_tmpdir_free(dir);
+}
+
 int
 main(void)
 {
@@ -99,6 +2214,35 @@ main(void)
 
     test_loggable();
     test_output();
+    test_precision(LOG_PRECISION_MSEC, 3, "msec");
+    test_precision(LOG_PRECISION_USEC, 6, "usec");
+    test_precision(LOG_PRECISION_NSEC, 9, "nsec");
+    test_clock(LOG_CLOCK_REALTIME, "realtime");
+    test_clock(LOG_CLOCK_REALTIME_COARSE, "realtime coarse");
+    test_clock(LOG_CLOCK_MONOTONIC, "monotonic");
+    test_clock(LOG_CLOCK_TSC, "tsc");
+    test_buffered();
+    test_module_levels();
+    test_limited();
+    test_rotate();
+    test_mmap();
+    test_mmap_full();
+    test_binary();
+    test_binary_rotate();
+    test_recorder();
+    test_kv();
+    test_sinks();
+    test_stats();
+    test_long(0, 0, "sync");
+    test_long(4096, 0, "buffered");
+    test_long(0, 8, "async");
+    test_signal_safe();
+    test_dedup();
+    test_datagram();
+    test_set_level();
+    test_thread();
+    test_async(LOG_OVERFLOW_BLOCK, 8, "block");
+    test_async(LOG_OVERFLOW_DROP, 8, "drop");
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,170 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <pthread.h>
+#include <sched.h>
+#include <test/tap/basic.h>
+#include <util/buffer.h>
+
+/* bytes pushed through the ring by the stress test */
+#define STRESS_TOTAL (16 * 1024 * 1024)
+
+/*
+ * Basic operation of a spsc_ring.
+ */
+static void
+test_basic(void)
+{
+    struct spsc_ring *ring;
+    uint8_t           byte = 'a';
+
+    ring = spsc_ring_init(1);
+
+    ok(!spsc_ring_get(ring, &byte), "unreadable");
+    ok(byte == 'a', "unmodified");
+    ok(spsc_ring_put(ring, 'z'), "put");
+    ok(!spsc_ring_put(ring, 'y'), "at capacity");
+    ok(spsc_ring_get(ring, &byte), "get");
+    ok(byte == 'z', "result");
+
+    spsc_ring_deinit(ring);
+}
+
+/*
+ * Test capacity rounding and wrapping bulk transfers.
+ */
+static void
+test_wrap(void)
+{
+    struct spsc_ring *ring;
+    uint8_t           src[26];
+    uint8_t           dst[26];
+    size_t            i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = 'a' + i;
+    }
+
+    ring = spsc_ring_init(13); /* rounded up to 16 */
+
+    is_int(16, spsc_ring_put_n(ring, src, sizeof(src)), "put to capacity");
+    is_int(10, spsc_ring_get_n(ring, dst, 10), "get 10 bytes");
+    ok(memcmp(dst, src, 10) == 0, "read the first 10 letters");
+
+    is_int(10, spsc_ring_put_n(ring, src + 16, 10), "put across the end");
+    is_int(16, spsc_ring_get_n(ring, dst + 10, 16), "get across the end");
+    ok(memcmp(dst, src, sizeof(src)) == 0, "read all letters in order");
+    is_int(0, spsc_ring_get_n(ring, dst, 1), "drained");
+
+    spsc_ring_deinit(ring);
+}
+
+/*
+ * Producer half of the stress test: writes a repeating sequence in
+ * varying span sizes.
+ */
+static void *
+producer(void *arg)
+{
+    struct spsc_ring *ring = arg;
+    uint8_t           span[97];
+    size_t            sent = 0;
+    size_t            len;
+    size_t            n;
+    size_t            i;
+
+    while (sent < STRESS_TOTAL) {
+        len = 1 + sent % sizeof(span);
+        if (len > STRESS_TOTAL - sent) {
+            len = STRESS_TOTAL - sent;
+        }
+
+        for (i = 0; i < len; i++) {
+            span[i] = (uint8_t)((sent + i) % 251);
+        }
+
+        for (i = 0; i < len; i += n) {
+            n = spsc_ring_put_n(ring, span + i, len - i);
+            if (n == 0) {
+                sched_yield();
+            }
+        }
+
+        sent += len;
+    }
+
+    return NULL;
+}
+
+/*
+ * Stress a spsc_ring with a producer and consumer on separate
+ * threads, verifying every byte arrives in order.
+ */
+static void
+test_stress(void)
+{
+    struct spsc_ring *ring;
+    pthread_t         thread;
+    uint8_t           buf[61];
+    size_t            received = 0;
+    size_t            errors = 0;
+    size_t            n;
+    size_t            i;
+
+    ring = spsc_ring_init(256);
+
+    is_int(0, pthread_create(&thread, NULL, producer, ring),
+           "start producer");
+
+    while (received < STRESS_TOTAL) {
+        n = spsc_ring_get_n(ring, buf, sizeof(buf));
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (buf[i] != (uint8_t)((received + i) % 251)) {
+                errors++;
+            }
+        }
+
+        received += n;
+    }
+
+    is_int(0, pthread_join(thread, NULL), "join producer");
+    is_int(STRESS_TOTAL, received, "received every byte");
+    is_int(0, errors, "received bytes in order");
+    is_int(0, spsc_ring_get_n(ring, buf, sizeof(buf)), "drained");
+
+    spsc_ring_deinit(ring);
+}
+
+int
+main(void)
+{
+    plan_lazy();
+
+    test_basic();
+    test_wrap();
+    test_stress();
+
+    return EXIT_SUCCESS;
+}
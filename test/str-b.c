@@ -0,0 +1,63 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <test/bench/bench.h>
+
+#include "str.h"
+
+/* calls per benchmark */
+#define CALLS (1000 * 1000)
+
+/* defeats constant folding of the arguments */
+static volatile int bench_seed = 977;
+
+/*
+ * Formats CALLS typical log messages with formatter, which is
+ * scnprintf() or scnformat().
+ */
+#define BENCH_FORMAT(_name, _formatter)                                    \
+    do {                                                                   \
+        char     _buf[256];                                                \
+        uint64_t _start = bench_now();                                     \
+        size_t   _len = 0;                                                 \
+        int      _i;                                                       \
+                                                                           \
+        for (_i = 0; _i < CALLS; _i++) {                                   \
+            _len += _formatter(_buf, sizeof(_buf),                         \
+                               "request %d served in %zu us from %s at %p" \
+                               " (0x%x)",                                  \
+                               _i, (size_t)(_i % bench_seed), "cache",     \
+                               (void *)&_i, (unsigned)_i);                 \
+        }                                                                  \
+                                                                           \
+        bench_report(_name, CALLS, "call", bench_now() - _start);          \
+        if (_len == 0) {                                                   \
+            printf("%s: no output\n", _name);                              \
+        }                                                                  \
+    } while (0)
+
+int
+main(void)
+{
+    BENCH_FORMAT("scnprintf (vsnprintf)", scnprintf);
+    BENCH_FORMAT("scnformat", scnformat);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,112 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <portable/system.h>
+#include <test/tap/basic.h>
+#include <wchar.h>
+
+#include "str.h"
+
+/*
+ * Check scnformat() output matches scnprintf() for a buffer of size
+ * bytes.
+ */
+static void __attribute__((format(printf, 2, 3)))
+check(size_t size, const char *fmt, ...)
+{
+    char    expected[256];
+    char    actual[256];
+    int     nexpected;
+    int     nactual;
+    va_list args;
+    va_list copy;
+
+    expected[0] = actual[0] = '\0'; /* untouched if size is 0 */
+
+    va_start(args, fmt);
+    va_copy(copy, args);
+    nexpected = vscnprintf(expected, size, fmt, args);
+    nactual = vscnformat(actual, size, fmt, copy);
+    va_end(copy);
+    va_end(args);
+
+    is_int(nexpected, nactual, "%s (%zu): length", fmt, size);
+    is_string(expected, actual, "%s (%zu): output", fmt, size);
+}
+
+static void
+test_conversions(void)
+{
+    int                  i = 42;
+    char                 s[] = "string";
+    const char *volatile null = NULL; /* hide NULL from -Wformat */
+
+    check(256, "plain text");
+    check(256, "%s and %s", "one", "two");
+    check(256, "%s|%.2s|%.6s", null, null, null);
+    check(256, "%.3s|%.*s", "abcdef", 4, "abcdef");
+    check(256, "%.*s", -1, s);
+    check(256, "%d %d %d %i", 0, -1, INT_MAX, INT_MIN);
+    check(256, "%ld %lld %zd", LONG_MIN, LLONG_MAX, (ssize_t)-7);
+    check(256, "%u %lu %llu %zu", UINT_MAX, ULONG_MAX, ULLONG_MAX,
+          (size_t)123456789);
+    check(256, "%x %X %lx %llX %zx", 0xdeadbeefu, 0xabcdefu, 0x10UL,
+          0xfedcba9876543210ULL, (size_t)0xf);
+    check(256, "%#x %#X %#x", 255u, 255u, 0u);
+    check(256, "%p %p", (void *)&i, (void *)NULL);
+    check(256, "%c%c%c", 'a', 'b', 'c');
+    check(256, "100%% %%");
+    check(256, "[%5d] [%-5d] [%05d] [%05d]", 42, 42, 42, -42);
+    check(256, "[%8s] [%-8s] [%*s] [%-*s] [%*d]", s, s, 10, s, 10, s, -6,
+          7);
+    check(256, "[%08x] [%#08x] [%20p] [%-3c]", 0xabu, 0xabu, (void *)&i, 'z');
+}
+
+static void
+test_fallback(void)
+{
+    check(256, "%d then %.2f then %s", 1, 2.5, "three");
+    check(256, "%s %+d % d %hd", "flags", 1, 2, (short)70000);
+    check(256, "%.5d %o %e", 42, 8u, 1.0);
+    check(256, "%ls %lc", L"wide", (wint_t)L'c');
+}
+
+static void
+test_truncation(void)
+{
+    size_t size;
+
+    for (size = 1; size < 24; size++) {
+        check(size, "%s=%d %x [%5s]%%", "key", -12345, 0xabcdu, "v");
+    }
+
+    check(0, "%s", "nothing");
+    check(8, "%d and %f", 123456789, 1.5);
+}
+
+int
+main(void)
+{
+    plan_lazy();
+
+    test_conversions();
+    test_fallback();
+    test_truncation();
+
+    return EXIT_SUCCESS;
+}
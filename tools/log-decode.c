@@ -0,0 +1,272 @@
+/*
+ * libutil - C utilities
+ *
+ * Copyright (C) 2020 Brandon Mitchell <brandon@thewholedoubt.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * log-decode - format a binary log (LOG_FORMAT_BINARY) as text
+ *
+ * usage: log-decode [file]
+ *
+ * Reads the binary log from file, or from stdin if no file is given,
+ * and writes each message to stdout in the text format of log_write().
+ */
+
+#include <errno.h>
+#include <portable/system.h>
+#include <time.h>
+#include <util/log.h>
+
+#include "log-fmt.h"
+
+/* a call site defined by a LOG_REC_SITE record */
+struct site {
+    char *         file;
+    char *         fmt;
+    uint32_t       line;
+    int            nargs;
+    struct log_arg args[LOG_FMT_MAX_ARGS];
+};
+
+/* bound of site ids, far beyond the sites of any program */
+#define MAX_SITES (1U << 24)
+
+static struct site *sites;     /* indexed by site id */
+static size_t       nsites;    /* capacity of sites */
+static int          precision; /* log_precision_t of the session */
+
+/*
+ * Forgets every site, as at the start of a session.
+ */
+static void
+reset_sites(void)
+{
+    size_t i;
+
+    for (i = 0; i < nsites; i++) {
+        free(sites[i].file);
+        free(sites[i].fmt);
+    }
+
+    memset(sites, 0, sizeof(struct site) * nsites); /* NOLINT */
+}
+
+static void
+print_prefix(int64_t sec, uint32_t nsec, const char *file, uint32_t line)
+{
+    char      buf[32];
+    time_t    t = (time_t)sec;
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+
+    if (precision == LOG_PRECISION_NSEC) {
+        printf("[%s.%09u] %s:%u ", buf, nsec, file, line);
+    } else if (precision == LOG_PRECISION_USEC) {
+        printf("[%s.%06u] %s:%u ", buf, nsec / 1000, file, line);
+    } else {
+        printf("[%s.%03u] %s:%u ", buf, nsec / 1000000, file, line);
+    }
+}
+
+/*
+ * Prints the message of a LOG_REC_EVENT with arguments data.
+ */
+static bool
+print_event(const struct site *site, const uint8_t *data, size_t len)
+{
+    static char buf[UINT16_MAX * 2];
+    int         n;
+
+    n = log_fmt_format(buf, sizeof(buf), site->fmt, site->args, site->nargs,
+                       (const char *)data, len, snprintf);
+    if (n < 0) {
+        return false;
+    }
+
+    fwrite(buf, 1, (size_t)n, stdout);
+
+    return true;
+}
+
+/*
+ * Decodes one record of len bytes (including its header).
+ */
+static bool
+decode(const struct log_rec *rec, const uint8_t *body, size_t len)
+{
+    struct site *site;
+    uint32_t     id;
+    uint32_t     line;
+    uint32_t     nsec;
+    uint32_t     magic;
+    int64_t      sec;
+    const char * file;
+    const char * fmt;
+    size_t       flen;
+    size_t       n;
+
+    switch (rec->type) {
+    case LOG_REC_SESSION:
+        if (len < 8) {
+            return false;
+        }
+        memcpy(&magic, body, 4); /* NOLINT */
+        if (magic != LOG_BIN_MAGIC || body[4] != LOG_BIN_VERSION
+            || body[6] != sizeof(long) || body[7] != sizeof(void *)) {
+            fprintf(stderr, "log-decode: incompatible session\n");
+            return false;
+        }
+        precision = body[5];
+        reset_sites();
+        return true;
+
+    case LOG_REC_SITE:
+        if (len < 8) {
+            return false;
+        }
+        memcpy(&id, body, 4);       /* NOLINT */
+        memcpy(&line, body + 4, 4); /* NOLINT */
+        file = (const char *)body + 8;
+        flen = strnlen(file, len - 8);
+        if (flen + 1 >= len - 8) {
+            return false;
+        }
+        fmt = file + flen + 1;
+
+        if (id >= MAX_SITES) {
+            fprintf(stderr, "log-decode: site id %u out of range\n", id);
+            return false;
+        }
+
+        if (id >= nsites) {
+            n = (size_t)id + 64;
+            site = realloc(sites, sizeof(struct site) * n);
+            if (site == NULL) {
+                return false;
+            }
+            memset(site + nsites, 0, /* NOLINT */
+                   sizeof(struct site) * (n - nsites));
+            sites = site;
+            nsites = n;
+        }
+
+        site = &sites[id];
+        free(site->file);
+        free(site->fmt);
+        site->file = strdup(file);
+        site->fmt = strndup(fmt, len - 8 - flen - 1);
+        site->line = line;
+        site->nargs =
+            log_fmt_parse(site->fmt, site->args, LOG_FMT_MAX_ARGS);
+        return true; /* unparsable sites log only text records */
+
+    case LOG_REC_EVENT:
+        if (len < 16) {
+            return false;
+        }
+        memcpy(&id, body, 4);        /* NOLINT */
+        memcpy(&sec, body + 4, 8);   /* NOLINT */
+        memcpy(&nsec, body + 12, 4); /* NOLINT */
+        if (id >= nsites || sites[id].fmt == NULL || sites[id].nargs < 0) {
+            /* e.g. its site record was cut off; skip it */
+            fprintf(stderr, "log-decode: event of undefined site %u\n",
+                    id);
+            return true;
+        }
+        site = &sites[id];
+        print_prefix(sec, nsec, site->file, site->line);
+        if (!print_event(site, body + 16, len - 16)) {
+            return false;
+        }
+        putchar('\n');
+        return true;
+
+    case LOG_REC_TEXT:
+        if (len < 16) {
+            return false;
+        }
+        memcpy(&sec, body, 8);       /* NOLINT */
+        memcpy(&nsec, body + 8, 4);  /* NOLINT */
+        memcpy(&line, body + 12, 4); /* NOLINT */
+        file = (const char *)body + 16;
+        flen = strnlen(file, len - 16);
+        if (flen >= len - 16) {
+            return false;
+        }
+        print_prefix(sec, nsec, file, line);
+        fwrite(file + flen + 1, 1, len - 16 - flen - 1, stdout);
+        putchar('\n');
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    FILE *         fp = stdin;
+    struct log_rec rec;
+    uint8_t        body[UINT16_MAX];
+    size_t         len;
+    long           offset = 0;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: log-decode [file]\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 2) {
+        fp = fopen(argv[1], "rb");
+        if (fp == NULL) {
+            fprintf(stderr, "log-decode: %s: %s\n", argv[1], strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.len < sizeof(rec)) {
+            fprintf(stderr, "log-decode: bad record at offset %ld\n", offset);
+            return EXIT_FAILURE;
+        }
+
+        len = rec.len - sizeof(rec);
+        if (fread(body, 1, len, fp) != len) {
+            fprintf(stderr, "log-decode: truncated record at offset %ld\n",
+                    offset);
+            return EXIT_FAILURE;
+        }
+
+        if (!decode(&rec, body, len)) {
+            fprintf(stderr, "log-decode: bad record at offset %ld\n", offset);
+            return EXIT_FAILURE;
+        }
+
+        offset += rec.len;
+    }
+
+    reset_sites();
+    free(sites);
+
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    return EXIT_SUCCESS;
+}